@@ -110,6 +110,10 @@ static JSContext *JS_NewCustomContext(JSRuntime *rt)
     ctx = JS_NewContext(rt);
     if (!ctx)
         return NULL;
+    if (JS_AddIntrinsicTextEncoding(ctx)) {
+        JS_FreeContext(ctx);
+        return NULL;
+    }
     /* system modules */
     js_init_module_std(ctx, "std");
     js_init_module_os(ctx, "os");
@@ -288,6 +292,13 @@ static size_t get_suffixed_size(const char *str)
 
 #define PROG_NAME "qjs"
 
+/* average number of bytes between two allocation samples */
+#define ALLOC_SAMPLE_INTERVAL (32 * 1024)
+/* CPU profiling sampling interval in us */
+#define CPU_PROFILE_INTERVAL 1000
+/* maximum number of recorded trace events */
+#define TRACE_MAX_EVENTS (1 << 18)
+
 void help(void)
 {
     printf("QuickJS version " CONFIG_VERSION "\n"
@@ -302,8 +313,14 @@ void help(void)
            "    --std          make 'std' and 'os' available to the loaded script\n"
            "-T  --trace        trace memory allocation\n"
            "-d  --dump         dump the memory usage stats\n"
+           "    --heap-snapshot file  write a heap snapshot to 'file' before exiting\n"
+           "    --alloc-profile file  write the sampled allocations to 'file' in folded stack format\n"
+           "    --cpu-prof file   write a CPU profile to 'file' (Chrome .cpuprofile format)\n"
+           "    --trace-events file  write the most recent function calls to 'file' (Chrome trace event format)\n"
+           "    --opcode-stats    dump the executed opcode statistics (qjs-prof only)\n"
            "    --memory-limit n  limit the memory usage to 'n' bytes (SI suffixes allowed)\n"
            "    --stack-size n    limit the stack size to 'n' bytes (SI suffixes allowed)\n"
+           "    --gc-step-budget n  bound the automatic GC pauses to about 'n' objects\n"
            "    --no-unhandled-rejection  ignore unhandled promise rejections\n"
            "-s                    strip all the debug info\n"
            "    --strip-source    strip the source code\n"
@@ -331,6 +348,12 @@ int main(int argc, char **argv)
     int i, include_count = 0;
     int strip_flags = 0;
     size_t stack_size = 0;
+    size_t gc_step_budget = 0;
+    const char *heap_snapshot_filename = NULL;
+    const char *alloc_profile_filename = NULL;
+    const char *cpu_profile_filename = NULL;
+    const char *trace_filename = NULL;
+    int dump_opcode_stats = 0;
 
     /* cannot use getopt because we want to pass the command line to
        the script */
@@ -401,6 +424,42 @@ int main(int argc, char **argv)
                 dump_memory++;
                 continue;
             }
+            if (!strcmp(longopt, "heap-snapshot")) {
+                if (optind >= argc) {
+                    fprintf(stderr, "expecting filename");
+                    exit(1);
+                }
+                heap_snapshot_filename = argv[optind++];
+                continue;
+            }
+            if (!strcmp(longopt, "alloc-profile")) {
+                if (optind >= argc) {
+                    fprintf(stderr, "expecting filename");
+                    exit(1);
+                }
+                alloc_profile_filename = argv[optind++];
+                continue;
+            }
+            if (!strcmp(longopt, "cpu-prof")) {
+                if (optind >= argc) {
+                    fprintf(stderr, "expecting filename");
+                    exit(1);
+                }
+                cpu_profile_filename = argv[optind++];
+                continue;
+            }
+            if (!strcmp(longopt, "trace-events")) {
+                if (optind >= argc) {
+                    fprintf(stderr, "expecting filename");
+                    exit(1);
+                }
+                trace_filename = argv[optind++];
+                continue;
+            }
+            if (!strcmp(longopt, "opcode-stats")) {
+                dump_opcode_stats = 1;
+                continue;
+            }
             if (opt == 'T' || !strcmp(longopt, "trace")) {
                 trace_memory++;
                 continue;
@@ -425,6 +484,14 @@ int main(int argc, char **argv)
                 memory_limit = get_suffixed_size(argv[optind++]);
                 continue;
             }
+            if (!strcmp(longopt, "gc-step-budget")) {
+                if (optind >= argc) {
+                    fprintf(stderr, "expecting GC step budget");
+                    exit(1);
+                }
+                gc_step_budget = get_suffixed_size(argv[optind++]);
+                continue;
+            }
             if (!strcmp(longopt, "stack-size")) {
                 if (optind >= argc) {
                     fprintf(stderr, "expecting stack size");
@@ -464,7 +531,34 @@ int main(int argc, char **argv)
         JS_SetMemoryLimit(rt, memory_limit);
     if (stack_size != 0)
         JS_SetMaxStackSize(rt, stack_size);
+    if (gc_step_budget != 0)
+        JS_SetGCStepBudget(rt, gc_step_budget > INT32_MAX ? INT32_MAX : gc_step_budget);
     JS_SetStripInfo(rt, strip_flags);
+    if (alloc_profile_filename) {
+        if (JS_StartAllocationSampling(rt, ALLOC_SAMPLE_INTERVAL)) {
+            fprintf(stderr, "qjs: cannot start the allocation sampling\n");
+            exit(2);
+        }
+    }
+    if (cpu_profile_filename) {
+        if (JS_StartProfiling(rt) ||
+            js_std_set_profiling_timer(rt, CPU_PROFILE_INTERVAL)) {
+            fprintf(stderr, "qjs: cannot start the CPU profiling\n");
+            exit(2);
+        }
+    }
+    if (trace_filename) {
+        if (JS_StartTracing(rt, TRACE_MAX_EVENTS, 1, 0)) {
+            fprintf(stderr, "qjs: cannot start the tracing\n");
+            exit(2);
+        }
+    }
+    if (dump_opcode_stats) {
+        if (JS_EnableOpcodeStats(rt, TRUE)) {
+            fprintf(stderr, "qjs: opcode statistics are not available in this build (use qjs-prof)\n");
+            exit(2);
+        }
+    }
     js_std_set_worker_new_context_func(JS_NewCustomContext);
     js_std_init_handlers(rt);
     ctx = JS_NewCustomContext(rt);
@@ -526,6 +620,55 @@ int main(int argc, char **argv)
         js_std_loop(ctx);
     }
 
+    if (cpu_profile_filename) {
+        FILE *f;
+        js_std_set_profiling_timer(rt, 0);
+        f = fopen(cpu_profile_filename, "w");
+        if (!f) {
+            perror(cpu_profile_filename);
+        } else {
+            if (JS_WriteCPUProfile(rt, f) < 0)
+                fprintf(stderr, "qjs: could not write the CPU profile\n");
+            fclose(f);
+        }
+    }
+    if (trace_filename) {
+        FILE *f;
+        f = fopen(trace_filename, "w");
+        if (!f) {
+            perror(trace_filename);
+        } else {
+            if (JS_WriteTrace(rt, f) < 0)
+                fprintf(stderr, "qjs: could not write the trace\n");
+            fclose(f);
+        }
+    }
+    if (alloc_profile_filename) {
+        FILE *f;
+        f = fopen(alloc_profile_filename, "w");
+        if (!f) {
+            perror(alloc_profile_filename);
+        } else {
+            if (JS_WriteAllocationProfile(rt, f) < 0)
+                fprintf(stderr, "qjs: could not write the allocation profile\n");
+            fclose(f);
+        }
+    }
+    if (heap_snapshot_filename) {
+        FILE *f;
+        f = fopen(heap_snapshot_filename, "w");
+        if (!f) {
+            perror(heap_snapshot_filename);
+        } else {
+            if (JS_WriteHeapSnapshot(rt, f) < 0)
+                fprintf(stderr, "qjs: could not write the heap snapshot\n");
+            fclose(f);
+        }
+    }
+    if (dump_opcode_stats) {
+        JS_EnableOpcodeStats(rt, FALSE);
+        JS_DumpOpcodeStats(rt, stdout);
+    }
     if (dump_memory) {
         JSMemoryUsage stats;
         JS_ComputeMemoryUsage(rt, &stats);
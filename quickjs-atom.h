@@ -232,6 +232,8 @@ DEF(DataView, "DataView")
 DEF(BigInt, "BigInt")
 DEF(WeakRef, "WeakRef")
 DEF(FinalizationRegistry, "FinalizationRegistry")
+DEF(TextEncoder, "TextEncoder")
+DEF(TextDecoder, "TextDecoder")
 DEF(Map, "Map")
 DEF(Set, "Set") /* Map + 1 */
 DEF(WeakMap, "WeakMap") /* Map + 2 */
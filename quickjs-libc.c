@@ -1355,14 +1355,14 @@ static JSValue js_std_file_getline(JSContext *ctx, JSValueConst this_val,
     return obj;
 }
 
-/* XXX: could use less memory and go faster */
+/* the file is decoded by chunks of 4096 bytes */
 static JSValue js_std_file_readAsString(JSContext *ctx, JSValueConst this_val,
                                         int argc, JSValueConst *argv)
 {
     FILE *f = js_std_file_get(ctx, this_val);
-    int c;
-    DynBuf dbuf;
-    JSValue obj;
+    uint8_t buf[4096];
+    JSStringBuilder *sb;
+    size_t len;
     uint64_t max_size64;
     size_t max_size;
     JSValueConst max_size_val;
@@ -1382,20 +1382,23 @@ static JSValue js_std_file_readAsString(JSContext *ctx, JSValueConst this_val,
             max_size = max_size64;
     }
 
-    js_std_dbuf_init(ctx, &dbuf);
+    sb = JS_NewStringBuilder(ctx, 0);
+    if (!sb)
+        return JS_EXCEPTION;
     while (max_size != 0) {
-        c = fgetc(f);
-        if (c == EOF)
+        len = sizeof(buf);
+        if (len > max_size)
+            len = max_size;
+        len = fread(buf, 1, len, f);
+        if (len == 0)
             break;
-        if (dbuf_putc(&dbuf, c)) {
-            dbuf_free(&dbuf);
+        if (JS_StringBuilderPutUTF8(sb, (const char *)buf, len)) {
+            JS_FreeStringBuilder(sb);
             return JS_EXCEPTION;
         }
-        max_size--;
+        max_size -= len;
     }
-    obj = JS_NewStringLen(ctx, (const char *)dbuf.buf, dbuf.size);
-    dbuf_free(&dbuf);
-    return obj;
+    return JS_StringBuilderFinish(sb);
 }
 
 static JSValue js_std_file_getByte(JSContext *ctx, JSValueConst this_val,
@@ -2910,7 +2913,11 @@ static JSValue js_os_sleep(JSContext *ctx, JSValueConst this_val,
 
         ts.tv_sec = delay / 1000;
         ts.tv_nsec = (delay % 1000) * 1000000;
-        ret = js_get_errno(nanosleep(&ts, NULL));
+        /* sleep the remaining time if interrupted by a signal
+           (e.g. SIGPROF when profiling) */
+        do {
+            ret = js_get_errno(nanosleep(&ts, &ts));
+        } while (ret == -EINTR);
     }
 #endif
     return JS_NewInt32(ctx, ret);
@@ -3585,6 +3592,14 @@ static void *worker_func(void *opaque)
     JSThreadState *ts;
     JSContext *ctx;
     JSValue val;
+#if !defined(_WIN32)
+    sigset_t sigmask;
+
+    /* the profiling signal is only handled by the profiled thread */
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
+#endif
 
     rt = JS_NewRuntime();
     if (rt == NULL) {
@@ -3875,6 +3890,56 @@ void js_std_set_worker_new_context_func(JSContext *(*func)(JSRuntime *rt))
 #endif
 }
 
+#if !defined(_WIN32)
+static JSRuntime *profiling_rt;
+
+static void profiling_signal_handler(int sig_num)
+{
+    if (profiling_rt)
+        JS_ProfileTick(profiling_rt);
+}
+#endif
+
+/* Request a CPU profiling sample of 'rt' every 'interval_us'
+   microseconds of CPU time (see JS_StartProfiling()). The timer is
+   stopped if 'interval_us' = 0. Return 0 if OK or -1 if error.
+
+   The timer is process-wide: the CPU time of all the threads is
+   counted, so the time spent in the workers is also charged to
+   'rt'. SIGPROF is blocked in the worker threads and the interrupted
+   system calls are restarted, except the ones which always fail with
+   EINTR such as select(). */
+int js_std_set_profiling_timer(JSRuntime *rt, int interval_us)
+{
+#if defined(_WIN32)
+    return -1;
+#else
+    struct itimerval it;
+
+    memset(&it, 0, sizeof(it));
+    if (interval_us > 0) {
+        struct sigaction sa;
+
+        profiling_rt = rt;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = profiling_signal_handler;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGPROF, &sa, NULL);
+        it.it_interval.tv_sec = interval_us / 1000000;
+        it.it_interval.tv_usec = interval_us % 1000000;
+        it.it_value = it.it_interval;
+    }
+    if (setitimer(ITIMER_PROF, &it, NULL) < 0)
+        return -1;
+    if (interval_us <= 0) {
+        signal(SIGPROF, SIG_DFL);
+        profiling_rt = NULL;
+    }
+    return 0;
+#endif
+}
+
 #if defined(_WIN32)
 #define OS_PLATFORM "win32"
 #elif defined(__APPLE__)
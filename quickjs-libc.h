@@ -58,6 +58,7 @@ void js_std_promise_rejection_tracker(JSContext *ctx, JSValueConst promise,
                                       JSValueConst reason,
                                       JS_BOOL is_handled, void *opaque);
 void js_std_set_worker_new_context_func(JSContext *(*func)(JSRuntime *rt));
+int js_std_set_profiling_timer(JSRuntime *rt, int interval_us);
 
 #ifdef __cplusplus
 } /* extern "C" { */
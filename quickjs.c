@@ -181,6 +181,8 @@ enum {
     JS_CLASS_ASYNC_GENERATOR,   /* u.async_generator_data */
     JS_CLASS_WEAK_REF,
     JS_CLASS_FINALIZATION_REGISTRY,
+    JS_CLASS_TEXT_ENCODER,
+    JS_CLASS_TEXT_DECODER,      /* opaque: JSTextDecoder */
     
     JS_CLASS_INIT_COUNT, /* last entry for predefined classes */
 };
@@ -265,7 +267,8 @@ typedef struct JSMallocBlockHeader {
         uint16_t free_next; /* FREE_NIL if none */
     } u;
     uint8_t block_size_idx;
-    uint8_t gc_obj_type : 7;
+    uint8_t gc_obj_type : 6;
+    uint8_t young : 1; /* TRUE if in rt->gc_young_obj_list */
     uint8_t mark : 1;
     int ref_count;
     __attribute__((aligned(JS_MALLOC_ALIGN))) uint8_t user_data[];
@@ -278,7 +281,7 @@ typedef struct JSMallocLargeBlockHeader {
     JSMallocBlockHeader header;
 } JSMallocLargeBlockHeader;
 
-typedef struct {
+typedef struct JSMallocArena {
     struct list_head free_link;
     struct list_head link;
     uint8_t block_size_idx;
@@ -296,6 +299,9 @@ typedef struct {
 typedef struct {
     struct list_head arena_list[JS_MALLOC_BLOCK_SIZE_COUNT]; /* list of JSMallocArena.link (all arenas) */
     struct list_head free_arena_list[JS_MALLOC_BLOCK_SIZE_COUNT]; /* list of JSMallocArena.free_link (arenas where n_used_blocks < n_blocks) */
+    /* at most one empty arena is kept for each block size to avoid
+       allocating and freeing an arena repeatedly. NULL if none. */
+    struct JSMallocArena *empty_arena[JS_MALLOC_BLOCK_SIZE_COUNT];
 #ifdef JS_MALLOC_USE_ITER
     struct list_head large_block_list; /* list of JSMallocLargeBlockHeader.link */
 #endif
@@ -304,10 +310,22 @@ typedef struct {
     /* callbacks to the host malloc */
     JSMallocFunctions mf;
     JSMallocState malloc_state;
+#ifdef CONFIG_ATOMICS
+    struct JSBgFree *bg_free; /* NULL if no background freeing */
+#endif
 } JSMallocContext;
 
 /* end JS Malloc */
 
+#define JS_INT_STRING_CACHE_SIZE 1024
+#define JS_FLOAT64_STRING_CACHE_BITS 6
+#define JS_FLOAT64_STRING_CACHE_SIZE (1 << JS_FLOAT64_STRING_CACHE_BITS)
+
+typedef struct {
+    uint64_t bits; /* float64 value */
+    JSString *str; /* NULL if empty entry */
+} JSFloat64StringCacheEntry;
+
 struct JSRuntime {
     JSMallocContext malloc_ctx;
     const char *rt_info;
@@ -319,6 +337,14 @@ struct JSRuntime {
     uint32_t *atom_hash;
     JSAtomStruct **atom_array;
     int atom_free_index; /* 0 = none */
+    uint64_t hash_seed; /* random seed of the string hash */
+
+    /* last leaf found by string_rope_get(): 'rope_cache_leaf' contains
+       the characters of 'rope_cache_rope' starting at
+       'rope_cache_start'. NULL if none */
+    struct JSStringRope *rope_cache_rope;
+    JSString *rope_cache_leaf;
+    uint32_t rope_cache_start;
 
     int class_count;    /* size of class_array */
     JSClass *class_array;
@@ -327,12 +353,51 @@ struct JSRuntime {
     /* list of JSGCObjectHeader.link. List of allocated GC objects (used
        by the garbage collector) */
     struct list_head gc_obj_list;
+    /* list of JSGCObjectHeader.link. GC objects allocated since the
+       last garbage collection */
+    struct list_head gc_young_obj_list;
+    int gc_young_count; /* number of objects added to gc_young_obj_list */
     /* list of JSGCObjectHeader.link. Used during JS_FreeValueRT() */
     struct list_head gc_zero_ref_count_list;
     struct list_head tmp_obj_list; /* used during GC */
     JSGCPhaseEnum gc_phase : 8;
     size_t malloc_gc_threshold;
-    struct list_head weakref_list; /* list of JSWeakRefHeader.link */
+    size_t malloc_gc_full_threshold; /* above it, do a full collection */
+    /* if non zero, maximum number of objects examined by an automatic
+       collection */
+    int gc_step_budget;
+    int gc_step_count; /* used by JS_RunGCStep() */
+    struct JSHeapSnapshot *heap_snapshot; /* used by JS_WriteHeapSnapshot() */
+    /* allocation sampling: a sample is taken when the countdown
+       becomes negative. INT64_MAX if no sampling */
+    int64_t alloc_sample_countdown;
+    struct JSAllocSampler *alloc_sampler; /* NULL if no sampling */
+    JSClassID alloc_sample_class_id; /* class of the object being allocated */
+    struct JSCPUProfiler *cpu_profiler; /* NULL if no CPU profiling */
+#ifdef CONFIG_ATOMICS
+    _Atomic int cpu_profile_ticks; /* set by JS_ProfileTick() */
+#else
+    volatile int cpu_profile_ticks;
+#endif
+    struct JSTracer *tracer; /* NULL if no tracing */
+    int trace_depth; /* number of call or job events in progress */
+#ifdef CONFIG_OPCODE_STATS
+    struct JSOpcodeStats *opcode_stats; /* NULL if no opcode statistics */
+#endif
+    JSGCParams gc_params;
+    JSGCStats gc_stats;
+    JSGCCallback *gc_callback; /* NULL if none */
+    void *gc_callback_opaque;
+    /* the JSWeakTarget are allocated by chunks of
+       JS_WEAK_TARGET_CHUNK_SIZE and never move */
+    struct JSWeakTarget **weak_target_chunks;
+    uint32_t weak_target_chunk_count;
+    uint32_t weak_target_chunk_size; /* allocated size of weak_target_chunks */
+    struct JSWeakTarget *weak_target_free_list;
+    uint32_t weak_target_count;
+    /* targets freed since the last garbage collection (list of
+       JSWeakTarget.dead_link) */
+    struct list_head weak_dead_list;
 #ifdef DUMP_LEAKS
     struct list_head string_list; /* list of JSString.link */
 #endif
@@ -380,8 +445,33 @@ struct JSRuntime {
     int shape_hash_count; /* number of hashed shapes */
     JSShape **shape_hash;
     void *user_opaque;
+    /* shared one character strings in the Latin-1 range, allocated
+       on demand */
+    JSString *char_string_cache[256];
+    /* shared strings of the integers 0 to JS_INT_STRING_CACHE_SIZE - 1,
+       allocated on demand. NULL if not allocated */
+    JSString **int_string_cache;
+    /* direct mapped cache of the float64 to string conversions */
+    JSFloat64StringCacheEntry float64_string_cache[JS_FLOAT64_STRING_CACHE_SIZE];
 };
 
+/* return the GC object following 'el' in gc_obj_list then in
+   gc_young_obj_list */
+static inline struct list_head *gc_obj_list_next(JSRuntime *rt,
+                                                 struct list_head *el)
+{
+    el = el->next;
+    if (el == &rt->gc_obj_list)
+        el = rt->gc_young_obj_list.next;
+    return el;
+}
+
+/* iterate over the old and young GC objects without modifying the
+   generations */
+#define gc_obj_list_for_each(el, rt)                                 \
+    for(el = gc_obj_list_next(rt, &(rt)->gc_obj_list);               \
+        el != &(rt)->gc_young_obj_list; el = gc_obj_list_next(rt, el))
+
 struct JSClass {
     uint32_t class_id; /* 0 means free entry */
     JSAtom class_name;
@@ -431,14 +521,38 @@ struct JSGCObjectHeader {
 typedef enum {
     JS_WEAKREF_TYPE_MAP,
     JS_WEAKREF_TYPE_WEAKREF,
-    JS_WEAKREF_TYPE_FINREC,
+    JS_WEAKREF_TYPE_FINREC, /* target of a FinalizationRegistry entry */
+    JS_WEAKREF_TYPE_FINREC_TOKEN, /* token of a FinalizationRegistry entry */
 } JSWeakRefHeaderTypeEnum;
 
+/* container of weak references */
 typedef struct {
-    struct list_head link;
     JSWeakRefHeaderTypeEnum weakref_type;
 } JSWeakRefHeader;
 
+/* weak reference to an object or a symbol */
+typedef struct JSWeakRefLink {
+    struct list_head link; /* list of the weak references to the same
+                              target (JSWeakTarget.refs) */
+    JSWeakRefHeader *wh;
+} JSWeakRefLink;
+
+/* object or symbol having weak references. It is referenced by its
+   index, stored in JSObject.weak_target or in the hash field of the
+   symbols. 0 means no weak reference. */
+typedef struct JSWeakTarget {
+    struct list_head refs; /* list of JSWeakRefLink.link */
+    union {
+        struct list_head dead_link; /* in rt->weak_dead_list if is_dead */
+        struct JSWeakTarget *free_next; /* in rt->weak_target_free_list */
+    } u;
+    uint32_t index;
+    BOOL is_dead;
+} JSWeakTarget;
+
+#define JS_WEAK_TARGET_CHUNK_BITS 8
+#define JS_WEAK_TARGET_CHUNK_SIZE (1 << JS_WEAK_TARGET_CHUNK_BITS)
+
 typedef struct JSVarRef {
     JSGCObjectHeader header; /* must come first */
     uint8_t is_detached;
@@ -502,6 +616,8 @@ typedef enum {
 /* must be large enough to have a negligible runtime cost and small
    enough to call the interrupt callback often. */
 #define JS_INTERRUPT_COUNTER_INIT 10000
+/* used instead of JS_INTERRUPT_COUNTER_INIT when CPU profiling */
+#define JS_PROFILE_INTERRUPT_COUNTER 100
 
 struct JSContext {
     JSGCObjectHeader header; /* must come first */
@@ -537,6 +653,9 @@ struct JSContext {
 
     /* when the counter reaches zero, JSRutime.interrupt_handler is called */
     int interrupt_counter;
+    /* when CPU profiling, number of steps before the next call to
+       JSRuntime.interrupt_handler */
+    int interrupt_handler_countdown;
 
     struct list_head loaded_modules; /* list of JSModuleDef.link */
 
@@ -573,9 +692,10 @@ typedef enum {
 #define JS_ATOM_HASH_PRIVATE JS_ATOM_HASH_MASK
 
 struct JSString {
-    uint32_t len : 31;
+    uint32_t len : 30;
+    uint8_t is_external : 1; /* the characters are in a JSStringExternal */
     uint8_t is_wide_char : 1; /* 0 = 8 bits, 1 = 16 bits characters */
-    /* for JS_ATOM_TYPE_SYMBOL: hash = weakref_count, atom_type = 3,
+    /* for JS_ATOM_TYPE_SYMBOL: hash = weak target index, atom_type = 3,
        for JS_ATOM_TYPE_PRIVATE: hash = JS_ATOM_HASH_PRIVATE, atom_type = 3
        XXX: could change encoding to have one more bit in hash */
     uint32_t hash : 30;
@@ -590,6 +710,40 @@ struct JSString {
     } u;
 };
 
+/* String whose characters are owned by the host. It is never an atom
+   and there is no trailing null character for 8 bit strings. */
+typedef struct JSStringExternal {
+    JSString str;
+    const void *ptr;
+    JSFreeExternalStringFunc *free_func;
+    void *opaque;
+} JSStringExternal;
+
+/* the characters of a string which may be external must be read with
+   these functions. The strings which are being built are never
+   external. */
+static inline const uint8_t *str8_ptr(const JSString *p)
+{
+    if (unlikely(p->is_external))
+        return ((const JSStringExternal *)p)->ptr;
+    return p->u.str8;
+}
+
+static inline const uint16_t *str16_ptr(const JSString *p)
+{
+    if (unlikely(p->is_external))
+        return ((const JSStringExternal *)p)->ptr;
+    return p->u.str16;
+}
+
+/* size of the memory allocated by the engine for a string */
+static inline size_t js_string_alloc_size(const JSString *p)
+{
+    if (p->is_external)
+        return sizeof(JSStringExternal);
+    return sizeof(JSString) + (p->len << p->is_wide_char) + 1 - p->is_wide_char;
+}
+
 typedef struct JSStringRope {
     uint32_t len;
     uint8_t is_wide_char; /* 0 = 8 bits, 1 = 16 bits characters */
@@ -705,6 +859,13 @@ typedef struct JSFunctionBytecode {
     JSValue *cpool; /* constant pool (self pointer) */
     int cpool_count;
     int closure_var_count;
+    /* atoms referenced by the bytecode. The atom operands of the
+       bytecode are indexes in this table (self pointer) */
+    JSAtom *atoms;
+    int atom_count;
+#ifdef CONFIG_OPCODE_STATS
+    struct JSOpcodeStatsFunc *opcode_stats; /* NULL if not executed */
+#endif
     struct {
         /* debug info, move to separate structure to save memory? */
         JSAtom filename;
@@ -998,10 +1159,10 @@ struct JSObject {
     uint8_t tmp_mark : 1; /* used in JS_WriteObjectRec() */
     uint8_t is_HTMLDDA : 1; /* specific annex B IsHtmlDDA behavior */
     uint16_t class_id; /* see JS_CLASS_x */
-    /* count the number of weak references to this object. The object
-       structure is freed only if header.ref_count = 0 and
-       weakref_count = 0 */
-    uint32_t weakref_count; 
+    /* index of the JSWeakTarget listing the weak references to this
+       object, 0 if none. The object structure is freed only if
+       header.ref_count = 0 and weak_target = 0 */
+    uint32_t weak_target;
     JSShape *shape; /* prototype and property names + flag */
     JSProperty *prop; /* array of properties */
     union {
@@ -1075,6 +1236,8 @@ typedef struct JSMapRecord {
     struct JSMapRecord *hash_next;
     JSValue key;
     JSValue value;
+    /* only allocated for WeakMap/WeakSet */
+    JSWeakRefLink key_link;
 } JSMapRecord;
 
 typedef struct JSMapState {
@@ -1140,6 +1303,11 @@ static JSAtom __JS_NewAtomInit(JSRuntime *rt, const char *str, int len,
                                int atom_type);
 static void JS_FreeAtomStruct(JSRuntime *rt, JSAtomStruct *p);
 static void free_function_bytecode(JSRuntime *rt, JSFunctionBytecode *b);
+#ifdef CONFIG_OPCODE_STATS
+static inline void js_opcode_stats_update(JSRuntime *rt, JSFunctionBytecode *b,
+                                          const uint8_t *pc);
+static void js_free_opcode_stats(JSRuntime *rt);
+#endif
 static JSValue js_call_c_function(JSContext *ctx, JSValueConst func_obj,
                                   JSValueConst this_obj,
                                   int argc, JSValueConst *argv, int flags);
@@ -1244,10 +1412,11 @@ static int JS_ToInt32Free(JSContext *ctx, int32_t *pres, JSValue val);
 static int JS_ToFloat64Free(JSContext *ctx, double *pres, JSValue val);
 static int JS_ToUint8ClampFree(JSContext *ctx, int32_t *pres, JSValue val);
 static JSValue js_new_string8_len(JSContext *ctx, const char *buf, int len);
+static JSValue js_new_string_int32(JSContext *ctx, int32_t n);
 static JSValue js_compile_regexp(JSContext *ctx, JSValueConst pattern,
                                  JSValueConst flags);
 static JSValue JS_NewRegexp(JSContext *ctx, JSValue pattern, JSValue bc);
-static void gc_decref(JSRuntime *rt);
+static void gc_decref(JSRuntime *rt, BOOL young_only);
 static int JS_NewClass1(JSRuntime *rt, JSClassID class_id,
                         const JSClassDef *class_def, JSAtom name);
 
@@ -1379,10 +1548,31 @@ static JSValue JS_InstantiateFunctionListItem2(JSContext *ctx, JSObject *p,
                                                JSAtom atom, void *opaque);
 static JSValue js_object_groupBy(JSContext *ctx, JSValueConst this_val,
                                  int argc, JSValueConst *argv, int is_map);
-static void map_delete_weakrefs(JSRuntime *rt, JSWeakRefHeader *wh);
-static void weakref_delete_weakref(JSRuntime *rt, JSWeakRefHeader *wh);
-static void finrec_delete_weakref(JSRuntime *rt, JSWeakRefHeader *wh);
-static void JS_RunGCInternal(JSRuntime *rt, BOOL remove_weak_objects);
+static void map_delete_weakref(JSRuntime *rt, JSWeakRefLink *wl);
+static void weakref_delete_weakref(JSRuntime *rt, JSWeakRefLink *wl);
+static void finrec_delete_weakref(JSRuntime *rt, JSWeakRefLink *wl);
+static void js_weak_target_set_dead(JSRuntime *rt, uint32_t idx);
+static void js_weak_target_free(JSRuntime *rt, struct JSWeakTarget *wt);
+static uint32_t map_hash_pointer(uintptr_t a, int hash_bits);
+static void JS_RunGCInternal(JSRuntime *rt, BOOL remove_weak_objects,
+                             BOOL young_only, JSGCReasonEnum reason);
+static void js_run_gc_step(JSRuntime *rt, int budget, JSGCReasonEnum reason);
+static int find_line_num(JSContext *ctx, JSFunctionBytecode *b,
+                         uint32_t pc_value, int *pcol_num);
+static void js_cpu_profile_sample(JSRuntime *rt, int count);
+typedef enum {
+    JS_TRACE_EVENT_CALL,
+    JS_TRACE_EVENT_GC,
+    JS_TRACE_EVENT_JOB,
+} JSTraceEventKindEnum;
+/* value of a trace start time when the tracing is not enabled */
+#define JS_TRACE_NONE (-2)
+static int64_t js_profile_time_us(void);
+static int64_t js_trace_begin(JSRuntime *rt);
+static void js_trace_end(JSRuntime *rt, int64_t start_time,
+                         JSTraceEventKindEnum kind, JSValueConst func);
+static void js_trace_add_event(JSRuntime *rt, JSTraceEventKindEnum kind,
+                               int64_t start_time, JSValueConst func);
 static JSValue js_array_from_iterator(JSContext *ctx, uint32_t *plen,
                                       JSValueConst obj, JSValueConst method);
 static int js_string_find_invalid_codepoint(JSString *p);
@@ -1486,6 +1676,22 @@ static inline JSMallocBlockHeader *js_rc(void *ptr)
     return container_of(ptr, JSMallocBlockHeader, user_data);
 }
 
+static void js_malloc_free_empty_arenas(JSMallocContext *s)
+{
+    JSMallocArena *ar;
+    int i;
+
+    for(i = 0; i < JS_MALLOC_BLOCK_SIZE_COUNT; i++) {
+        ar = s->empty_arena[i];
+        if (ar) {
+            list_del(&ar->link);
+            list_del(&ar->free_link);
+            s->mf.js_free(&s->malloc_state, ar);
+            s->empty_arena[i] = NULL;
+        }
+    }
+}
+
 static no_inline JSMallocArena *js_malloc_new_arena(JSMallocContext *s, int block_size_idx)
 {
     JSMallocBlockHeader *b;
@@ -1495,8 +1701,14 @@ static no_inline JSMallocArena *js_malloc_new_arena(JSMallocContext *s, int bloc
     block_size = js_malloc_block_sizes[block_size_idx];
     n_blocks = (JS_MALLOC_ARENA_SIZE - sizeof(JSMallocArena)) / block_size;
     ar = s->mf.js_malloc(&s->malloc_state, sizeof(JSMallocArena) + n_blocks * block_size);
-    if (!ar)
-        return NULL;
+    if (!ar) {
+        /* the empty arenas of the other block sizes may prevent the
+           allocation if a memory limit is set */
+        js_malloc_free_empty_arenas(s);
+        ar = s->mf.js_malloc(&s->malloc_state, sizeof(JSMallocArena) + n_blocks * block_size);
+        if (!ar)
+            return NULL;
+    }
 
     ar->block_size_idx = block_size_idx;
     ar->n_blocks = n_blocks;
@@ -1569,6 +1781,10 @@ static void *__js_malloc(JSMallocContext *s, size_t size)
             b = get_arena_block(ar, ar->first_free_block, block_size);
             ar->first_free_block = b->u.free_next;
             b->u.block_idx = block_idx;
+            if (unlikely(ar->n_used_blocks == 0)) {
+                /* the kept empty arena (if any) is no longer empty */
+                s->empty_arena[block_size_idx] = NULL;
+            }
             ar->n_used_blocks++;
             if (unlikely(ar->n_used_blocks == ar->n_blocks)) {
                 list_del(&ar->free_link);
@@ -1583,6 +1799,10 @@ static void *__js_malloc(JSMallocContext *s, size_t size)
     }
 }
 
+#ifdef CONFIG_ATOMICS
+static void js_bg_free(JSMallocContext *s, void *ptr);
+#endif
+
 static void __js_free(JSMallocContext *s, void *ptr)
 {
     JSMallocBlockHeader *b;
@@ -1598,6 +1818,12 @@ static void __js_free(JSMallocContext *s, void *ptr)
             JSMallocLargeBlockHeader *lb = container_of(ptr, JSMallocLargeBlockHeader, header.user_data);
 #ifdef JS_MALLOC_USE_ITER
             list_del(&lb->link);
+#endif
+#ifdef CONFIG_ATOMICS
+            if (s->bg_free) {
+                js_bg_free(s, lb);
+                return;
+            }
 #endif
             s->mf.js_free(&s->malloc_state, lb);
         }
@@ -1617,9 +1843,13 @@ static void __js_free(JSMallocContext *s, void *ptr)
         }
         ar->n_used_blocks--;
         if (unlikely(ar->n_used_blocks == 0)) {
-            list_del(&ar->link);
-            list_del(&ar->free_link);
-            s->mf.js_free(&s->malloc_state, ar);
+            if (!s->empty_arena[block_size_idx]) {
+                s->empty_arena[block_size_idx] = ar;
+            } else {
+                list_del(&ar->link);
+                list_del(&ar->free_link);
+                s->mf.js_free(&s->malloc_state, ar);
+            }
         }
     }
 }
@@ -1675,6 +1905,7 @@ static void *__js_realloc(JSMallocContext *s, void *ptr, size_t size)
         new_b = container_of(new_ptr, JSMallocBlockHeader, user_data);
         /* copy the GC data */
         new_b->gc_obj_type = b->gc_obj_type;
+        new_b->young = b->young;
         new_b->mark = b->mark;
         new_b->ref_count = b->ref_count;
         /* copy the data */
@@ -1768,6 +1999,38 @@ static __maybe_unused void js_malloc_iter(JSMallocContext *s, JSMallocIterFunc *
 
 /* end JS malloc */
 
+/* return 'size' increased by 'growth' percent, saturated to SIZE_MAX */
+static size_t js_gc_grow_size(size_t size, int growth)
+{
+    uint64_t n, v;
+    n = size / 100;
+    if (n > (UINT64_MAX - size) / growth)
+        return SIZE_MAX;
+    v = size + n * growth;
+    if (v > SIZE_MAX)
+        return SIZE_MAX;
+    return v;
+}
+
+static void js_gc_update_threshold(JSRuntime *rt)
+{
+    JSGCStats *st = &rt->gc_stats;
+    const JSGCParams *p = &rt->gc_params;
+    size_t size = rt->malloc_ctx.malloc_state.malloc_size;
+
+    /* wait longer if the collection found almost no garbage and
+       collect more often if it found a lot */
+    if (st->last_freed_count * 100 <
+        st->last_examined_count * p->low_yield) {
+        st->growth = min_int(st->growth * 2, p->max_growth);
+    } else if (st->last_freed_count * 100 >
+               st->last_examined_count * p->high_yield) {
+        st->growth = max_int(st->growth / 2, p->min_growth);
+    }
+    rt->malloc_gc_threshold = js_gc_grow_size(size, st->growth);
+    st->gc_threshold = rt->malloc_gc_threshold;
+}
+
 static void js_trigger_gc(JSRuntime *rt, size_t size)
 {
     BOOL force_gc;
@@ -1775,22 +2038,54 @@ static void js_trigger_gc(JSRuntime *rt, size_t size)
     force_gc = TRUE;
 #else
     force_gc = ((rt->malloc_ctx.malloc_state.malloc_size + size) >
-                rt->malloc_gc_threshold);
+                rt->malloc_gc_threshold) ||
+        (rt->gc_step_budget != 0 &&
+         rt->gc_young_count >= max_int(rt->gc_step_budget / 2, 1));
 #endif
     if (force_gc) {
 #ifdef DUMP_GC
         printf("GC: size=%" PRIu64 "\n",
                (uint64_t)rt->malloc_ctx.malloc_state.malloc_size);
 #endif
-        JS_RunGC(rt);
-        rt->malloc_gc_threshold = rt->malloc_ctx.malloc_state.malloc_size +
-            (rt->malloc_ctx.malloc_state.malloc_size >> 1);
+        /* the heap may have shrunk since the last collection */
+        rt->gc_stats.last_alloc_size =
+            max_int64((int64_t)rt->malloc_ctx.malloc_state.malloc_size -
+                      rt->gc_stats.last_heap_size, 0);
+        if (rt->malloc_ctx.malloc_state.malloc_size >
+            rt->malloc_gc_full_threshold) {
+            /* also done with a step budget, otherwise the cycles
+               larger than the budget would never be freed. The
+               budget does not bound this pause: there is no write
+               barrier, so the trial deletion of all the objects
+               cannot be spread over several steps. */
+            JS_RunGCInternal(rt, TRUE, FALSE, JS_GC_REASON_ALLOC);
+            js_malloc_free_empty_arenas(&rt->malloc_ctx);
+            rt->malloc_gc_full_threshold =
+                js_gc_grow_size(rt->malloc_ctx.malloc_state.malloc_size,
+                                rt->gc_params.full_growth);
+        } else if (rt->gc_step_budget != 0) {
+            /* bounded pause: collect the young objects and a part of
+               the old ones in a single pass */
+            js_run_gc_step(rt, rt->gc_step_budget, JS_GC_REASON_ALLOC);
+        } else {
+            /* only look for cycles in the objects allocated since the
+               last collection */
+            JS_RunGCInternal(rt, TRUE, TRUE, JS_GC_REASON_ALLOC);
+            js_malloc_free_empty_arenas(&rt->malloc_ctx);
+        }
+        js_gc_update_threshold(rt);
     }
 }
 
+static void js_alloc_sample(JSRuntime *rt, size_t size);
+
 extern force_inline void *js_malloc_rt(JSRuntime *rt, size_t size)
 {
-    return __js_malloc(&rt->malloc_ctx, size);
+    void *ptr;
+    ptr = __js_malloc(&rt->malloc_ctx, size);
+    if (unlikely((rt->alloc_sample_countdown -= size) < 0) && ptr)
+        js_alloc_sample(rt, size);
+    return ptr;
 }
 
 extern force_inline void js_free_rt(JSRuntime *rt, void *ptr)
@@ -1800,7 +2095,16 @@ extern force_inline void js_free_rt(JSRuntime *rt, void *ptr)
 
 extern force_inline void *js_realloc_rt(JSRuntime *rt, void *ptr, size_t size)
 {
-    return __js_realloc(&rt->malloc_ctx, ptr, size);
+    size_t old_size, growth;
+
+    /* only the growth of the block is sampled, so that a buffer
+       growing by steps is not counted several times */
+    old_size = __js_malloc_usable_size(&rt->malloc_ctx, ptr);
+    growth = size > old_size ? size - old_size : 0;
+    ptr = __js_realloc(&rt->malloc_ctx, ptr, size);
+    if (unlikely((rt->alloc_sample_countdown -= growth) < 0) && ptr)
+        js_alloc_sample(rt, growth);
+    return ptr;
 }
 
 extern force_inline size_t js_malloc_usable_size_rt(JSRuntime *rt, const void *ptr)
@@ -1950,7 +2254,7 @@ static inline int is_digit(int c) {
 }
 
 static inline int string_get(const JSString *p, int idx) {
-    return p->is_wide_char ? p->u.str16[idx] : p->u.str8[idx];
+    return p->is_wide_char ? str16_ptr(p)[idx] : str8_ptr(p)[idx];
 }
 
 typedef struct JSClassShortDef {
@@ -2055,6 +2359,22 @@ static inline BOOL js_check_stack_overflow(JSRuntime *rt, size_t alloca_size)
 }
 #endif
 
+/* the string hash seed is derived from the time and the runtime
+   address so that the hash of a string cannot be predicted */
+static uint64_t js_hash_seed_init(JSRuntime *rt)
+{
+    struct timeval tv;
+    uint64_t v;
+
+    gettimeofday(&tv, NULL);
+    v = ((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+    v ^= (uintptr_t)rt;
+    /* mix the bits (splitmix64 finalizer) */
+    v = (v ^ (v >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    v = (v ^ (v >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return v ^ (v >> 31);
+}
+
 JSRuntime *JS_NewRuntime2(const JSMallocFunctions *mf, void *opaque)
 {
     JSRuntime *rt;
@@ -2072,18 +2392,28 @@ JSRuntime *JS_NewRuntime2(const JSMallocFunctions *mf, void *opaque)
     rt->malloc_ctx.mf = *mf;
     rt->malloc_ctx.malloc_state = ms;
     rt->malloc_gc_threshold = 256 * 1024;
+    rt->gc_params.min_growth = 50;
+    rt->gc_params.max_growth = 400;
+    rt->gc_params.low_yield = 1;
+    rt->gc_params.high_yield = 10;
+    rt->gc_params.full_growth = 100;
+    rt->gc_stats.growth = rt->gc_params.min_growth;
+    rt->gc_stats.gc_threshold = rt->malloc_gc_threshold;
+    rt->alloc_sample_countdown = INT64_MAX;
 
     init_list_head(&rt->context_list);
     init_list_head(&rt->gc_obj_list);
+    init_list_head(&rt->gc_young_obj_list);
     init_list_head(&rt->gc_zero_ref_count_list);
     rt->gc_phase = JS_GC_PHASE_NONE;
-    init_list_head(&rt->weakref_list);
+    init_list_head(&rt->weak_dead_list);
 
 #ifdef DUMP_LEAKS
     init_list_head(&rt->string_list);
 #endif
     init_list_head(&rt->job_list);
 
+    rt->hash_seed = js_hash_seed_init(rt);
     if (JS_InitAtoms(rt))
         goto fail;
 
@@ -2197,6 +2527,151 @@ static void *js_def_realloc(JSMallocState *s, void *ptr, size_t size)
     return ptr;
 }
 
+#ifdef CONFIG_ATOMICS
+
+/* Background freeing: the blocks allocated with the default malloc
+   functions are accounted as freed immediately and given by batches
+   to a thread which calls free(). The small blocks are not concerned
+   because the arenas are not thread safe. */
+
+#define JS_BG_FREE_BATCH_SIZE 256
+/* smaller blocks are freed directly because free() is fast for them
+   (it is the default mmap() threshold of glibc) */
+#define JS_BG_FREE_MIN_SIZE   (128 * 1024)
+#define JS_BG_FREE_MAX_BATCH_BYTES (4 * 1024 * 1024)
+
+typedef struct JSBgFreeBatch {
+    struct JSBgFreeBatch *next;
+    int count;
+    size_t size;
+    void *tab[JS_BG_FREE_BATCH_SIZE];
+} JSBgFreeBatch;
+
+typedef struct JSBgFree {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    BOOL terminate; /* protected by mutex */
+    JSBgFreeBatch *queue; /* protected by mutex */
+    JSBgFreeBatch *cur; /* batch being filled by the runtime thread */
+} JSBgFree;
+
+static void *js_bg_free_thread(void *opaque)
+{
+    JSBgFree *bf = opaque;
+    JSBgFreeBatch *b, *b_next;
+    int i;
+
+    pthread_mutex_lock(&bf->mutex);
+    for(;;) {
+        while (!bf->queue && !bf->terminate)
+            pthread_cond_wait(&bf->cond, &bf->mutex);
+        b = bf->queue;
+        if (!b)
+            break;
+        bf->queue = NULL;
+        pthread_mutex_unlock(&bf->mutex);
+        for(; b != NULL; b = b_next) {
+            b_next = b->next;
+            for(i = 0; i < b->count; i++)
+                free(b->tab[i]);
+            free(b);
+        }
+        pthread_mutex_lock(&bf->mutex);
+    }
+    pthread_mutex_unlock(&bf->mutex);
+    /* the runtime no longer references 'bf' */
+    pthread_cond_destroy(&bf->cond);
+    pthread_mutex_destroy(&bf->mutex);
+    free(bf);
+    return NULL;
+}
+
+/* give the current batch to the thread */
+static void js_bg_free_flush(JSBgFree *bf)
+{
+    JSBgFreeBatch *b = bf->cur;
+    if (!b)
+        return;
+    bf->cur = NULL;
+    pthread_mutex_lock(&bf->mutex);
+    b->next = bf->queue;
+    bf->queue = b;
+    pthread_cond_signal(&bf->cond);
+    pthread_mutex_unlock(&bf->mutex);
+}
+
+static void js_bg_free(JSMallocContext *s, void *ptr)
+{
+    JSBgFree *bf = s->bg_free;
+    JSBgFreeBatch *b;
+    size_t size;
+
+    size = js_def_malloc_usable_size(ptr);
+    if (size < JS_BG_FREE_MIN_SIZE)
+        goto direct_free;
+    b = bf->cur;
+    if (!b) {
+        b = malloc(sizeof(*b));
+        if (!b)
+            goto direct_free;
+        b->count = 0;
+        b->size = 0;
+        bf->cur = b;
+    }
+    s->malloc_state.malloc_count--;
+    s->malloc_state.malloc_size -= size + MALLOC_OVERHEAD;
+    b->tab[b->count++] = ptr;
+    b->size += size;
+    if (b->count == JS_BG_FREE_BATCH_SIZE ||
+        b->size >= JS_BG_FREE_MAX_BATCH_BYTES) {
+        js_bg_free_flush(bf);
+    }
+    return;
+ direct_free:
+    js_def_free(&s->malloc_state, ptr);
+}
+
+static void js_bg_free_end(JSMallocContext *s)
+{
+    JSBgFree *bf = s->bg_free;
+    if (!bf)
+        return;
+    s->bg_free = NULL;
+    js_bg_free_flush(bf);
+    /* the thread frees the remaining blocks and 'bf' without making
+       the caller wait */
+    pthread_detach(bf->thread);
+    pthread_mutex_lock(&bf->mutex);
+    bf->terminate = TRUE;
+    pthread_cond_signal(&bf->cond);
+    pthread_mutex_unlock(&bf->mutex);
+}
+
+static int js_bg_free_start(JSMallocContext *s)
+{
+    JSBgFree *bf;
+
+    if (s->bg_free)
+        return 0;
+    bf = malloc(sizeof(*bf));
+    if (!bf)
+        return -1;
+    memset(bf, 0, sizeof(*bf));
+    pthread_mutex_init(&bf->mutex, NULL);
+    pthread_cond_init(&bf->cond, NULL);
+    if (pthread_create(&bf->thread, NULL, js_bg_free_thread, bf) != 0) {
+        pthread_cond_destroy(&bf->cond);
+        pthread_mutex_destroy(&bf->mutex);
+        free(bf);
+        return -1;
+    }
+    s->bg_free = bf;
+    return 0;
+}
+
+#endif /* CONFIG_ATOMICS */
+
 static const JSMallocFunctions def_malloc_funcs = {
     js_def_malloc,
     js_def_free,
@@ -2218,6 +2693,72 @@ void JS_SetMemoryLimit(JSRuntime *rt, size_t limit)
 void JS_SetGCThreshold(JSRuntime *rt, size_t gc_threshold)
 {
     rt->malloc_gc_threshold = gc_threshold;
+    rt->gc_stats.gc_threshold = gc_threshold;
+}
+
+/* maximum growth percentage. The thresholds are saturated to SIZE_MAX
+   if they overflow. */
+#define JS_GC_GROWTH_MAX 100000
+
+static int js_gc_clamp_param(int v, int min, int max)
+{
+    return max_int(min_int(v, max), min);
+}
+
+/* the parameters are clamped to valid ranges */
+void JS_SetGCParams(JSRuntime *rt, const JSGCParams *p)
+{
+    JSGCParams *q = &rt->gc_params;
+
+    q->min_growth = js_gc_clamp_param(p->min_growth, 1, JS_GC_GROWTH_MAX);
+    q->max_growth = js_gc_clamp_param(p->max_growth, q->min_growth,
+                                      JS_GC_GROWTH_MAX);
+    q->low_yield = js_gc_clamp_param(p->low_yield, 0, 100);
+    q->high_yield = js_gc_clamp_param(p->high_yield, q->low_yield, 100);
+    q->full_growth = js_gc_clamp_param(p->full_growth, 1, JS_GC_GROWTH_MAX);
+    rt->gc_stats.growth = js_gc_clamp_param(rt->gc_stats.growth,
+                                            q->min_growth, q->max_growth);
+}
+
+void JS_GetGCParams(JSRuntime *rt, JSGCParams *p)
+{
+    *p = rt->gc_params;
+}
+
+void JS_GetGCStats(JSRuntime *rt, JSGCStats *s)
+{
+    *s = rt->gc_stats;
+}
+
+void JS_SetGCCallback(JSRuntime *rt, JSGCCallback *cb, void *opaque)
+{
+    rt->gc_callback = cb;
+    rt->gc_callback_opaque = opaque;
+}
+
+/* Free the large memory blocks in a background thread. Only
+   available with the default malloc functions. Return -1 if not
+   supported. */
+int JS_SetBackgroundFree(JSRuntime *rt, BOOL enable)
+{
+#ifdef CONFIG_ATOMICS
+    JSMallocContext *s = &rt->malloc_ctx;
+    if (!enable) {
+        js_bg_free_end(s);
+        return 0;
+    }
+    if (s->mf.js_free != js_def_free)
+        return -1;
+    return js_bg_free_start(s);
+#else
+    return enable ? -1 : 0;
+#endif
+}
+
+/* use 0 to disable incremental GC */
+void JS_SetGCStepBudget(JSRuntime *rt, int budget)
+{
+    rt->gc_step_budget = max_int(budget, 0);
 }
 
 #define malloc(s) malloc_is_forbidden(s)
@@ -2297,6 +2838,7 @@ int JS_ExecutePendingJob(JSRuntime *rt, JSContext **pctx)
     JSJobEntry *e;
     JSValue res;
     int i, ret;
+    int64_t trace_start;
 
     if (list_empty(&rt->job_list)) {
         if (pctx)
@@ -2308,7 +2850,12 @@ int JS_ExecutePendingJob(JSRuntime *rt, JSContext **pctx)
     e = list_entry(rt->job_list.next, JSJobEntry, link);
     list_del(&e->link);
     ctx = e->realm;
+    trace_start = JS_TRACE_NONE;
+    if (unlikely(rt->tracer))
+        trace_start = js_trace_begin(rt);
     res = e->job_func(ctx, e->argc, (JSValueConst *)e->argv);
+    if (unlikely(trace_start != JS_TRACE_NONE))
+        js_trace_end(rt, trace_start, JS_TRACE_EVENT_JOB, JS_UNDEFINED);
     for(i = 0; i < e->argc; i++)
         JS_FreeValue(ctx, e->argv[i]);
     if (JS_IsException(res))
@@ -2350,6 +2897,7 @@ static JSString *js_alloc_string_rt(JSRuntime *rt, int max_len, int is_wide_char
     if (unlikely(!str))
         return NULL;
     js_rc(str)->ref_count = 1;
+    str->is_external = 0;
     str->is_wide_char = is_wide_char;
     str->len = max_len;
     str->atom_type = 0;
@@ -2372,6 +2920,14 @@ static JSString *js_alloc_string(JSContext *ctx, int max_len, int is_wide_char)
     return p;
 }
 
+static void js_free_external_string(JSRuntime *rt, JSString *str)
+{
+    JSStringExternal *es = (JSStringExternal *)str;
+    if (es->free_func)
+        es->free_func(rt, es->opaque, (void *)es->ptr);
+    js_free_rt(rt, es);
+}
+
 /* same as JS_FreeValueRT() but faster */
 static inline void js_free_string(JSRuntime *rt, JSString *str)
 {
@@ -2382,7 +2938,10 @@ static inline void js_free_string(JSRuntime *rt, JSString *str)
 #ifdef DUMP_LEAKS
             list_del(&str->link);
 #endif
-            js_free_rt(rt, str);
+            if (unlikely(str->is_external))
+                js_free_external_string(rt, str);
+            else
+                js_free_rt(rt, str);
         }
     }
 }
@@ -2411,7 +2970,30 @@ void JS_FreeRuntime(JSRuntime *rt)
 
     /* don't remove the weak objects to avoid create new jobs with
        FinalizationRegistry */
-    JS_RunGCInternal(rt, FALSE);
+    JS_RunGCInternal(rt, FALSE, FALSE, JS_GC_REASON_FREE_RUNTIME);
+
+    JS_StopAllocationSampling(rt);
+    JS_StopProfiling(rt);
+    JS_StopTracing(rt);
+#ifdef CONFIG_OPCODE_STATS
+    js_free_opcode_stats(rt);
+#endif
+
+    for(i = 0; i < countof(rt->char_string_cache); i++) {
+        if (rt->char_string_cache[i])
+            js_free_string(rt, rt->char_string_cache[i]);
+    }
+    if (rt->int_string_cache) {
+        for(i = 0; i < JS_INT_STRING_CACHE_SIZE; i++) {
+            if (rt->int_string_cache[i])
+                js_free_string(rt, rt->int_string_cache[i]);
+        }
+        js_free_rt(rt, rt->int_string_cache);
+    }
+    for(i = 0; i < countof(rt->float64_string_cache); i++) {
+        if (rt->float64_string_cache[i].str)
+            js_free_string(rt, rt->float64_string_cache[i].str);
+    }
 
 #ifdef DUMP_LEAKS
     /* leaking objects */
@@ -2426,7 +3008,7 @@ void JS_FreeRuntime(JSRuntime *rt)
             p = list_entry(el, JSGCObjectHeader, link);
             js_rc(p)->mark = 0;
         }
-        gc_decref(rt);
+        gc_decref(rt, FALSE);
 
         header_done = FALSE;
         list_for_each(el, &rt->gc_obj_list) {
@@ -2453,7 +3035,18 @@ void JS_FreeRuntime(JSRuntime *rt)
     }
 #endif
     assert(list_empty(&rt->gc_obj_list));
-    assert(list_empty(&rt->weakref_list));
+    assert(list_empty(&rt->gc_young_obj_list));
+    /* the weak references to the dead targets have been freed */
+    while (!list_empty(&rt->weak_dead_list)) {
+        JSWeakTarget *wt = list_entry(rt->weak_dead_list.next, JSWeakTarget, u.dead_link);
+        assert(list_empty(&wt->refs));
+        list_del(&wt->u.dead_link);
+        js_weak_target_free(rt, wt);
+    }
+    assert(rt->weak_target_count == 0);
+    for(i = 0; i < rt->weak_target_chunk_count; i++)
+        js_free_rt(rt, rt->weak_target_chunks[i]);
+    js_free_rt(rt, rt->weak_target_chunks);
 
     /* free the classes */
     for(i = 0; i < rt->class_count; i++) {
@@ -2563,6 +3156,7 @@ void JS_FreeRuntime(JSRuntime *rt)
         if (rt->rt_info)
             printf("\n");
     }
+    js_malloc_free_empty_arenas(&rt->malloc_ctx);
     {
         JSMallocState *s = &rt->malloc_ctx.malloc_state;
         if (s->malloc_count > 1) {
@@ -2575,6 +3169,10 @@ void JS_FreeRuntime(JSRuntime *rt)
     }
 #endif
 
+    js_malloc_free_empty_arenas(&rt->malloc_ctx);
+#ifdef CONFIG_ATOMICS
+    js_bg_free_end(&rt->malloc_ctx);
+#endif
     {
         JSMallocState ms = rt->malloc_ctx.malloc_state;
         rt->malloc_ctx.mf.js_free(&ms, rt);
@@ -2774,7 +3372,7 @@ void JS_FreeContext(JSContext *ctx)
         JSGCObjectHeader *p;
         printf("JSObjects: {\n");
         JS_DumpObjectHeader(ctx->rt);
-        list_for_each(el, &rt->gc_obj_list) {
+        gc_obj_list_for_each(el, rt) {
             p = list_entry(el, JSGCObjectHeader, link);
             JS_DumpGCObject(rt, p);
         }
@@ -2929,44 +3527,147 @@ static inline BOOL is_num_string(uint32_t *pval, const JSString *p)
     }
 }
 
-/* XXX: could use faster version ? */
-static inline uint32_t hash_string8(const uint8_t *str, size_t len, uint32_t h)
+static inline BOOL is_be(void)
+{
+    union {
+        uint16_t a;
+        uint8_t  b;
+    } u = {0x100};
+    return u.b;
+}
+
+/* String hash. The characters are processed 4 at a time as 64 bit
+   words of 16 bit characters, so that the hash does not depend on the
+   string representation (8 or 16 bit characters, rope). The seed
+   comes from the runtime to make hash flooding attacks harder. */
+
+#define STRING_HASH_K1 UINT64_C(0x9e3779b97f4a7c15)
+#define STRING_HASH_K2 UINT64_C(0xff51afd7ed558ccd)
+
+typedef struct {
+    uint64_t h;
+    uint64_t w; /* pending characters */
+    int n; /* number of pending characters, < 4 */
+    uint32_t len;
+} StringHashState;
+
+static inline uint64_t string_hash_mix(uint64_t h, uint64_t w)
+{
+    h = (h ^ w) * STRING_HASH_K1;
+    return h ^ (h >> 32);
+}
+
+/* convert 4 8 bit characters to the 16 bit representation */
+static inline uint64_t string_hash_widen4(uint32_t x)
+{
+    uint64_t v = x;
+    v = (v | (v << 16)) & UINT64_C(0x0000ffff0000ffff);
+    v = (v | (v << 8)) & UINT64_C(0x00ff00ff00ff00ff);
+    return v;
+}
+
+static inline void string_hash_init(StringHashState *s, uint64_t seed)
+{
+    s->h = (seed + STRING_HASH_K1) * STRING_HASH_K2;
+    s->w = 0;
+    s->n = 0;
+    s->len = 0;
+}
+
+static inline void string_hash_putc(StringHashState *s, uint32_t c)
+{
+    s->w |= (uint64_t)c << (16 * (is_be() ? 3 - s->n : s->n));
+    if (++s->n == 4) {
+        s->h = string_hash_mix(s->h, s->w);
+        s->w = 0;
+        s->n = 0;
+    }
+}
+
+static inline void string_hash_update8(StringHashState *s,
+                                       const uint8_t *str, size_t len)
 {
+    uint64_t h;
     size_t i;
 
-    for(i = 0; i < len; i++)
-        h = h * 263 + str[i];
-    return h;
+    s->len += len;
+    i = 0;
+    while (s->n != 0 && i < len)
+        string_hash_putc(s, str[i++]);
+    h = s->h;
+    for(; i + 4 <= len; i += 4)
+        h = string_hash_mix(h, string_hash_widen4(get_u32(str + i)));
+    s->h = h;
+    while (i < len)
+        string_hash_putc(s, str[i++]);
 }
 
-static inline uint32_t hash_string16(const uint16_t *str,
-                                     size_t len, uint32_t h)
+static inline void string_hash_update16(StringHashState *s,
+                                        const uint16_t *str, size_t len)
 {
+    uint64_t h;
     size_t i;
 
-    for(i = 0; i < len; i++)
-        h = h * 263 + str[i];
-    return h;
+    s->len += len;
+    i = 0;
+    while (s->n != 0 && i < len)
+        string_hash_putc(s, str[i++]);
+    h = s->h;
+    for(; i + 4 <= len; i += 4)
+        h = string_hash_mix(h, get_u64((const uint8_t *)(str + i)));
+    s->h = h;
+    while (i < len)
+        string_hash_putc(s, str[i++]);
 }
 
-static uint32_t hash_string(const JSString *str, uint32_t h)
+static inline uint32_t string_hash_final(StringHashState *s)
+{
+    uint64_t h = s->h;
+    if (s->n != 0)
+        h = string_hash_mix(h, s->w);
+    h = (h ^ s->len) * STRING_HASH_K2;
+    return h ^ (h >> 32);
+}
+
+static uint32_t hash_string8(const uint8_t *str, size_t len, uint64_t seed)
+{
+    StringHashState s;
+    string_hash_init(&s, seed);
+    string_hash_update8(&s, str, len);
+    return string_hash_final(&s);
+}
+
+static uint32_t hash_string16(const uint16_t *str, size_t len, uint64_t seed)
+{
+    StringHashState s;
+    string_hash_init(&s, seed);
+    string_hash_update16(&s, str, len);
+    return string_hash_final(&s);
+}
+
+static uint32_t hash_string(const JSString *str, uint64_t seed)
 {
     if (str->is_wide_char)
-        h = hash_string16(str->u.str16, str->len, h);
+        return hash_string16(str16_ptr(str), str->len, seed);
     else
-        h = hash_string8(str->u.str8, str->len, h);
-    return h;
+        return hash_string8(str8_ptr(str), str->len, seed);
 }
 
-static uint32_t hash_string_rope(JSValueConst val, uint32_t h)
+/* Return the hash of a string value. It is the same as the hash of
+   the corresponding JS_ATOM_TYPE_STRING atom. The hash is cached in
+   the strings which are not atoms (0 = not computed). */
+static uint32_t js_string_get_hash(JSRuntime *rt, JSString *p)
 {
-    if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING) {
-        return hash_string(JS_VALUE_GET_STRING(val), h);
-    } else {
-        JSStringRope *r = JS_VALUE_GET_STRING_ROPE(val);
-        h = hash_string_rope(r->left, h);
-        return hash_string_rope(r->right, h);
-    }
+    uint32_t h;
+
+    if (p->atom_type == JS_ATOM_TYPE_STRING ||
+        (p->atom_type == 0 && p->hash != 0))
+        return p->hash;
+    h = hash_string(p, rt->hash_seed + JS_ATOM_TYPE_STRING) &
+        JS_ATOM_HASH_MASK;
+    if (p->atom_type == 0)
+        p->hash = h;
+    return h;
 }
 
 static __maybe_unused void JS_DumpChar(FILE *fo, int c, int sep)
@@ -3188,8 +3889,12 @@ static JSAtom __JS_NewAtom(JSRuntime *rt, JSString *str, int atom_type)
         }
         /* try and locate an already registered atom */
         len = str->len;
-        h = hash_string(str, atom_type);
-        h &= JS_ATOM_HASH_MASK;
+        if (atom_type == JS_ATOM_TYPE_STRING) {
+            h = js_string_get_hash(rt, str);
+        } else {
+            h = hash_string(str, rt->hash_seed + atom_type);
+            h &= JS_ATOM_HASH_MASK;
+        }
         h1 = h & (rt->atom_hash_size - 1);
         i = rt->atom_hash[h1];
         while (i != 0) {
@@ -3262,23 +3967,26 @@ static JSAtom __JS_NewAtom(JSRuntime *rt, JSString *str, int atom_type)
     }
 
     if (str) {
-        if (str->atom_type == 0) {
+        if (str->atom_type == 0 && !str->is_external) {
             p = str;
             p->atom_type = atom_type;
         } else {
+            /* the external strings are copied */
             p = js_malloc_rt(rt, sizeof(JSString) +
                              (str->len << str->is_wide_char) +
                              1 - str->is_wide_char);
             if (unlikely(!p))
                 goto fail;
             js_rc(p)->ref_count = 1;
+            p->is_external = 0;
             p->is_wide_char = str->is_wide_char;
             p->len = str->len;
 #ifdef DUMP_LEAKS
             list_add_tail(&p->link, &rt->string_list);
 #endif
-            memcpy(p->u.str8, str->u.str8, (str->len << str->is_wide_char) +
-                   1 - str->is_wide_char);
+            memcpy(p->u.str8, str8_ptr(str), str->len << str->is_wide_char);
+            if (!str->is_wide_char)
+                p->u.str8[str->len] = '\0';
             js_free_string(rt, str);
         }
     } else {
@@ -3286,6 +3994,7 @@ static JSAtom __JS_NewAtom(JSRuntime *rt, JSString *str, int atom_type)
         if (!p)
             return JS_ATOM_NULL;
         js_rc(p)->ref_count = 1;
+        p->is_external = 0;
         p->is_wide_char = 1;    /* Hack to represent NULL as a JSString */
         p->len = 0;
 #ifdef DUMP_LEAKS
@@ -3342,7 +4051,8 @@ static JSAtom __JS_FindAtom(JSRuntime *rt, const char *str, size_t len,
     uint32_t h, h1, i;
     JSAtomStruct *p;
 
-    h = hash_string8((const uint8_t *)str, len, JS_ATOM_TYPE_STRING);
+    h = hash_string8((const uint8_t *)str, len,
+                     rt->hash_seed + JS_ATOM_TYPE_STRING);
     h &= JS_ATOM_HASH_MASK;
     h1 = h & (rt->atom_hash_size - 1);
     i = rt->atom_hash[h1];
@@ -3404,6 +4114,7 @@ static void JS_FreeAtomStruct(JSRuntime *rt, JSAtomStruct *p)
         p->hash != JS_ATOM_HASH_PRIVATE && p->hash != 0) {
         /* live weak references are still present on this object: keep
            it */
+        js_weak_target_set_dead(rt, p->hash);
     } else {
         js_free_rt(rt, p);
     }
@@ -3436,12 +4147,15 @@ static JSAtom JS_NewAtomStr(JSContext *ctx, JSString *p)
     return __JS_NewAtom(rt, p, JS_ATOM_TYPE_STRING);
 }
 
-/* XXX: optimize */
+/* the ASCII characters are tested 8 at a time */
 static size_t count_ascii(const uint8_t *buf, size_t len)
 {
     const uint8_t *p, *p_end;
     p = buf;
     p_end = buf + len;
+    while (p_end - p >= 8 &&
+           (get_u64(p) & 0x8080808080808080) == 0)
+        p += 8;
     while (p < p_end && *p < 128)
         p++;
     return p - buf;
@@ -3585,11 +4299,8 @@ static const char *JS_AtomGetStr(JSContext *ctx, char *buf, int buf_size, JSAtom
 
 static JSValue __JS_AtomToValue(JSContext *ctx, JSAtom atom, BOOL force_string)
 {
-    char buf[ATOM_GET_STR_BUF_SIZE];
-
     if (__JS_AtomIsTaggedInt(atom)) {
-        size_t len = u32toa(buf, __JS_AtomToUInt32(atom));
-        return js_new_string8_len(ctx, buf, len);
+        return js_new_string_int32(ctx, __JS_AtomToUInt32(atom));
     } else {
         JSRuntime *rt = ctx->rt;
         JSAtomStruct *p;
@@ -3911,6 +4622,8 @@ int JS_NewClass(JSRuntime *rt, JSClassID class_id, const JSClassDef *class_def)
     return ret;
 }
 
+static JSValue js_new_string_char(JSContext *ctx, uint16_t c);
+
 static JSValue js_new_string8_len(JSContext *ctx, const char *buf, int len)
 {
     JSString *str;
@@ -3918,6 +4631,8 @@ static JSValue js_new_string8_len(JSContext *ctx, const char *buf, int len)
     if (len <= 0) {
         return JS_AtomToString(ctx, JS_ATOM_empty_string);
     }
+    if (len == 1)
+        return js_new_string_char(ctx, (uint8_t)buf[0]);
     str = js_alloc_string(ctx, len, 0);
     if (!str)
         return JS_EXCEPTION;
@@ -3941,43 +4656,93 @@ static JSValue js_new_string16_len(JSContext *ctx, const uint16_t *buf, int len)
     return JS_MKPTR(JS_TAG_STRING, str);
 }
 
+/* the one character strings in the Latin-1 range are shared so that
+   str[i], charAt() or split('') do not allocate memory */
 static JSValue js_new_string_char(JSContext *ctx, uint16_t c)
 {
     if (c < 0x100) {
-        uint8_t ch8 = c;
-        return js_new_string8_len(ctx, (const char *)&ch8, 1);
+        JSRuntime *rt = ctx->rt;
+        JSString *str = rt->char_string_cache[c];
+        if (unlikely(!str)) {
+            str = js_alloc_string(ctx, 1, 0);
+            if (!str)
+                return JS_EXCEPTION;
+            str->u.str8[0] = c;
+            str->u.str8[1] = '\0';
+            rt->char_string_cache[c] = str;
+        }
+        js_rc(str)->ref_count++;
+        return JS_MKPTR(JS_TAG_STRING, str);
     } else {
         uint16_t ch16 = c;
         return js_new_string16_len(ctx, &ch16, 1);
     }
 }
 
+/* the strings of the small positive integers are shared so that the
+   array index to string conversions do not allocate memory */
+static JSValue js_new_string_int32(JSContext *ctx, int32_t n)
+{
+    JSRuntime *rt = ctx->rt;
+    JSString *str;
+    JSValue val;
+    char buf[16];
+    size_t len;
+
+    if ((uint32_t)n < JS_INT_STRING_CACHE_SIZE) {
+        if (unlikely(!rt->int_string_cache)) {
+            rt->int_string_cache =
+                js_mallocz_rt(rt, sizeof(rt->int_string_cache[0]) *
+                              JS_INT_STRING_CACHE_SIZE);
+            if (!rt->int_string_cache)
+                goto no_cache;
+        }
+        str = rt->int_string_cache[n];
+        if (unlikely(!str)) {
+            len = u32toa(buf, n);
+            val = js_new_string8_len(ctx, buf, len);
+            if (JS_IsException(val))
+                return val;
+            str = JS_VALUE_GET_STRING(val);
+            rt->int_string_cache[n] = str;
+        }
+        js_rc(str)->ref_count++;
+        return JS_MKPTR(JS_TAG_STRING, str);
+    }
+ no_cache:
+    len = i32toa(buf, n);
+    return js_new_string8_len(ctx, buf, len);
+}
+
 static JSValue js_sub_string(JSContext *ctx, JSString *p, int start, int end)
 {
     int len = end - start;
     if (start == 0 && end == p->len) {
         return JS_DupValue(ctx, JS_MKPTR(JS_TAG_STRING, p));
     }
+    if (len == 1) {
+        return js_new_string_char(ctx, string_get(p, start));
+    }
     if (p->is_wide_char && len > 0) {
         JSString *str;
         int i;
         uint16_t c = 0;
         for (i = start; i < end; i++) {
-            c |= p->u.str16[i];
+            c |= str16_ptr(p)[i];
         }
         if (c > 0xFF)
-            return js_new_string16_len(ctx, p->u.str16 + start, len);
+            return js_new_string16_len(ctx, str16_ptr(p) + start, len);
 
         str = js_alloc_string(ctx, len, 0);
         if (!str)
             return JS_EXCEPTION;
         for (i = 0; i < len; i++) {
-            str->u.str8[i] = p->u.str16[start + i];
+            str->u.str8[i] = str16_ptr(p)[start + i];
         }
         str->u.str8[len] = '\0';
         return JS_MKPTR(JS_TAG_STRING, str);
     } else {
-        return js_new_string8_len(ctx, (const char *)(p->u.str8 + start), len);
+        return js_new_string8_len(ctx, (const char *)(str8_ptr(p) + start), len);
     }
 }
 
@@ -4168,16 +4933,16 @@ static int string_getc(const JSString *p, int *pidx)
     int idx, c, c1;
     idx = *pidx;
     if (p->is_wide_char) {
-        c = p->u.str16[idx++];
+        c = str16_ptr(p)[idx++];
         if (is_hi_surrogate(c) && idx < p->len) {
-            c1 = p->u.str16[idx];
+            c1 = str16_ptr(p)[idx];
             if (is_lo_surrogate(c1)) {
                 c = from_surrogate(c, c1);
                 idx++;
             }
         }
     } else {
-        c = p->u.str8[idx++];
+        c = str8_ptr(p)[idx++];
     }
     *pidx = idx;
     return c;
@@ -4241,9 +5006,9 @@ static int string_buffer_concat(StringBuffer *s, const JSString *p,
     if (to <= from)
         return 0;
     if (p->is_wide_char)
-        return string_buffer_write16(s, p->u.str16 + from, to - from);
+        return string_buffer_write16(s, str16_ptr(p) + from, to - from);
     else
-        return string_buffer_write8(s, p->u.str8 + from, to - from);
+        return string_buffer_write8(s, str8_ptr(p) + from, to - from);
 }
 
 static int string_buffer_concat_value(StringBuffer *s, JSValueConst v)
@@ -4345,12 +5110,60 @@ static JSValue string_buffer_end(StringBuffer *s)
 }
 
 /* create a string from a UTF-8 buffer */
-JSValue JS_NewStringLen(JSContext *ctx, const char *buf, size_t buf_len)
+/* Decode the UTF-8 sequence at '*pp' whose first byte is not
+   ASCII. Return 0xfffd if it is invalid. */
+static inline uint32_t utf8_decode_non_ascii(const uint8_t **pp,
+                                             const uint8_t *p_end)
 {
-    const uint8_t *p, *p_end, *p_start, *p_next;
+    const uint8_t *p = *pp, *p_next;
     uint32_t c;
-    StringBuffer b_s, *b = &b_s;
-    size_t len1;
+
+    /* fast path for the valid 2 and 3 byte sequences */
+    c = p[0];
+    if (c >= 0xc2 && c < 0xe0 && p_end - p >= 2 && (p[1] & 0xc0) == 0x80) {
+        *pp = p + 2;
+        return ((c & 0x1f) << 6) | (p[1] & 0x3f);
+    }
+    if (c >= 0xe0 && c < 0xf0 && p_end - p >= 3 &&
+        (p[1] & 0xc0) == 0x80 && (p[2] & 0xc0) == 0x80) {
+        c = ((c & 0x0f) << 12) | ((p[1] & 0x3f) << 6) | (p[2] & 0x3f);
+        if (c >= 0x800) {
+            *pp = p + 3;
+            return c;
+        }
+    }
+    /* parse utf-8 sequence, return 0xFFFFFFFF for error */
+    c = unicode_from_utf8(p, p_end - p, &p_next);
+    if (c <= 0x10FFFF) {
+        p = p_next;
+    } else {
+        /* invalid char */
+        c = 0xfffd;
+        /* skip the invalid chars */
+        /* XXX: seems incorrect. Why not just use c = *p++; ? */
+        while (p < p_end && (*p >= 0x80 && *p < 0xc0))
+            p++;
+        if (p < p_end) {
+            p++;
+            while (p < p_end && (*p >= 0x80 && *p < 0xc0))
+                p++;
+        }
+    }
+    *pp = p;
+    return c;
+}
+
+/* The UTF-8 string is decoded in two passes: the first one computes
+   the length and tells whether the result fits in 8 bits, then the
+   characters are directly written to the string. */
+JSValue JS_NewStringLen(JSContext *ctx, const char *buf, size_t buf_len)
+{
+    const uint8_t *p, *p_end, *p_start;
+    uint32_t c, c_max;
+    size_t len, len1;
+    JSString *str;
+    uint8_t *q8;
+    uint16_t *q16;
 
     p_start = (const uint8_t *)buf;
     p_end = p_start + buf_len;
@@ -4361,45 +5174,406 @@ JSValue JS_NewStringLen(JSContext *ctx, const char *buf, size_t buf_len)
     if (p == p_end) {
         /* ASCII string */
         return js_new_string8_len(ctx, buf, buf_len);
-    } else {
+    }
+
+    len = len1;
+    c_max = 0;
+    /* If the first non-ASCII character is below 0x100, the text is
+       likely Latin-1: it is decoded in a single pass into an 8 bit
+       buffer of 'buf_len' characters. The two passes are used if a
+       larger character is found. */
+    if (*p < 0xc4 && buf_len <= JS_STRING_LEN_MAX) {
+        StringBuffer b_s, *b = &b_s;
         if (string_buffer_init(ctx, b, buf_len))
-            goto fail;
-        string_buffer_write8(b, p_start, len1);
+            return JS_EXCEPTION;
+        q8 = b->str->u.str8;
+        memcpy(q8, p_start, len1);
+        q8 += len1;
         while (p < p_end) {
             if (*p < 128) {
-                string_buffer_putc8(b, *p++);
+                len1 = count_ascii(p, p_end - p);
+                memcpy(q8, p, len1);
+                p += len1;
+                q8 += len1;
             } else {
-                /* parse utf-8 sequence, return 0xFFFFFFFF for error */
-                c = unicode_from_utf8(p, p_end - p, &p_next);
-                if (c < 0x10000) {
-                    p = p_next;
-                } else if (c <= 0x10FFFF) {
-                    p = p_next;
-                    /* surrogate pair */
-                    string_buffer_putc16(b, get_hi_surrogate(c));
+                c = utf8_decode_non_ascii(&p, p_end);
+                if (c >= 0x100) {
+                    len = q8 - b->str->u.str8 + 1 + (c >= 0x10000);
+                    c_max = c;
+                    break;
+                }
+                *q8++ = c;
+            }
+        }
+        if (c_max == 0) {
+            b->len = q8 - b->str->u.str8;
+            if (b->len != 1)
+                return string_buffer_end(b);
+            c = b->str->u.str8[0];
+        }
+        string_buffer_free(b);
+        if (c_max == 0)
+            return js_new_string_char(ctx, c);
+    }
+    while (p < p_end) {
+        if (*p < 128) {
+            len1 = count_ascii(p, p_end - p);
+            p += len1;
+            len += len1;
+        } else {
+            c = utf8_decode_non_ascii(&p, p_end);
+            c_max = max_uint32(c_max, c);
+            /* surrogate pair if c >= 0x10000 */
+            len += 1 + (c >= 0x10000);
+        }
+    }
+    if (len > JS_STRING_LEN_MAX)
+        return JS_ThrowInternalError(ctx, "string too long");
+    if (len == 1 && c_max < 0x100)
+        return js_new_string_char(ctx, c_max);
+
+    str = js_alloc_string(ctx, len, c_max >= 0x100);
+    if (!str)
+        return JS_EXCEPTION;
+    p = p_start;
+    if (!str->is_wide_char) {
+        /* Latin-1 string */
+        q8 = str->u.str8;
+        while (p < p_end) {
+            if (*p < 128) {
+                len1 = count_ascii(p, p_end - p);
+                memcpy(q8, p, len1);
+                p += len1;
+                q8 += len1;
+            } else {
+                *q8++ = utf8_decode_non_ascii(&p, p_end);
+            }
+        }
+        *q8 = '\0';
+    } else {
+        q16 = str->u.str16;
+        while (p < p_end) {
+            if (*p < 128) {
+                *q16++ = *p++;
+            } else {
+                c = utf8_decode_non_ascii(&p, p_end);
+                if (c >= 0x10000) {
+                    *q16++ = get_hi_surrogate(c);
                     c = get_lo_surrogate(c);
-                } else {
-                    /* invalid char */
-                    c = 0xfffd;
-                    /* skip the invalid chars */
-                    /* XXX: seems incorrect. Why not just use c = *p++; ? */
-                    while (p < p_end && (*p >= 0x80 && *p < 0xc0))
-                        p++;
-                    if (p < p_end) {
-                        p++;
-                        while (p < p_end && (*p >= 0x80 && *p < 0xc0))
-                            p++;
-                    }
                 }
-                string_buffer_putc16(b, c);
+                *q16++ = c;
             }
         }
     }
-    return string_buffer_end(b);
+    return JS_MKPTR(JS_TAG_STRING, str);
+}
 
- fail:
-    string_buffer_free(b);
-    return JS_EXCEPTION;
+static JSValue js_new_external_string(JSContext *ctx, const void *ptr,
+                                      size_t len, int is_wide_char,
+                                      JSFreeExternalStringFunc *free_func,
+                                      void *opaque)
+{
+    JSStringExternal *es;
+    JSString *p;
+
+    if (len > JS_STRING_LEN_MAX)
+        return JS_ThrowInternalError(ctx, "string too long");
+    if (len == 0) {
+        if (free_func)
+            free_func(ctx->rt, opaque, (void *)ptr);
+        return JS_AtomToString(ctx, JS_ATOM_empty_string);
+    }
+    es = js_malloc(ctx, sizeof(*es));
+    if (!es)
+        return JS_EXCEPTION;
+    p = &es->str;
+    js_rc(p)->ref_count = 1;
+    p->is_external = 1;
+    p->is_wide_char = is_wide_char;
+    p->len = len;
+    p->atom_type = 0;
+    p->hash = 0;
+    p->hash_next = 0;
+#ifdef DUMP_LEAKS
+    list_add_tail(&p->link, &ctx->rt->string_list);
+#endif
+    es->ptr = ptr;
+    es->free_func = free_func;
+    es->opaque = opaque;
+    return JS_MKPTR(JS_TAG_STRING, p);
+}
+
+/* Create a string whose 'len' Latin-1 characters stay in 'buf' until
+   'free_func' is called. In case of exception, the caller keeps the
+   ownership of 'buf'. */
+JSValue JS_NewExternalStringLatin1(JSContext *ctx, const uint8_t *buf,
+                                   size_t len,
+                                   JSFreeExternalStringFunc *free_func,
+                                   void *opaque)
+{
+    return js_new_external_string(ctx, buf, len, 0, free_func, opaque);
+}
+
+/* same as JS_NewExternalStringLatin1() with 'len' UTF-16 code units */
+JSValue JS_NewExternalStringUTF16(JSContext *ctx, const uint16_t *buf,
+                                  size_t len,
+                                  JSFreeExternalStringFunc *free_func,
+                                  void *opaque)
+{
+    return js_new_external_string(ctx, buf, len, 1, free_func, opaque);
+}
+
+/* public interface to StringBuffer */
+
+/* JSStringBuilder.utf8_skip values */
+enum {
+    JS_UTF8_SKIP_NONE,
+    JS_UTF8_SKIP_FIRST, /* skip the continuation bytes and the next byte */
+    JS_UTF8_SKIP_TRAIL, /* skip the continuation bytes */
+};
+
+struct JSStringBuilder {
+    StringBuffer b;
+    /* start of a UTF-8 sequence split between two
+       JS_StringBuilderPutUTF8() calls */
+    uint8_t utf8_buf[UTF8_CHAR_LEN_MAX];
+    int utf8_len;
+    /* state of the skipping of an invalid UTF-8 sequence which may
+       continue in the next JS_StringBuilderPutUTF8() call */
+    int utf8_skip;
+};
+
+/* 'size_hint' is the expected number of UTF-16 code units. Return
+   NULL in case of exception. */
+JSStringBuilder *JS_NewStringBuilder(JSContext *ctx, size_t size_hint)
+{
+    JSStringBuilder *sb;
+
+    if (size_hint > JS_STRING_LEN_MAX)
+        size_hint = JS_STRING_LEN_MAX;
+    sb = js_malloc(ctx, sizeof(*sb));
+    if (!sb)
+        return NULL;
+    sb->utf8_len = 0;
+    sb->utf8_skip = JS_UTF8_SKIP_NONE;
+    if (string_buffer_init(ctx, &sb->b, size_hint)) {
+        js_free(ctx, sb);
+        return NULL;
+    }
+    return sb;
+}
+
+/* return the length of the UTF-8 sequence accepted by
+   unicode_from_utf8() starting with 'c' or 0 if 'c' cannot start a
+   multi-byte sequence */
+static int utf8_lead_len(uint32_t c)
+{
+    if (c >= 0xc0 && c < 0xe0)
+        return 2;
+    else if (c >= 0xe0 && c < 0xf0)
+        return 3;
+    else if (c >= 0xf0 && c < 0xf8)
+        return 4;
+    else if (c >= 0xf8 && c < 0xfc)
+        return 5;
+    else if (c >= 0xfc && c < 0xfe)
+        return 6;
+    else
+        return 0;
+}
+
+/* an incomplete UTF-8 sequence is replaced by U+FFFD if it is not
+   continued by the next put operation */
+static int js_string_builder_flush_utf8(JSStringBuilder *sb)
+{
+    sb->utf8_skip = JS_UTF8_SKIP_NONE;
+    if (sb->utf8_len == 0)
+        return 0;
+    sb->utf8_len = 0;
+    return string_buffer_putc16(&sb->b, 0xfffd);
+}
+
+static int js_string_builder_check_len(JSStringBuilder *sb, size_t len)
+{
+    StringBuffer *s = &sb->b;
+    if (s->error_status)
+        return -1;
+    if (unlikely(len > JS_STRING_LEN_MAX)) {
+        JS_ThrowInternalError(s->ctx, "string too long");
+        return string_buffer_set_error(s);
+    }
+    return js_string_builder_flush_utf8(sb);
+}
+
+/* All the JS_StringBuilderPut functions return -1 in case of
+   exception. The following calls are then ignored and
+   JS_StringBuilderFinish() returns JS_EXCEPTION. */
+
+/* 0 <= c <= 0x10ffff */
+int JS_StringBuilderPutc(JSStringBuilder *sb, uint32_t c)
+{
+    if (js_string_builder_flush_utf8(sb))
+        return -1;
+    return string_buffer_putc(&sb->b, c);
+}
+
+int JS_StringBuilderPutLatin1(JSStringBuilder *sb, const uint8_t *buf,
+                              size_t len)
+{
+    if (js_string_builder_check_len(sb, len))
+        return -1;
+    return string_buffer_write8(&sb->b, buf, len);
+}
+
+int JS_StringBuilderPutUTF16(JSStringBuilder *sb, const uint16_t *buf,
+                             size_t len)
+{
+    if (js_string_builder_check_len(sb, len))
+        return -1;
+    return string_buffer_write16(&sb->b, buf, len);
+}
+
+/* Invalid UTF-8 sequences are replaced by U+FFFD as in
+   JS_NewStringLen(). The sequences may be split between two calls:
+   the result does not depend on the split positions. */
+int JS_StringBuilderPutUTF8(JSStringBuilder *sb, const char *buf,
+                            size_t len)
+{
+    const uint8_t *p, *p_end, *p_next;
+    size_t len1;
+    int c, n;
+
+    if (sb->b.error_status)
+        return -1;
+    p = (const uint8_t *)buf;
+    p_end = p + len;
+    for(;;) {
+        if (sb->utf8_skip != JS_UTF8_SKIP_NONE) {
+            /* same rule as utf8_decode_non_ascii() */
+            while (p < p_end && (*p & 0xc0) == 0x80)
+                p++;
+            if (p == p_end)
+                break;
+            if (sb->utf8_skip == JS_UTF8_SKIP_FIRST) {
+                /* the first byte after the continuation bytes is
+                   also skipped */
+                p++;
+                sb->utf8_skip = JS_UTF8_SKIP_TRAIL;
+                continue;
+            }
+            sb->utf8_skip = JS_UTF8_SKIP_NONE;
+        }
+        if (sb->utf8_len != 0) {
+            /* complete the pending sequence */
+            n = utf8_lead_len(sb->utf8_buf[0]);
+            while (sb->utf8_len < n && p < p_end && (*p & 0xc0) == 0x80)
+                sb->utf8_buf[sb->utf8_len++] = *p++;
+            if (sb->utf8_len < n && p == p_end)
+                break;
+            c = unicode_from_utf8(sb->utf8_buf, sb->utf8_len, &p_next);
+            sb->utf8_len = 0;
+            if (c < 0 || c > 0x10ffff) {
+                /* the lead byte and the continuation bytes are skipped */
+                c = 0xfffd;
+                sb->utf8_skip = JS_UTF8_SKIP_TRAIL;
+            }
+            if (string_buffer_putc(&sb->b, c))
+                return -1;
+            continue;
+        }
+        if (p == p_end)
+            break;
+        if (*p < 128) {
+            /* the run is capped so that its length fits in an int. A
+               longer run makes string_buffer_realloc() fail with
+               "string too long". */
+            len1 = p_end - p;
+            if (len1 > JS_STRING_LEN_MAX)
+                len1 = JS_STRING_LEN_MAX;
+            len1 = count_ascii(p, len1);
+            if (string_buffer_write8(&sb->b, p, len1))
+                return -1;
+            p += len1;
+            continue;
+        }
+        /* fast path for the valid 2 and 3 byte sequences */
+        c = *p;
+        if (c >= 0xc2 && c < 0xe0 && p_end - p >= 2 &&
+            (p[1] & 0xc0) == 0x80) {
+            if (string_buffer_putc16(&sb->b, ((c & 0x1f) << 6) | (p[1] & 0x3f)))
+                return -1;
+            p += 2;
+            continue;
+        }
+        if (c >= 0xe0 && c < 0xf0 && p_end - p >= 3 &&
+            (p[1] & 0xc0) == 0x80 && (p[2] & 0xc0) == 0x80) {
+            c = ((c & 0x0f) << 12) | ((p[1] & 0x3f) << 6) | (p[2] & 0x3f);
+            if (c >= 0x800) {
+                if (string_buffer_putc16(&sb->b, c))
+                    return -1;
+                p += 3;
+                continue;
+            }
+        }
+        n = utf8_lead_len(*p);
+        if (n > p_end - p) {
+            /* keep the start of the sequence if the next bytes may
+               complete it */
+            for(p_next = p + 1; p_next < p_end; p_next++) {
+                if ((*p_next & 0xc0) != 0x80)
+                    break;
+            }
+            if (p_next == p_end) {
+                memcpy(sb->utf8_buf, p, p_end - p);
+                sb->utf8_len = p_end - p;
+                break;
+            }
+        }
+        c = unicode_from_utf8(p, p_end - p, &p_next);
+        if (c >= 0 && c <= 0x10ffff) {
+            p = p_next;
+        } else {
+            c = 0xfffd;
+            if ((*p & 0xc0) == 0x80) {
+                sb->utf8_skip = JS_UTF8_SKIP_FIRST;
+            } else {
+                p++;
+                sb->utf8_skip = JS_UTF8_SKIP_TRAIL;
+            }
+        }
+        if (string_buffer_putc(&sb->b, c))
+            return -1;
+    }
+    return 0;
+}
+
+/* append 'val' converted to a string */
+int JS_StringBuilderPutValue(JSStringBuilder *sb, JSValueConst val)
+{
+    if (js_string_builder_flush_utf8(sb))
+        return -1;
+    return string_buffer_concat_value(&sb->b, val);
+}
+
+/* Return the built string and free 'sb' */
+JSValue JS_StringBuilderFinish(JSStringBuilder *sb)
+{
+    JSContext *ctx = sb->b.ctx;
+    JSValue val;
+
+    js_string_builder_flush_utf8(sb);
+    val = string_buffer_end(&sb->b);
+    js_free(ctx, sb);
+    return val;
+}
+
+/* free 'sb' without building the string */
+void JS_FreeStringBuilder(JSStringBuilder *sb)
+{
+    JSContext *ctx = sb->b.ctx;
+
+    string_buffer_free(&sb->b);
+    js_free(ctx, sb);
 }
 
 static JSValue JS_ConcatString3(JSContext *ctx, const char *str1,
@@ -4464,20 +5638,25 @@ const char *JS_ToCStringLen2(JSContext *ctx, size_t *plen, JSValueConst val1, BO
     str = JS_VALUE_GET_STRING(val);
     len = str->len;
     if (!str->is_wide_char) {
-        const uint8_t *src = str->u.str8;
+        const uint8_t *src = str8_ptr(str);
         int count;
 
         /* count the number of non-ASCII characters */
         /* Scanning the whole string is required for ASCII strings,
            and computing the number of non-ASCII bytes is less expensive
            than testing each byte, hence this method is faster for ASCII
-           strings, which is the most common case.
+           strings, which is the most common case. The bytes are
+           counted 8 at a time.
          */
         count = 0;
-        for (pos = 0; pos < len; pos++) {
+        for (pos = 0; len - pos >= 8; pos += 8) {
+            uint64_t v = (get_u64(src + pos) >> 7) & 0x0101010101010101;
+            count += (v * 0x0101010101010101) >> 56;
+        }
+        for (; pos < len; pos++) {
             count += src[pos] >> 7;
         }
-        if (count == 0) {
+        if (count == 0 && !str->is_external) {
             if (plen)
                 *plen = len;
             return (const char *)src;
@@ -4486,17 +5665,30 @@ const char *JS_ToCStringLen2(JSContext *ctx, size_t *plen, JSValueConst val1, BO
         if (!str_new)
             goto fail;
         q = str_new->u.str8;
-        for (pos = 0; pos < len; pos++) {
-            c = src[pos];
-            if (c < 0x80) {
-                *q++ = c;
+        pos = 0;
+        while (pos < len) {
+            /* copy the ASCII characters 8 at a time */
+            if (len - pos >= 8 &&
+                (get_u64(src + pos) & 0x8080808080808080) == 0) {
+                memcpy(q, src + pos, 8);
+                q += 8;
+                pos += 8;
             } else {
-                *q++ = (c >> 6) | 0xc0;
-                *q++ = (c & 0x3f) | 0x80;
+                /* the next 8 characters are converted one by one */
+                int pos_end = min_int(pos + 8, len);
+                for (; pos < pos_end; pos++) {
+                    c = src[pos];
+                    if (c < 0x80) {
+                        *q++ = c;
+                    } else {
+                        *q++ = (c >> 6) | 0xc0;
+                        *q++ = (c & 0x3f) | 0x80;
+                    }
+                }
             }
         }
     } else {
-        const uint16_t *src = str->u.str16;
+        const uint16_t *src = str16_ptr(str);
         /* Allocate 3 bytes per 16 bit code point. Surrogate pairs may
            produce 4 bytes but use 2 code points.
          */
@@ -4506,10 +5698,37 @@ const char *JS_ToCStringLen2(JSContext *ctx, size_t *plen, JSValueConst val1, BO
         q = str_new->u.str8;
         pos = 0;
         while (pos < len) {
-            c = src[pos++];
+            c = src[pos];
             if (c < 0x80) {
-                *q++ = c;
+                /* narrow the ASCII characters 4 at a time */
+                if (len - pos >= 4 &&
+                    (get_u64((const uint8_t *)(src + pos)) &
+                     0xff80ff80ff80ff80) == 0) {
+                    q[0] = c;
+                    q[1] = src[pos + 1];
+                    q[2] = src[pos + 2];
+                    q[3] = src[pos + 3];
+                    q += 4;
+                    pos += 4;
+                } else {
+                    *q++ = c;
+                    pos++;
+                }
+            } else if (!is_surrogate(c)) {
+                /* inline version of unicode_to_utf8() */
+                if (c < 0x800) {
+                    q[0] = (c >> 6) | 0xc0;
+                    q[1] = (c & 0x3f) | 0x80;
+                    q += 2;
+                } else {
+                    q[0] = (c >> 12) | 0xe0;
+                    q[1] = ((c >> 6) & 0x3f) | 0x80;
+                    q[2] = (c & 0x3f) | 0x80;
+                    q += 3;
+                }
+                pos++;
             } else {
+                pos++;
                 if (is_hi_surrogate(c)) {
                     if (pos < len && !cesu8) {
                         c1 = src[pos];
@@ -4581,14 +5800,14 @@ static int js_string_memcmp(const JSString *p1, int pos1, const JSString *p2,
 
     if (likely(!p1->is_wide_char)) {
         if (likely(!p2->is_wide_char))
-            res = memcmp(p1->u.str8 + pos1, p2->u.str8 + pos2, len);
+            res = memcmp(str8_ptr(p1) + pos1, str8_ptr(p2) + pos2, len);
         else
-            res = -memcmp16_8(p2->u.str16 + pos2, p1->u.str8 + pos1, len);
+            res = -memcmp16_8(str16_ptr(p2) + pos2, str8_ptr(p1) + pos1, len);
     } else {
         if (!p2->is_wide_char)
-            res = memcmp16_8(p1->u.str16 + pos1, p2->u.str8 + pos2, len);
+            res = memcmp16_8(str16_ptr(p1) + pos1, str8_ptr(p2) + pos2, len);
         else
-            res = memcmp16(p1->u.str16 + pos1, p2->u.str16 + pos2, len);
+            res = memcmp16(str16_ptr(p1) + pos1, str16_ptr(p2) + pos2, len);
     }
     return res;
 }
@@ -4624,9 +5843,9 @@ static int js_string_compare(JSContext *ctx,
 static void copy_str16(uint16_t *dst, const JSString *p, int offset, int len)
 {
     if (p->is_wide_char) {
-        memcpy(dst, p->u.str16 + offset, len * 2);
+        memcpy(dst, str16_ptr(p) + offset, len * 2);
     } else {
-        const uint8_t *src1 = p->u.str8 + offset;
+        const uint8_t *src1 = str8_ptr(p) + offset;
         int i;
 
         for(i = 0; i < len; i++)
@@ -4649,8 +5868,8 @@ static JSValue JS_ConcatString1(JSContext *ctx,
     if (!p)
         return JS_EXCEPTION;
     if (!is_wide_char) {
-        memcpy(p->u.str8, p1->u.str8, p1->len);
-        memcpy(p->u.str8 + p1->len, p2->u.str8, p2->len);
+        memcpy(p->u.str8, str8_ptr(p1), p1->len);
+        memcpy(p->u.str8 + p1->len, str8_ptr(p2), p2->len);
         p->u.str8[len] = '\0';
     } else {
         copy_str16(p->u.str16, p1, 0, p1->len);
@@ -4659,40 +5878,81 @@ static JSValue JS_ConcatString1(JSContext *ctx,
     return JS_MKPTR(JS_TAG_STRING, p);
 }
 
-static BOOL JS_ConcatStringInPlace(JSContext *ctx, JSString *p1, JSValueConst op2) {
-    if (JS_VALUE_GET_TAG(op2) == JS_TAG_STRING) {
-        JSString *p2 = JS_VALUE_GET_STRING(op2);
-        size_t size1;
+/* Append the string 'op2' to 'p1' by modifying p1. p1 must not be
+   referenced outside of the caller, which must replace its references
+   to p1 by the returned string. If 'grow' is TRUE, the memory block is
+   grown geometrically so that repeated appends take an amortized
+   constant time. The spare capacity is given by the allocator. Return
+   NULL if the string cannot be modified in place. */
+static JSString *js_string_append_in_place(JSContext *ctx, JSString *p1,
+                                           JSValueConst op2, BOOL grow)
+{
+    JSString *p2, *p;
+    size_t size1, new_size, new_len, cap;
+    uint32_t i;
 
-        if (p2->len == 0)
-            return TRUE;
-        if (js_rc(p1)->ref_count != 1)
-            return FALSE;
+    if (JS_VALUE_GET_TAG(op2) != JS_TAG_STRING)
+        return NULL;
+    p2 = JS_VALUE_GET_STRING(op2);
+    if (p2->len == 0)
+        return p1;
+    if (p1->atom_type || p1->is_external)
+        return NULL;
+    new_len = p1->len + p2->len;
+    if (new_len > JS_STRING_LEN_MAX)
+        return NULL;
+    cap = min_int(max_int(new_len, p1->len + p1->len / 2), JS_STRING_LEN_MAX);
+    if (p1->is_wide_char || !p2->is_wide_char) {
         size1 = js_malloc_usable_size(ctx, p1);
+        new_size = sizeof(JSString) + (new_len << p1->is_wide_char) +
+            1 - p1->is_wide_char;
+        if (size1 < new_size) {
+            if (!grow)
+                return NULL;
+#ifdef DUMP_LEAKS
+            list_del(&p1->link);
+#endif
+            p = js_realloc_rt(ctx->rt, p1, sizeof(JSString) +
+                              (cap << p1->is_wide_char) + 1 - p1->is_wide_char);
+#ifdef DUMP_LEAKS
+            list_add_tail(&(p ? p : p1)->link, &ctx->rt->string_list);
+#endif
+            if (!p)
+                return NULL;
+            p1 = p;
+        }
         if (p1->is_wide_char) {
-            if (size1 >= sizeof(*p1) + ((p1->len + p2->len) << 1)) {
-                if (p2->is_wide_char) {
-                    memcpy(p1->u.str16 + p1->len, p2->u.str16, p2->len << 1);
-                    p1->len += p2->len;
-                    return TRUE;
-                } else {
-                    size_t i;
-                    for (i = 0; i < p2->len; i++) {
-                        p1->u.str16[p1->len++] = p2->u.str8[i];
-                    }
-                    return TRUE;
-                }
-            }
-        } else if (!p2->is_wide_char) {
-            if (size1 >= sizeof(*p1) + p1->len + p2->len + 1) {
-                memcpy(p1->u.str8 + p1->len, p2->u.str8, p2->len);
-                p1->len += p2->len;
-                p1->u.str8[p1->len] = '\0';
-                return TRUE;
+            if (p2->is_wide_char) {
+                memcpy(p1->u.str16 + p1->len, str16_ptr(p2), p2->len << 1);
+            } else {
+                const uint8_t *src = str8_ptr(p2);
+                for(i = 0; i < p2->len; i++)
+                    p1->u.str16[p1->len + i] = src[i];
             }
+        } else {
+            memcpy(p1->u.str8 + p1->len, str8_ptr(p2), p2->len);
+            p1->u.str8[new_len] = '\0';
         }
+        p1->len = new_len;
+        p1->hash = 0; /* the cached hash is no longer valid */
+        return p1;
+    } else {
+        /* the string must be converted to 16 bits */
+        if (!grow)
+            return NULL;
+        p = js_alloc_string_rt(ctx->rt, cap, 1);
+        if (!p)
+            return NULL;
+        copy_str16(p->u.str16, p1, 0, p1->len);
+        copy_str16(p->u.str16 + p1->len, p2, 0, p2->len);
+        p->len = new_len;
+        js_rc(p)->ref_count = js_rc(p1)->ref_count;
+#ifdef DUMP_LEAKS
+        list_del(&p1->link);
+#endif
+        js_free_rt(ctx->rt, p1);
+        return p;
     }
-    return FALSE;
 }
 
 static JSValue JS_ConcatString2(JSContext *ctx, JSValue op1, JSValue op2)
@@ -4700,7 +5960,8 @@ static JSValue JS_ConcatString2(JSContext *ctx, JSValue op1, JSValue op2)
     JSValue ret;
     JSString *p1, *p2;
     p1 = JS_VALUE_GET_STRING(op1);
-    if (JS_ConcatStringInPlace(ctx, p1, op2)) {
+    if (js_rc(p1)->ref_count == 1 &&
+        js_string_append_in_place(ctx, p1, op2, FALSE)) {
         JS_FreeValue(ctx, op2);
         return op1;
     }
@@ -4711,23 +5972,67 @@ static JSValue JS_ConcatString2(JSContext *ctx, JSValue op1, JSValue op2)
     return ret;
 }
 
-/* Return the character at position 'idx'. 'val' must be a string or rope */
-static int string_rope_get(JSValueConst val, uint32_t idx)
+static uint32_t string_rope_get_len(JSValueConst val)
 {
-    if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING) {
+    if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING)
+        return JS_VALUE_GET_STRING(val)->len;
+    else
+        return JS_VALUE_GET_STRING_ROPE(val)->len;
+}
+
+/* Return the character at position 'idx'. 'val' must be a string or
+   rope. The last accessed leaf is cached so that sequential accesses
+   do not need to walk the tree. */
+static int string_rope_get(JSRuntime *rt, JSValueConst val, uint32_t idx)
+{
+    JSStringRope *r, *r0;
+    JSString *p;
+    uint32_t len, start;
+
+    if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING)
         return string_get(JS_VALUE_GET_STRING(val), idx);
-    } else {
-        JSStringRope *r = JS_VALUE_GET_STRING_ROPE(val);
-        uint32_t len;
-        if (JS_VALUE_GET_TAG(r->left) == JS_TAG_STRING)
-            len = JS_VALUE_GET_STRING(r->left)->len;
-        else
-            len = JS_VALUE_GET_STRING_ROPE(r->left)->len;
-        if (idx < len)
-            return string_rope_get(r->left, idx);
-        else
-            return string_rope_get(r->right, idx - len);
+    r0 = JS_VALUE_GET_STRING_ROPE(val);
+    if (rt->rope_cache_rope == r0 &&
+        (idx - rt->rope_cache_start) < rt->rope_cache_leaf->len) {
+        return string_get(rt->rope_cache_leaf, idx - rt->rope_cache_start);
+    }
+    start = 0;
+    while (JS_VALUE_GET_TAG(val) == JS_TAG_STRING_ROPE) {
+        r = JS_VALUE_GET_STRING_ROPE(val);
+        len = string_rope_get_len(r->left);
+        if (idx < len) {
+            val = r->left;
+        } else {
+            val = r->right;
+            idx -= len;
+            start += len;
+        }
+    }
+    p = JS_VALUE_GET_STRING(val);
+    rt->rope_cache_rope = r0;
+    rt->rope_cache_leaf = p;
+    rt->rope_cache_start = start;
+    return string_get(p, idx);
+}
+
+/* Return the code point at position '*pidx' and update '*pidx'. 'val'
+   must be a string or rope. */
+static int string_rope_getc(JSRuntime *rt, JSValueConst val, uint32_t *pidx)
+{
+    uint32_t idx;
+    int c, c1;
+
+    idx = *pidx;
+    c = string_rope_get(rt, val, idx++);
+    if (is_hi_surrogate(c) && idx < string_rope_get_len(val)) {
+        c1 = string_rope_get(rt, val, idx);
+        if (is_lo_surrogate(c1)) {
+            c = from_surrogate(c, c1);
+            idx++;
+        }
     }
+    *pidx = idx;
+    return c;
 }
 
 typedef struct {
@@ -4760,12 +6065,22 @@ static JSString *string_rope_iter_next(JSStringRopeIter *s)
     }
 }
 
-static uint32_t string_rope_get_len(JSValueConst val)
+/* same as js_string_get_hash() for a rope */
+static uint32_t js_string_rope_get_hash(JSRuntime *rt, JSValueConst val)
 {
-    if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING)
-        return JS_VALUE_GET_STRING(val)->len;
-    else
-        return JS_VALUE_GET_STRING_ROPE(val)->len;
+    StringHashState s;
+    JSStringRopeIter it;
+    JSString *p;
+
+    string_hash_init(&s, rt->hash_seed + JS_ATOM_TYPE_STRING);
+    string_rope_iter_init(&it, val);
+    while ((p = string_rope_iter_next(&it)) != NULL) {
+        if (p->is_wide_char)
+            string_hash_update16(&s, str16_ptr(p), p->len);
+        else
+            string_hash_update8(&s, str8_ptr(p), p->len);
+    }
+    return string_hash_final(&s) & JS_ATOM_HASH_MASK;
 }
 
 static int js_string_rope_compare(JSContext *ctx, JSValueConst op1,
@@ -4840,7 +6155,9 @@ static JSValue js_linearize_string_rope(JSContext *ctx, JSValue rope)
         goto fail;
     ret = string_buffer_end(b);
     if (js_rc(r)->ref_count > 1) {
-        /* update the rope so that it won't need to be linearized again */
+        /* update the rope so that it won't need to be linearized
+           again. The cached leaf may be freed. */
+        ctx->rt->rope_cache_rope = NULL;
         JS_FreeValue(ctx, r->left);
         JS_FreeValue(ctx, r->right);
         r->left = JS_DupValue(ctx, ret);
@@ -5587,7 +6904,7 @@ static __maybe_unused void JS_DumpShapes(JSRuntime *rt)
         }
     }
     /* dump non-hashed shapes */
-    list_for_each(el, &rt->gc_obj_list) {
+    gc_obj_list_for_each(el, rt) {
         gp = list_entry(el, JSGCObjectHeader, link);
         if (js_rc(gp)->gc_obj_type == JS_GC_OBJ_TYPE_JS_OBJECT) {
             p = (JSObject *)gp;
@@ -5608,9 +6925,12 @@ static JSValue JS_NewObjectFromShape(JSContext *ctx, JSShape *sh, JSClassID clas
     int i;
     
     js_trigger_gc(ctx->rt, sizeof(JSObject));
+    ctx->rt->alloc_sample_class_id = class_id;
     p = js_malloc(ctx, sizeof(JSObject));
-    if (unlikely(!p))
+    if (unlikely(!p)) {
+        ctx->rt->alloc_sample_class_id = 0;
         goto fail;
+    }
     p->class_id = class_id;
     p->is_std_array_prototype = 0;
     p->extensible = TRUE;
@@ -5621,10 +6941,11 @@ static JSValue JS_NewObjectFromShape(JSContext *ctx, JSShape *sh, JSClassID clas
     p->has_immutable_prototype = 0;
     p->tmp_mark = 0;
     p->is_HTMLDDA = 0;
-    p->weakref_count = 0;
+    p->weak_target = 0;
     p->u.opaque = NULL;
     p->shape = sh;
     p->prop = js_malloc(ctx, sizeof(JSProperty) * sh->prop_size);
+    ctx->rt->alloc_sample_class_id = 0;
     if (unlikely(!p->prop)) {
         js_free(ctx, p);
     fail:
@@ -6337,6 +7658,8 @@ static void free_object(JSRuntime *rt, JSObject *p)
 
     p->free_mark = 1; /* used to tell the object is invalid when
                          freeing cycles */
+    if (p->weak_target != 0)
+        js_weak_target_set_dead(rt, p->weak_target);
     /* free all the fields */
     sh = p->shape;
     pr = get_shape_prop(sh);
@@ -6365,7 +7688,7 @@ static void free_object(JSRuntime *rt, JSObject *p)
 
     remove_gc_object(&p->header);
     if (rt->gc_phase == JS_GC_PHASE_REMOVE_CYCLES) {
-        if (js_rc(p)->ref_count == 0 && p->weakref_count == 0) {
+        if (js_rc(p)->ref_count == 0 && p->weak_target == 0) {
             js_free_rt(rt, p);
         } else {
             /* keep the object structure because there are may be
@@ -6374,7 +7697,7 @@ static void free_object(JSRuntime *rt, JSObject *p)
         }
     } else {
         /* keep the object structure in case there are weak references to it */
-        if (p->weakref_count == 0) {
+        if (p->weak_target == 0) {
             js_free_rt(rt, p);
         } else {
             js_rc(p)->mark = 0; /* reset the mark so that the weakref can be freed */
@@ -6446,7 +7769,10 @@ void __JS_FreeValueRT(JSRuntime *rt, JSValue v)
 #ifdef DUMP_LEAKS
                 list_del(&p->link);
 #endif
-                js_free_rt(rt, p);
+                if (unlikely(p->is_external))
+                    js_free_external_string(rt, p);
+                else
+                    js_free_rt(rt, p);
             }
         }
         break;
@@ -6454,6 +7780,8 @@ void __JS_FreeValueRT(JSRuntime *rt, JSValue v)
         /* Note: recursion is acceptable because the rope depth is bounded */
         {
             JSStringRope *p = JS_VALUE_GET_STRING_ROPE(v);
+            if (rt->rope_cache_rope == p)
+                rt->rope_cache_rope = NULL;
             JS_FreeValueRT(rt, p->left);
             JS_FreeValueRT(rt, p->right);
             js_free_rt(rt, p);
@@ -6471,6 +7799,13 @@ void __JS_FreeValueRT(JSRuntime *rt, JSValue v)
                 if (rt->gc_phase == JS_GC_PHASE_NONE) {
                     free_zero_refcount(rt);
                 }
+            } else if (js_rc(p)->mark == 0) {
+                /* object outside the freed cycles which was only
+                   referenced by them (e.g. an old object referenced
+                   by a young cycle): free it with the cycles */
+                list_del(&p->link);
+                list_add_tail(&p->link, &rt->tmp_obj_list);
+                js_rc(p)->mark = 1;
             }
         }
         break;
@@ -6498,29 +7833,40 @@ void __JS_FreeValue(JSContext *ctx, JSValue v)
 
 /* garbage collection */
 
+/* only the weak references to the targets freed since the last call
+   are examined */
 static void gc_remove_weak_objects(JSRuntime *rt)
 {
-    struct list_head *el;
+    JSWeakTarget *wt;
+    JSWeakRefLink *wl;
 
     /* add the freed objects to rt->gc_zero_ref_count_list so that
-       rt->weakref_list is not modified while we traverse it */
+       the weak references are not modified while we traverse them */
     rt->gc_phase = JS_GC_PHASE_DECREF; 
         
-    list_for_each(el, &rt->weakref_list) {
-        JSWeakRefHeader *wh = list_entry(el, JSWeakRefHeader, link);
-        switch(wh->weakref_type) {
-        case JS_WEAKREF_TYPE_MAP:
-            map_delete_weakrefs(rt, wh);
-            break;
-        case JS_WEAKREF_TYPE_WEAKREF:
-            weakref_delete_weakref(rt, wh);
-            break;
-        case JS_WEAKREF_TYPE_FINREC:
-            finrec_delete_weakref(rt, wh);
-            break;
-        default:
-            abort();
+    while (!list_empty(&rt->weak_dead_list)) {
+        wt = list_entry(rt->weak_dead_list.next, JSWeakTarget, u.dead_link);
+        list_del(&wt->u.dead_link);
+        /* each call removes at least 'wl' from wt->refs */
+        while (!list_empty(&wt->refs)) {
+            wl = list_entry(wt->refs.next, JSWeakRefLink, link);
+            switch(wl->wh->weakref_type) {
+            case JS_WEAKREF_TYPE_MAP:
+                map_delete_weakref(rt, wl);
+                break;
+            case JS_WEAKREF_TYPE_WEAKREF:
+                weakref_delete_weakref(rt, wl);
+                break;
+            case JS_WEAKREF_TYPE_FINREC:
+            case JS_WEAKREF_TYPE_FINREC_TOKEN:
+                finrec_delete_weakref(rt, wl);
+                break;
+            default:
+                abort();
+            }
         }
+        /* no longer referenced by the target */
+        js_weak_target_free(rt, wt);
     }
 
     rt->gc_phase = JS_GC_PHASE_NONE;
@@ -6532,8 +7878,25 @@ static void add_gc_object(JSRuntime *rt, JSGCObjectHeader *h,
                           JSGCObjectTypeEnum type)
 {
     js_rc(h)->mark = 0;
+    js_rc(h)->young = 1;
     js_rc(h)->gc_obj_type = type;
-    list_add_tail(&h->link, &rt->gc_obj_list);
+    list_add_tail(&h->link, &rt->gc_young_obj_list);
+    rt->gc_young_count++;
+}
+
+/* move the young GC objects to rt->gc_obj_list */
+static void gc_promote_young(JSRuntime *rt)
+{
+    struct list_head *el, *el1;
+    JSGCObjectHeader *p;
+
+    list_for_each_safe(el, el1, &rt->gc_young_obj_list) {
+        p = list_entry(el, JSGCObjectHeader, link);
+        js_rc(p)->young = 0;
+        list_del(&p->link);
+        list_add_tail(&p->link, &rt->gc_obj_list);
+    }
+    rt->gc_young_count = 0;
 }
 
 static void remove_gc_object(JSGCObjectHeader *h)
@@ -6685,20 +8048,33 @@ static void gc_decref_child(JSRuntime *rt, JSGCObjectHeader *p)
     }
 }
 
-static void gc_decref(JSRuntime *rt)
+/* the old objects are not candidates for removal: the references
+   to them are kept */
+static void gc_decref_young_child(JSRuntime *rt, JSGCObjectHeader *p)
 {
-    struct list_head *el, *el1;
+    if (js_rc(p)->young)
+        gc_decref_child(rt, p);
+}
+
+/* if 'young_only' is TRUE, only the young objects are considered and
+   the references from the old objects are handled as external
+   references. */
+static void gc_decref(JSRuntime *rt, BOOL young_only)
+{
+    struct list_head *el, *el1, *obj_list;
     JSGCObjectHeader *p;
 
     init_list_head(&rt->tmp_obj_list);
 
+    obj_list = young_only ? &rt->gc_young_obj_list : &rt->gc_obj_list;
     /* decrement the refcount of all the children of all the GC
        objects and move the GC objects with zero refcount to
        tmp_obj_list */
-    list_for_each_safe(el, el1, &rt->gc_obj_list) {
+    list_for_each_safe(el, el1, obj_list) {
         p = list_entry(el, JSGCObjectHeader, link);
+        rt->gc_stats.last_examined_count++;
         assert(js_rc(p)->mark == 0);
-        mark_children(rt, p, gc_decref_child);
+        mark_children(rt, p, young_only ? gc_decref_young_child : gc_decref_child);
         js_rc(p)->mark = 1;
         if (js_rc(p)->ref_count == 0) {
             list_del(&p->link);
@@ -6724,23 +8100,44 @@ static void gc_scan_incref_child2(JSRuntime *rt, JSGCObjectHeader *p)
     js_rc(p)->ref_count++;
 }
 
-static void gc_scan(JSRuntime *rt)
+static void gc_scan_young_incref_child(JSRuntime *rt, JSGCObjectHeader *p)
 {
-    struct list_head *el;
+    if (js_rc(p)->young) {
+        js_rc(p)->ref_count++;
+        if (js_rc(p)->ref_count == 1) {
+            list_del(&p->link);
+            list_add_tail(&p->link, &rt->gc_young_obj_list);
+            js_rc(p)->mark = 0;
+        }
+    }
+}
+
+static void gc_scan_young_incref_child2(JSRuntime *rt, JSGCObjectHeader *p)
+{
+    if (js_rc(p)->young)
+        js_rc(p)->ref_count++;
+}
+
+static void gc_scan(JSRuntime *rt, BOOL young_only)
+{
+    struct list_head *el, *obj_list;
     JSGCObjectHeader *p;
 
+    obj_list = young_only ? &rt->gc_young_obj_list : &rt->gc_obj_list;
     /* keep the objects with a refcount > 0 and their children. */
-    list_for_each(el, &rt->gc_obj_list) {
+    list_for_each(el, obj_list) {
         p = list_entry(el, JSGCObjectHeader, link);
         assert(js_rc(p)->ref_count > 0);
         js_rc(p)->mark = 0; /* reset the mark for the next GC call */
-        mark_children(rt, p, gc_scan_incref_child);
+        mark_children(rt, p, young_only ? gc_scan_young_incref_child :
+                      gc_scan_incref_child);
     }
 
     /* restore the refcount of the objects to be deleted. */
     list_for_each(el, &rt->tmp_obj_list) {
         p = list_entry(el, JSGCObjectHeader, link);
-        mark_children(rt, p, gc_scan_incref_child2);
+        mark_children(rt, p, young_only ? gc_scan_young_incref_child2 :
+                      gc_scan_incref_child2);
     }
 }
 
@@ -6776,6 +8173,7 @@ static void gc_free_cycles(JSRuntime *rt)
             JS_DumpGCObject(rt, p);
 #endif
             free_gc_object(rt, p);
+            rt->gc_stats.last_freed_count++;
             break;
         default:
             list_del(&p->link);
@@ -6792,7 +8190,7 @@ static void gc_free_cycles(JSRuntime *rt)
                js_rc(p)->gc_obj_type == JS_GC_OBJ_TYPE_ASYNC_FUNCTION ||
                js_rc(p)->gc_obj_type == JS_GC_OBJ_TYPE_MODULE);
         if (js_rc(p)->gc_obj_type == JS_GC_OBJ_TYPE_JS_OBJECT &&
-            ((JSObject *)p)->weakref_count != 0) {
+            ((JSObject *)p)->weak_target != 0) {
             /* keep the object because there are weak references to it */
             js_rc(p)->mark = 0;
         } else {
@@ -6803,29 +8201,148 @@ static void gc_free_cycles(JSRuntime *rt)
     init_list_head(&rt->gc_zero_ref_count_list);
 }
 
-static void JS_RunGCInternal(JSRuntime *rt, BOOL remove_weak_objects)
+/* return the time elapsed since *pt and update it */
+static int64_t gc_phase_time(int64_t *pt)
+{
+    int64_t t, d;
+    t = js_profile_time_us();
+    d = t - *pt;
+    *pt = t;
+    return d;
+}
+
+/* If 'young_only' is TRUE, only the cycles made of objects allocated
+   since the last collection are freed. It is much faster when the
+   heap contains many long lived objects. The surviving young objects
+   are then considered as old. */
+static void JS_RunGCInternal(JSRuntime *rt, BOOL remove_weak_objects,
+                             BOOL young_only, JSGCReasonEnum reason)
 {
+    JSGCStats *st = &rt->gc_stats;
+    JSGCEventInfo info;
+    int64_t start_time, t;
+
+    memset(&info, 0, sizeof(info));
+    info.reason = reason;
+    info.young_only = young_only;
+    info.heap_size_before = rt->malloc_ctx.malloc_state.malloc_size;
+    if (rt->gc_callback)
+        rt->gc_callback(rt, JS_GC_EVENT_START, &info, rt->gc_callback_opaque);
+    start_time = js_profile_time_us();
+    t = start_time;
+
+    if (!young_only)
+        gc_promote_young(rt);
+    st->last_examined_count = 0;
+    st->last_freed_count = 0;
+
     if (remove_weak_objects) {
         /* free the weakly referenced object or symbol structures, delete
            the associated Map/Set entries and queue the finalization
            registry callbacks. */
         gc_remove_weak_objects(rt);
     }
+    info.weak_time = gc_phase_time(&t);
     
     /* decrement the reference of the children of each object. mark =
        1 after this pass. */
-    gc_decref(rt);
+    gc_decref(rt, young_only);
+    info.decref_time = gc_phase_time(&t);
 
     /* keep the GC objects with a non zero refcount and their childs */
-    gc_scan(rt);
+    gc_scan(rt, young_only);
+    info.scan_time = gc_phase_time(&t);
 
     /* free the GC objects in a cycle */
     gc_free_cycles(rt);
+
+    gc_promote_young(rt);
+#ifdef CONFIG_ATOMICS
+    /* the blocks freed by the collection are already accounted as
+       freed: give them to the thread now instead of waiting for a full
+       batch */
+    if (rt->malloc_ctx.bg_free)
+        js_bg_free_flush(rt->malloc_ctx.bg_free);
+#endif
+    info.free_cycles_time = gc_phase_time(&t);
+    info.total_time = t - start_time;
+
+    st->gc_count++;
+    if (!young_only)
+        st->full_gc_count++;
+    st->examined_count += st->last_examined_count;
+    st->freed_count += st->last_freed_count;
+    st->last_heap_size = rt->malloc_ctx.malloc_state.malloc_size;
+    st->last_gc_time = info.total_time;
+    st->gc_time += info.total_time;
+    st->max_gc_time = max_int64(st->max_gc_time, info.total_time);
+    if (unlikely(rt->tracer))
+        js_trace_add_event(rt, JS_TRACE_EVENT_GC, start_time, JS_UNDEFINED);
+    if (rt->gc_callback) {
+        info.heap_size_after = st->last_heap_size;
+        info.examined_count = st->last_examined_count;
+        info.freed_count = st->last_freed_count;
+        rt->gc_callback(rt, JS_GC_EVENT_END, &info, rt->gc_callback_opaque);
+    }
 }
 
 void JS_RunGC(JSRuntime *rt)
 {
-    JS_RunGCInternal(rt, TRUE);
+    JS_RunGCInternal(rt, TRUE, FALSE, JS_GC_REASON_RUN_GC);
+    js_malloc_free_empty_arenas(&rt->malloc_ctx);
+}
+
+static void gc_step_add_child(JSRuntime *rt, JSGCObjectHeader *p)
+{
+    if (!js_rc(p)->young && rt->gc_step_count > 0) {
+        js_rc(p)->young = 1;
+        list_del(&p->link);
+        list_add_tail(&p->link, &rt->gc_young_obj_list);
+        rt->gc_step_count--;
+    }
+}
+
+/* Remove the cycles in a subset of about 'budget' objects so that
+   the pause time is bounded. The subset contains the young objects
+   (unless there are more than 'budget' of them), the least recently
+   examined old objects and the objects reachable
+   from them, so that small cycles are entirely in it. At least half
+   of the budget is given to the old objects. The other objects are
+   handled as external references. Calling it repeatedly examines all
+   the objects, but a cycle larger than 'budget' is only freed by
+   JS_RunGC(). */
+static void js_run_gc_step(JSRuntime *rt, int budget, JSGCReasonEnum reason)
+{
+    struct list_head *el;
+    JSGCObjectHeader *p;
+
+    if (budget <= 0)
+        return;
+    /* use the young generation to hold the subset. The young objects
+       are already in it unless they exceed the budget. */
+    if (rt->gc_young_count > budget)
+        gc_promote_young(rt);
+    rt->gc_step_count = max_int(budget - rt->gc_young_count, budget / 2);
+    el = &rt->gc_young_obj_list;
+    while (rt->gc_step_count > 0) {
+        if (el->next == &rt->gc_young_obj_list) {
+            /* take the next least recently examined object */
+            if (list_empty(&rt->gc_obj_list))
+                break;
+            gc_step_add_child(rt, list_entry(rt->gc_obj_list.next,
+                                             JSGCObjectHeader, link));
+        }
+        el = el->next;
+        p = list_entry(el, JSGCObjectHeader, link);
+        mark_children(rt, p, gc_step_add_child);
+    }
+    /* the survivors are added at the end of gc_obj_list */
+    JS_RunGCInternal(rt, TRUE, TRUE, reason);
+}
+
+void JS_RunGCStep(JSRuntime *rt, int budget)
+{
+    js_run_gc_step(rt, budget, JS_GC_REASON_STEP);
 }
 
 /* Return false if not an object or if the object has already been
@@ -6860,8 +8377,7 @@ static void compute_jsstring_size(JSString *str, JSMemoryUsage_helper *hp)
     if (!str->atom_type) {  /* atoms are handled separately */
         double s_ref_count = js_rc(str)->ref_count;
         hp->str_count += 1 / s_ref_count;
-        hp->str_size += ((sizeof(*str) + (str->len << str->is_wide_char) +
-                          1 - str->is_wide_char) / s_ref_count);
+        hp->str_size += js_string_alloc_size(str) / s_ref_count;
     }
 }
 
@@ -6884,6 +8400,7 @@ static void compute_bytecode_size(JSFunctionBytecode *b, JSMemoryUsage_helper *h
     if (b->closure_var) {
         js_func_size += b->closure_var_count * sizeof(*b->closure_var);
     }
+    js_func_size += b->atom_count * sizeof(*b->atoms);
     if (!b->read_only_bytecode && b->byte_code_buf) {
         hp->js_func_code_size += b->byte_code_len;
     }
@@ -6978,7 +8495,7 @@ void JS_ComputeMemoryUsage(JSRuntime *rt, JSMemoryUsage *s)
         }
     }
 
-    list_for_each(el, &rt->gc_obj_list) {
+    gc_obj_list_for_each(el, rt) {
         JSGCObjectHeader *gp = list_entry(el, JSGCObjectHeader, link);
         JSObject *p;
         JSShape *sh;
@@ -7249,7 +8766,7 @@ void JS_DumpMemoryUsage(FILE *fp, const JSMemoryUsage *s, JSRuntime *rt)
             int obj_classes[JS_CLASS_INIT_COUNT + 1] = { 0 };
             int class_id;
             struct list_head *el;
-            list_for_each(el, &rt->gc_obj_list) {
+            gc_obj_list_for_each(el, rt) {
                 JSGCObjectHeader *gp = list_entry(el, JSGCObjectHeader, link);
                 JSObject *p;
                 if (js_rc(gp)->gc_obj_type == JS_GC_OBJ_TYPE_JS_OBJECT) {
@@ -7337,6 +8854,1750 @@ void JS_DumpMemoryUsage(FILE *fp, const JSMemoryUsage *s, JSRuntime *rt)
     }
 }
 
+/* Heap snapshot in the Chrome DevTools format (.heapsnapshot). The
+   nodes are the GC objects and the strings, symbols and BigInts they
+   reference. The GC objects referenced from outside the GC objects
+   (C code, stack frames) are the children of a synthetic root
+   node. */
+
+typedef enum {
+    JS_HS_NODE_HIDDEN,
+    JS_HS_NODE_ARRAY,
+    JS_HS_NODE_STRING,
+    JS_HS_NODE_OBJECT,
+    JS_HS_NODE_CODE,
+    JS_HS_NODE_CLOSURE,
+    JS_HS_NODE_REGEXP,
+    JS_HS_NODE_NUMBER,
+    JS_HS_NODE_NATIVE,
+    JS_HS_NODE_SYNTHETIC,
+    JS_HS_NODE_CONCATENATED_STRING,
+    JS_HS_NODE_SLICED_STRING,
+    JS_HS_NODE_SYMBOL,
+    JS_HS_NODE_BIGINT,
+    JS_HS_NODE_OBJECT_SHAPE,
+} JSHeapSnapshotNodeTypeEnum;
+
+typedef enum {
+    JS_HS_EDGE_CONTEXT,
+    JS_HS_EDGE_ELEMENT,
+    JS_HS_EDGE_PROPERTY,
+    JS_HS_EDGE_INTERNAL,
+    JS_HS_EDGE_HIDDEN,
+    JS_HS_EDGE_SHORTCUT,
+    JS_HS_EDGE_WEAK,
+} JSHeapSnapshotEdgeTypeEnum;
+
+/* first entries of the string table (same order as js_hs_names[]) */
+typedef enum {
+    JS_HS_STR_EMPTY,
+    JS_HS_STR_ROOT,
+    JS_HS_STR_MAP,
+    JS_HS_STR_PROTO,
+    JS_HS_STR_CODE,
+    JS_HS_STR_HOME_OBJECT,
+    JS_HS_STR_VALUE,
+    JS_HS_STR_SOURCE,
+    JS_HS_STR_BYTECODE,
+    JS_HS_STR_FIRST,
+    JS_HS_STR_SECOND,
+    JS_HS_STR_ANONYMOUS,
+    JS_HS_STR_SHAPE,
+    JS_HS_STR_VAR_REF,
+    JS_HS_STR_ASYNC_FUNCTION,
+    JS_HS_STR_CONTEXT,
+    JS_HS_STR_ROPE,
+    JS_HS_STR_BIGINT,
+    JS_HS_STR_COUNT,
+} JSHeapSnapshotStringEnum;
+
+static const char * const js_hs_names[JS_HS_STR_COUNT] = {
+    "",
+    "(GC roots)",
+    "map",
+    "__proto__",
+    "code",
+    "home_object",
+    "value",
+    "source",
+    "bytecode",
+    "first",
+    "second",
+    "(anonymous)",
+    "(shape)",
+    "(closure variable)",
+    "(async function state)",
+    "(context)",
+    "(concatenated string)",
+    "(bigint)",
+};
+
+/* maximum number of characters of the strings in the string table */
+#define JS_HS_STRING_MAX_LEN 256
+
+typedef struct {
+    void *ptr; /* NULL for the root node */
+    int tag; /* JS_TAG_OBJECT for all the GC objects */
+    int edge_count;
+} JSHeapSnapshotNode;
+
+typedef struct JSHeapSnapshot {
+    JSRuntime *rt;
+    FILE *f;
+    BOOL output; /* FALSE: count the nodes and edges, TRUE: write them */
+    BOOL mem_error;
+    JSHeapSnapshotNode *nodes;
+    int node_count;
+    int node_size;
+    int gc_node_count; /* the GC objects are the nodes 1 to gc_node_count */
+    int *hash_table; /* node index + 1, 0 if empty slot */
+    int hash_bits;
+    int edge_count;
+    int cur_node; /* node whose edges are enumerated */
+    int cur_index; /* index of the next hidden edge of 'cur_node' */
+    const char *sep; /* separator before the next node or edge */
+    DynBuf strings; /* JSON encoded string table */
+    int string_count;
+    int *atom_strings; /* string index + 1 of the atoms, 0 if none */
+} JSHeapSnapshot;
+
+static int js_hs_find_node(JSHeapSnapshot *hs, void *ptr)
+{
+    uint32_t h, mask;
+    int idx;
+
+    mask = (1 << hs->hash_bits) - 1;
+    h = map_hash_pointer((uintptr_t)ptr, hs->hash_bits);
+    for(;;) {
+        idx = hs->hash_table[h];
+        if (idx == 0)
+            return -1;
+        if (hs->nodes[idx - 1].ptr == ptr)
+            return idx - 1;
+        h = (h + 1) & mask;
+    }
+}
+
+static void js_hs_hash_insert(JSHeapSnapshot *hs, int idx)
+{
+    uint32_t h, mask;
+
+    mask = (1 << hs->hash_bits) - 1;
+    h = map_hash_pointer((uintptr_t)hs->nodes[idx].ptr, hs->hash_bits);
+    while (hs->hash_table[h] != 0)
+        h = (h + 1) & mask;
+    hs->hash_table[h] = idx + 1;
+}
+
+/* return the node index or -1 if memory error */
+static int js_hs_add_node(JSHeapSnapshot *hs, void *ptr, int tag)
+{
+    JSRuntime *rt = hs->rt;
+    JSHeapSnapshotNode *n;
+    int idx, i, new_size;
+
+    if (hs->mem_error)
+        return -1;
+    if (hs->node_count >= hs->node_size) {
+        new_size = max_int(hs->node_size * 3 / 2, 256);
+        n = js_realloc_rt(rt, hs->nodes, sizeof(hs->nodes[0]) * new_size);
+        if (!n)
+            goto fail;
+        hs->nodes = n;
+        hs->node_size = new_size;
+    }
+    /* the hash table is at most half full */
+    if (2 * (hs->node_count + 1) > (1 << hs->hash_bits)) {
+        int *hash_table, new_bits;
+        new_bits = max_int(hs->hash_bits + 1, 10);
+        hash_table = js_mallocz_rt(rt, sizeof(hash_table[0]) << new_bits);
+        if (!hash_table)
+            goto fail;
+        js_free_rt(rt, hs->hash_table);
+        hs->hash_table = hash_table;
+        hs->hash_bits = new_bits;
+        /* the root node is not in the hash table */
+        for(i = 1; i < hs->node_count; i++)
+            js_hs_hash_insert(hs, i);
+    }
+    idx = hs->node_count++;
+    n = &hs->nodes[idx];
+    n->ptr = ptr;
+    n->tag = tag;
+    n->edge_count = 0;
+    if (ptr)
+        js_hs_hash_insert(hs, idx);
+    return idx;
+ fail:
+    hs->mem_error = TRUE;
+    return -1;
+}
+
+/* add a string to the string table and return its index. 'prefix' is
+   an ASCII string. 'p' can be NULL. */
+static int js_hs_new_string(JSHeapSnapshot *hs, const char *prefix,
+                            const JSString *p)
+{
+    DynBuf *b = &hs->strings;
+    int i, c, len;
+
+    if (!hs->output)
+        return 0;
+    if (hs->string_count != 0)
+        dbuf_putc(b, ',');
+    dbuf_putc(b, '\"');
+    if (prefix)
+        dbuf_putstr(b, prefix);
+    if (p) {
+        len = min_int(p->len, JS_HS_STRING_MAX_LEN);
+        for(i = 0; i < len; i++) {
+            c = string_get(p, i);
+            if (c == '\"' || c == '\\') {
+                dbuf_putc(b, '\\');
+                dbuf_putc(b, c);
+            } else if (c < 0x20 || c >= 0x7f) {
+                dbuf_printf(b, "\\u%04x", c);
+            } else {
+                dbuf_putc(b, c);
+            }
+        }
+        if (len < p->len)
+            dbuf_putstr(b, "...");
+    }
+    dbuf_putc(b, '\"');
+    return hs->string_count++;
+}
+
+static int js_hs_atom_string(JSHeapSnapshot *hs, const char *prefix,
+                             JSAtom atom)
+{
+    JSRuntime *rt = hs->rt;
+    char buf[32];
+    int idx;
+
+    if (!hs->output)
+        return 0;
+    if (__JS_AtomIsTaggedInt(atom)) {
+        snprintf(buf, sizeof(buf), "%s%u", prefix ? prefix : "",
+                 __JS_AtomToUInt32(atom));
+        return js_hs_new_string(hs, buf, NULL);
+    }
+    if (prefix)
+        return js_hs_new_string(hs, prefix, rt->atom_array[atom]);
+    idx = hs->atom_strings[atom] - 1;
+    if (idx < 0) {
+        idx = js_hs_new_string(hs, NULL, rt->atom_array[atom]);
+        hs->atom_strings[atom] = idx + 1;
+    }
+    return idx;
+}
+
+/* 'ptr' and 'tag' define the destination node */
+static void js_hs_add_edge(JSHeapSnapshot *hs, JSHeapSnapshotEdgeTypeEnum type,
+                           int name_or_index, void *ptr, int tag)
+{
+    int idx;
+
+    idx = js_hs_find_node(hs, ptr);
+    if (!hs->output) {
+        if (idx < 0) {
+            idx = js_hs_add_node(hs, ptr, tag);
+            if (idx < 0)
+                return;
+        }
+        hs->nodes[hs->cur_node].edge_count++;
+        hs->edge_count++;
+    } else {
+        fprintf(hs->f, "%s%d,%d,%d\n", hs->sep, type, name_or_index,
+                idx * 7);
+        hs->sep = ",";
+    }
+}
+
+static void js_hs_add_value_edge(JSHeapSnapshot *hs,
+                                 JSHeapSnapshotEdgeTypeEnum type,
+                                 int name_or_index, JSValueConst val)
+{
+    int tag;
+
+    if (!JS_VALUE_HAS_REF_COUNT(val))
+        return;
+    tag = JS_VALUE_GET_TAG(val);
+    switch(tag) {
+    case JS_TAG_OBJECT:
+    case JS_TAG_FUNCTION_BYTECODE:
+    case JS_TAG_MODULE:
+        tag = JS_TAG_OBJECT;
+        break;
+    case JS_TAG_STRING:
+    case JS_TAG_STRING_ROPE:
+    case JS_TAG_SYMBOL:
+    case JS_TAG_BIG_INT:
+        break;
+    default:
+        return;
+    }
+    js_hs_add_edge(hs, type, name_or_index, JS_VALUE_GET_PTR(val), tag);
+}
+
+static void js_hs_mark_child(JSRuntime *rt, JSGCObjectHeader *gp)
+{
+    JSHeapSnapshot *hs = rt->heap_snapshot;
+    js_hs_add_edge(hs, JS_HS_EDGE_HIDDEN, hs->cur_index++, gp, JS_TAG_OBJECT);
+}
+
+static void js_hs_decref_child(JSRuntime *rt, JSGCObjectHeader *gp)
+{
+    js_rc(gp)->ref_count--;
+}
+
+static void js_hs_incref_child(JSRuntime *rt, JSGCObjectHeader *gp)
+{
+    js_rc(gp)->ref_count++;
+}
+
+static void js_hs_object_edges(JSHeapSnapshot *hs, JSObject *p)
+{
+    JSRuntime *rt = hs->rt;
+    JSShape *sh = p->shape;
+    JSShapeProperty *prs;
+    JSProperty *pr;
+    JSClassGCMark *gc_mark;
+    int i;
+
+    js_hs_add_edge(hs, JS_HS_EDGE_INTERNAL, JS_HS_STR_MAP, sh, JS_TAG_OBJECT);
+    if (sh->proto) {
+        js_hs_add_edge(hs, JS_HS_EDGE_PROPERTY, JS_HS_STR_PROTO, sh->proto,
+                       JS_TAG_OBJECT);
+    }
+    prs = get_shape_prop(sh);
+    for(i = 0; i < sh->prop_count; i++, prs++) {
+        pr = &p->prop[i];
+        if (prs->atom == JS_ATOM_NULL)
+            continue;
+        switch(prs->flags & JS_PROP_TMASK) {
+        case JS_PROP_NORMAL:
+            if (__JS_AtomIsTaggedInt(prs->atom)) {
+                js_hs_add_value_edge(hs, JS_HS_EDGE_ELEMENT,
+                                     __JS_AtomToUInt32(prs->atom),
+                                     pr->u.value);
+            } else if (JS_VALUE_HAS_REF_COUNT(pr->u.value)) {
+                js_hs_add_value_edge(hs, JS_HS_EDGE_PROPERTY,
+                                     js_hs_atom_string(hs, NULL, prs->atom),
+                                     pr->u.value);
+            }
+            break;
+        case JS_PROP_GETSET:
+            if (pr->u.getset.getter) {
+                js_hs_add_edge(hs, JS_HS_EDGE_PROPERTY,
+                               js_hs_atom_string(hs, "get ", prs->atom),
+                               pr->u.getset.getter, JS_TAG_OBJECT);
+            }
+            if (pr->u.getset.setter) {
+                js_hs_add_edge(hs, JS_HS_EDGE_PROPERTY,
+                               js_hs_atom_string(hs, "set ", prs->atom),
+                               pr->u.getset.setter, JS_TAG_OBJECT);
+            }
+            break;
+        case JS_PROP_VARREF:
+            js_hs_add_edge(hs, JS_HS_EDGE_PROPERTY,
+                           js_hs_atom_string(hs, NULL, prs->atom),
+                           pr->u.var_ref, JS_TAG_OBJECT);
+            break;
+        case JS_PROP_AUTOINIT:
+            js_autoinit_mark(rt, pr, js_hs_mark_child);
+            break;
+        }
+    }
+
+    switch(p->class_id) {
+    case JS_CLASS_OBJECT:
+        break;
+    case JS_CLASS_ARRAY:
+    case JS_CLASS_ARGUMENTS:
+        for(i = 0; i < p->u.array.count; i++) {
+            js_hs_add_value_edge(hs, JS_HS_EDGE_ELEMENT, i,
+                                 p->u.array.u.values[i]);
+        }
+        break;
+    case JS_CLASS_NUMBER:
+    case JS_CLASS_STRING:
+    case JS_CLASS_BOOLEAN:
+    case JS_CLASS_SYMBOL:
+    case JS_CLASS_DATE:
+    case JS_CLASS_BIG_INT:
+        js_hs_add_value_edge(hs, JS_HS_EDGE_INTERNAL, JS_HS_STR_VALUE,
+                             p->u.object_data);
+        break;
+    case JS_CLASS_BYTECODE_FUNCTION:
+        {
+            JSFunctionBytecode *b = p->u.func.function_bytecode;
+            JSVarRef **var_refs = p->u.func.var_refs;
+            if (p->u.func.home_object) {
+                js_hs_add_edge(hs, JS_HS_EDGE_INTERNAL, JS_HS_STR_HOME_OBJECT,
+                               p->u.func.home_object, JS_TAG_OBJECT);
+            }
+            if (b) {
+                if (var_refs) {
+                    for(i = 0; i < b->closure_var_count; i++) {
+                        if (var_refs[i]) {
+                            js_hs_add_edge(hs, JS_HS_EDGE_CONTEXT,
+                                           js_hs_atom_string(hs, NULL, b->closure_var[i].var_name),
+                                           var_refs[i], JS_TAG_OBJECT);
+                        }
+                    }
+                }
+                js_hs_add_edge(hs, JS_HS_EDGE_INTERNAL, JS_HS_STR_CODE,
+                               b, JS_TAG_OBJECT);
+            }
+        }
+        break;
+    case JS_CLASS_REGEXP:
+        if (p->u.regexp.pattern) {
+            js_hs_add_edge(hs, JS_HS_EDGE_INTERNAL, JS_HS_STR_SOURCE,
+                           p->u.regexp.pattern, JS_TAG_STRING);
+        }
+        if (p->u.regexp.bytecode) {
+            js_hs_add_edge(hs, JS_HS_EDGE_INTERNAL, JS_HS_STR_BYTECODE,
+                           p->u.regexp.bytecode, JS_TAG_STRING);
+        }
+        break;
+    default:
+        gc_mark = rt->class_array[p->class_id].gc_mark;
+        if (gc_mark)
+            gc_mark(rt, JS_MKPTR(JS_TAG_OBJECT, p), js_hs_mark_child);
+        break;
+    }
+}
+
+/* the children of the root node are the GC objects with external
+   references */
+static void js_hs_root_edges(JSHeapSnapshot *hs)
+{
+    JSRuntime *rt = hs->rt;
+    struct list_head *el;
+    JSGCObjectHeader *gp;
+    int i;
+
+    /* as in gc_decref(), remove the internal references */
+    gc_obj_list_for_each(el, rt) {
+        gp = list_entry(el, JSGCObjectHeader, link);
+        mark_children(rt, gp, js_hs_decref_child);
+    }
+    for(i = 1; i <= hs->gc_node_count; i++) {
+        gp = hs->nodes[i].ptr;
+        if (js_rc(gp)->ref_count != 0) {
+            js_hs_add_edge(hs, JS_HS_EDGE_ELEMENT, hs->cur_index++,
+                           gp, JS_TAG_OBJECT);
+        }
+    }
+    gc_obj_list_for_each(el, rt) {
+        gp = list_entry(el, JSGCObjectHeader, link);
+        mark_children(rt, gp, js_hs_incref_child);
+    }
+}
+
+static void js_hs_node_edges(JSHeapSnapshot *hs, int idx)
+{
+    JSRuntime *rt = hs->rt;
+    JSHeapSnapshotNode *n = &hs->nodes[idx];
+    JSGCObjectHeader *gp;
+    int i;
+
+    hs->cur_node = idx;
+    hs->cur_index = 0;
+    switch(n->tag) {
+    case JS_TAG_UNDEFINED:
+        js_hs_root_edges(hs);
+        break;
+    case JS_TAG_OBJECT:
+        gp = n->ptr;
+        switch(js_rc(gp)->gc_obj_type) {
+        case JS_GC_OBJ_TYPE_JS_OBJECT:
+            js_hs_object_edges(hs, (JSObject *)gp);
+            break;
+        case JS_GC_OBJ_TYPE_FUNCTION_BYTECODE:
+            {
+                JSFunctionBytecode *b = (JSFunctionBytecode *)gp;
+                for(i = 0; i < b->cpool_count; i++) {
+                    js_hs_add_value_edge(hs, JS_HS_EDGE_HIDDEN,
+                                         hs->cur_index++, b->cpool[i]);
+                }
+                if (b->realm)
+                    js_hs_mark_child(rt, &b->realm->header);
+            }
+            break;
+        case JS_GC_OBJ_TYPE_VAR_REF:
+            {
+                JSVarRef *var_ref = (JSVarRef *)gp;
+                if (var_ref->is_detached) {
+                    js_hs_add_value_edge(hs, JS_HS_EDGE_INTERNAL,
+                                         JS_HS_STR_VALUE, *var_ref->pvalue);
+                } else {
+                    mark_children(rt, gp, js_hs_mark_child);
+                }
+            }
+            break;
+        default:
+            mark_children(rt, gp, js_hs_mark_child);
+            break;
+        }
+        break;
+    case JS_TAG_STRING_ROPE:
+        {
+            JSStringRope *r = n->ptr;
+            js_hs_add_value_edge(hs, JS_HS_EDGE_INTERNAL, JS_HS_STR_FIRST,
+                                 r->left);
+            js_hs_add_value_edge(hs, JS_HS_EDGE_INTERNAL, JS_HS_STR_SECOND,
+                                 r->right);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* return the string index of the name of a function or -1 if none */
+static int js_hs_function_name(JSHeapSnapshot *hs, JSObject *p)
+{
+    JSShapeProperty *prs;
+    JSProperty *pr;
+
+    if (p->class_id == JS_CLASS_BYTECODE_FUNCTION) {
+        JSFunctionBytecode *b = p->u.func.function_bytecode;
+        if (b && b->func_name != JS_ATOM_NULL &&
+            b->func_name != JS_ATOM_empty_string)
+            return js_hs_atom_string(hs, NULL, b->func_name);
+    }
+    prs = find_own_property(&pr, p, JS_ATOM_name);
+    if (prs && !(prs->flags & JS_PROP_TMASK) &&
+        JS_VALUE_GET_TAG(pr->u.value) == JS_TAG_STRING &&
+        JS_VALUE_GET_STRING(pr->u.value)->len != 0) {
+        return js_hs_new_string(hs, NULL, JS_VALUE_GET_STRING(pr->u.value));
+    }
+    return -1;
+}
+
+static void js_hs_object_info(JSHeapSnapshot *hs, JSObject *p,
+                              int *ptype, int *pname, int64_t *psize)
+{
+    JSRuntime *rt = hs->rt;
+    JSShapeProperty *prs;
+    JSProperty *pr;
+    int type, name;
+    int64_t size;
+
+    type = JS_HS_NODE_OBJECT;
+    name = -1;
+    size = sizeof(JSObject);
+    if (p->prop)
+        size += p->shape->prop_size * sizeof(*p->prop);
+    switch(p->class_id) {
+    case JS_CLASS_OBJECT:
+        /* use the name of the constructor as V8 does */
+        if (p->shape->proto) {
+            prs = find_own_property(&pr, p->shape->proto, JS_ATOM_constructor);
+            if (prs && !(prs->flags & JS_PROP_TMASK) &&
+                JS_VALUE_GET_TAG(pr->u.value) == JS_TAG_OBJECT) {
+                name = js_hs_function_name(hs, JS_VALUE_GET_OBJ(pr->u.value));
+            }
+        }
+        break;
+    case JS_CLASS_ARRAY:
+    case JS_CLASS_ARGUMENTS:
+        size += p->u.array.count * sizeof(*p->u.array.u.values);
+        break;
+    case JS_CLASS_BYTECODE_FUNCTION:
+        type = JS_HS_NODE_CLOSURE;
+        if (p->u.func.var_refs) {
+            size += p->u.func.function_bytecode->closure_var_count *
+                sizeof(*p->u.func.var_refs);
+        }
+        name = js_hs_function_name(hs, p);
+        break;
+    case JS_CLASS_C_FUNCTION:
+    case JS_CLASS_BOUND_FUNCTION:
+    case JS_CLASS_C_FUNCTION_DATA:
+        type = JS_HS_NODE_CLOSURE;
+        name = js_hs_function_name(hs, p);
+        break;
+    case JS_CLASS_REGEXP:
+        type = JS_HS_NODE_REGEXP;
+        if (p->u.regexp.pattern)
+            name = js_hs_new_string(hs, NULL, p->u.regexp.pattern);
+        break;
+    case JS_CLASS_ARRAY_BUFFER:
+    case JS_CLASS_SHARED_ARRAY_BUFFER:
+        {
+            JSArrayBuffer *abuf = p->u.array_buffer;
+            if (abuf) {
+                size += sizeof(*abuf);
+                if (abuf->data)
+                    size += abuf->byte_length;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+    if (name < 0)
+        name = js_hs_atom_string(hs, NULL, rt->class_array[p->class_id].class_name);
+    *ptype = type;
+    *pname = name;
+    *psize = size;
+}
+
+static int64_t js_hs_bytecode_size(JSFunctionBytecode *b)
+{
+    int64_t size;
+
+    size = offsetof(JSFunctionBytecode, debug);
+    if (b->vardefs)
+        size += (b->arg_count + b->var_count) * sizeof(*b->vardefs);
+    size += b->cpool_count * sizeof(*b->cpool);
+    size += b->closure_var_count * sizeof(*b->closure_var);
+    size += b->atom_count * sizeof(*b->atoms);
+    if (!b->read_only_bytecode)
+        size += b->byte_code_len;
+    if (b->has_debug) {
+        size += sizeof(*b) - offsetof(JSFunctionBytecode, debug);
+        if (b->debug.source)
+            size += b->debug.source_len + 1;
+        size += b->debug.pc2line_len;
+    }
+    return size;
+}
+
+static void js_hs_write_node(JSHeapSnapshot *hs, int idx)
+{
+    JSRuntime *rt = hs->rt;
+    JSHeapSnapshotNode *n = &hs->nodes[idx];
+    int type, name;
+    int64_t size;
+
+    switch(n->tag) {
+    case JS_TAG_UNDEFINED:
+        type = JS_HS_NODE_SYNTHETIC;
+        name = JS_HS_STR_ROOT;
+        size = 0;
+        break;
+    case JS_TAG_OBJECT:
+        {
+            JSGCObjectHeader *gp = n->ptr;
+            switch(js_rc(gp)->gc_obj_type) {
+            case JS_GC_OBJ_TYPE_JS_OBJECT:
+                js_hs_object_info(hs, (JSObject *)gp, &type, &name, &size);
+                break;
+            case JS_GC_OBJ_TYPE_FUNCTION_BYTECODE:
+                {
+                    JSFunctionBytecode *b = (JSFunctionBytecode *)gp;
+                    type = JS_HS_NODE_CODE;
+                    if (b->func_name != JS_ATOM_NULL &&
+                        b->func_name != JS_ATOM_empty_string)
+                        name = js_hs_atom_string(hs, NULL, b->func_name);
+                    else
+                        name = JS_HS_STR_ANONYMOUS;
+                    size = js_hs_bytecode_size(b);
+                }
+                break;
+            case JS_GC_OBJ_TYPE_SHAPE:
+                {
+                    JSShape *sh = (JSShape *)gp;
+                    type = JS_HS_NODE_OBJECT_SHAPE;
+                    name = JS_HS_STR_SHAPE;
+                    size = get_shape_size(sh->prop_hash_mask + 1, sh->prop_size);
+                }
+                break;
+            case JS_GC_OBJ_TYPE_VAR_REF:
+                type = JS_HS_NODE_HIDDEN;
+                name = JS_HS_STR_VAR_REF;
+                size = sizeof(JSVarRef);
+                break;
+            case JS_GC_OBJ_TYPE_ASYNC_FUNCTION:
+                type = JS_HS_NODE_HIDDEN;
+                name = JS_HS_STR_ASYNC_FUNCTION;
+                size = sizeof(JSAsyncFunctionState);
+                break;
+            case JS_GC_OBJ_TYPE_JS_CONTEXT:
+                type = JS_HS_NODE_SYNTHETIC;
+                name = JS_HS_STR_CONTEXT;
+                size = sizeof(JSContext) + sizeof(JSValue) * rt->class_count;
+                break;
+            case JS_GC_OBJ_TYPE_MODULE:
+                type = JS_HS_NODE_HIDDEN;
+                name = js_hs_atom_string(hs, NULL, ((JSModuleDef *)gp)->module_name);
+                size = sizeof(JSModuleDef);
+                break;
+            default:
+                abort();
+            }
+        }
+        break;
+    case JS_TAG_STRING:
+        {
+            JSString *p = n->ptr;
+            type = JS_HS_NODE_STRING;
+            name = js_hs_new_string(hs, NULL, p);
+            size = js_string_alloc_size(p);
+        }
+        break;
+    case JS_TAG_STRING_ROPE:
+        type = JS_HS_NODE_CONCATENATED_STRING;
+        name = JS_HS_STR_ROPE;
+        size = sizeof(JSStringRope);
+        break;
+    case JS_TAG_SYMBOL:
+        {
+            JSAtomStruct *p = n->ptr;
+            type = JS_HS_NODE_SYMBOL;
+            name = js_hs_new_string(hs, NULL, p);
+            size = sizeof(JSString) + (p->len << p->is_wide_char) + 1 - p->is_wide_char;
+        }
+        break;
+    case JS_TAG_BIG_INT:
+        type = JS_HS_NODE_BIGINT;
+        name = JS_HS_STR_BIGINT;
+        size = sizeof(JSBigInt) + ((JSBigInt *)n->ptr)->len * sizeof(js_limb_t);
+        break;
+    default:
+        abort();
+    }
+    /* the node id is the address so that the objects can be matched
+       between snapshots */
+    fprintf(hs->f, "%s%d,%d,%" PRIu64 ",%" PRId64 ",%d,0,0\n",
+            hs->sep, type, name, n->ptr ? (uint64_t)(uintptr_t)n->ptr : 1,
+            size, n->edge_count);
+    hs->sep = ",";
+}
+
+/* Write a heap snapshot which can be loaded in the Chrome DevTools
+   memory panel. Return 0 if OK or -1 if memory or I/O error. */
+int JS_WriteHeapSnapshot(JSRuntime *rt, FILE *f)
+{
+    JSHeapSnapshot hs_s, *hs = &hs_s;
+    struct list_head *el;
+    JSGCObjectHeader *gp;
+    int i, ret;
+
+    if (rt->gc_phase != JS_GC_PHASE_NONE)
+        return -1;
+    memset(hs, 0, sizeof(*hs));
+    hs->rt = rt;
+    hs->f = f;
+    dbuf_init2(&hs->strings, rt, (DynBufReallocFunc *)js_realloc_rt);
+    rt->heap_snapshot = hs;
+    ret = -1;
+
+    /* the GC objects are the first nodes */
+    js_hs_add_node(hs, NULL, JS_TAG_UNDEFINED);
+    gc_obj_list_for_each(el, rt) {
+        gp = list_entry(el, JSGCObjectHeader, link);
+        js_hs_add_node(hs, gp, JS_TAG_OBJECT);
+    }
+    if (hs->mem_error)
+        goto done;
+    hs->gc_node_count = hs->node_count - 1;
+
+    /* count the edges and add the other nodes */
+    for(i = 0; i < hs->node_count; i++) {
+        js_hs_node_edges(hs, i);
+    }
+    if (hs->mem_error)
+        goto done;
+
+    hs->atom_strings = js_mallocz_rt(rt, sizeof(hs->atom_strings[0]) * rt->atom_size);
+    if (!hs->atom_strings)
+        goto done;
+    hs->output = TRUE;
+    for(i = 0; i < JS_HS_STR_COUNT; i++) {
+        js_hs_new_string(hs, js_hs_names[i], NULL);
+    }
+
+    fprintf(f, "{\"snapshot\":{\"meta\":{"
+            "\"node_fields\":[\"type\",\"name\",\"id\",\"self_size\",\"edge_count\",\"trace_node_id\",\"detachedness\"],\n"
+            "\"node_types\":[[\"hidden\",\"array\",\"string\",\"object\",\"code\",\"closure\",\"regexp\",\"number\",\"native\",\"synthetic\",\"concatenated string\",\"sliced string\",\"symbol\",\"bigint\",\"object shape\"],\"string\",\"number\",\"number\",\"number\",\"number\",\"number\"],\n"
+            "\"edge_fields\":[\"type\",\"name_or_index\",\"to_node\"],\n"
+            "\"edge_types\":[[\"context\",\"element\",\"property\",\"internal\",\"hidden\",\"shortcut\",\"weak\"],\"string_or_number\",\"node\"],\n"
+            "\"trace_function_info_fields\":[\"function_id\",\"name\",\"script_name\",\"script_id\",\"line\",\"column\"],\n"
+            "\"trace_node_fields\":[\"id\",\"function_info_index\",\"count\",\"size\",\"children\"],\n"
+            "\"sample_fields\":[\"timestamp_us\",\"last_assigned_id\"],\n"
+            "\"location_fields\":[\"object_index\",\"script_id\",\"line\",\"column\"]},\n"
+            "\"node_count\":%d,\"edge_count\":%d,\"trace_function_count\":0},\n",
+            hs->node_count, hs->edge_count);
+    fprintf(f, "\"nodes\":[");
+    hs->sep = "";
+    for(i = 0; i < hs->node_count; i++) {
+        js_hs_write_node(hs, i);
+    }
+    fprintf(f, "],\n\"edges\":[");
+    hs->sep = "";
+    for(i = 0; i < hs->node_count; i++) {
+        js_hs_node_edges(hs, i);
+    }
+    fprintf(f, "],\n\"trace_function_infos\":[],\n\"trace_tree\":[],\n"
+            "\"samples\":[],\n\"locations\":[],\n\"strings\":[");
+    if (dbuf_error(&hs->strings))
+        goto done;
+    fwrite(hs->strings.buf, 1, hs->strings.size, f);
+    fprintf(f, "]}\n");
+    if (!ferror(f))
+        ret = 0;
+ done:
+    rt->heap_snapshot = NULL;
+    dbuf_free(&hs->strings);
+    js_free_rt(rt, hs->atom_strings);
+    js_free_rt(rt, hs->hash_table);
+    js_free_rt(rt, hs->nodes);
+    return ret;
+}
+
+/* hash tables used by the profilers */
+
+typedef struct JSProfileEntry {
+    struct JSProfileEntry *hash_next;
+    uint32_t hash;
+} JSProfileEntry;
+
+typedef struct {
+    JSProfileEntry **hash;
+    int hash_bits;
+    int count;
+} JSProfileHash;
+
+/* add 'e' with hash 'h' to the table, return -1 if memory error */
+static int js_profile_hash_add(JSRuntime *rt, JSProfileHash *t,
+                                    JSProfileEntry *e, uint32_t h)
+{
+    JSProfileEntry **new_hash, *e1, *e_next;
+    int i, new_bits;
+    uint32_t h1;
+
+    if (t->count >= (1 << t->hash_bits)) {
+        new_bits = t->hash_bits + 1;
+        new_hash = js_mallocz_rt(rt, sizeof(new_hash[0]) << new_bits);
+        if (!new_hash)
+            return -1;
+        for(i = 0; i < (1 << t->hash_bits); i++) {
+            for(e1 = t->hash[i]; e1 != NULL; e1 = e_next) {
+                e_next = e1->hash_next;
+                h1 = e1->hash & ((1 << new_bits) - 1);
+                e1->hash_next = new_hash[h1];
+                new_hash[h1] = e1;
+            }
+        }
+        js_free_rt(rt, t->hash);
+        t->hash = new_hash;
+        t->hash_bits = new_bits;
+    }
+    e->hash = h;
+    h &= (1 << t->hash_bits) - 1;
+    e->hash_next = t->hash[h];
+    t->hash[h] = e;
+    t->count++;
+    return 0;
+}
+
+static void js_profile_hash_free(JSRuntime *rt, JSProfileHash *t)
+{
+    JSProfileEntry *e, *e_next;
+    int i;
+
+    for(i = 0; i < (1 << t->hash_bits); i++) {
+        for(e = t->hash[i]; e != NULL; e = e_next) {
+            e_next = e->hash_next;
+            js_free_rt(rt, e);
+        }
+    }
+    js_free_rt(rt, t->hash);
+}
+
+static int js_profile_hash_init(JSRuntime *rt, JSProfileHash *t)
+{
+    t->hash_bits = 6;
+    t->hash = js_mallocz_rt(rt, sizeof(t->hash[0]) << t->hash_bits);
+    if (!t->hash)
+        return -1;
+    return 0;
+}
+
+static void js_profile_atom_str(JSRuntime *rt, char *buf, int buf_size,
+                                JSAtom atom)
+{
+    const char *str;
+    str = JS_AtomGetStrRT(rt, buf, buf_size, atom);
+    if (str != buf)
+        pstrcpy(buf, buf_size, str);
+}
+
+/* get the name and the definition location of a stack frame function
+   without allocating memory. 'name' is empty for anonymous
+   functions. 'filename' is empty and *pline_num = 0 if unknown. */
+static void js_profile_get_func_info(JSRuntime *rt, JSValueConst func,
+                                     char *name, int name_size,
+                                     char *filename, int filename_size,
+                                     int *pline_num, int *pcol_num)
+{
+    JSObject *p;
+    JSFunctionBytecode *b;
+    JSShapeProperty *prs;
+    JSProperty *pr;
+
+    name[0] = '\0';
+    filename[0] = '\0';
+    *pline_num = 0;
+    *pcol_num = 0;
+    if (JS_VALUE_GET_TAG(func) != JS_TAG_OBJECT)
+        return;
+    p = JS_VALUE_GET_OBJ(func);
+    if (p->class_id == JS_CLASS_BYTECODE_FUNCTION) {
+        b = p->u.func.function_bytecode;
+        if (b->func_name != JS_ATOM_NULL)
+            js_profile_atom_str(rt, name, name_size, b->func_name);
+        if (b->has_debug) {
+            js_profile_atom_str(rt, filename, filename_size, b->debug.filename);
+            *pline_num = find_line_num(NULL, b, -1, pcol_num);
+        }
+    } else {
+        prs = find_own_property(&pr, p, JS_ATOM_name);
+        /* the names of the C functions are atoms */
+        if (prs && !(prs->flags & JS_PROP_TMASK) &&
+            JS_VALUE_GET_TAG(pr->u.value) == JS_TAG_STRING) {
+            JSString *str = JS_VALUE_GET_STRING(pr->u.value);
+            if (str->atom_type != 0) {
+                js_profile_atom_str(rt, name, name_size,
+                                    js_get_atom_index(rt, str));
+            }
+        }
+    }
+}
+
+/* Allocation sampling: on average every 'interval' bytes, the JS stack
+   of the allocation is recorded. The intervals between samples are
+   random so that the sampled allocations are not biased. */
+
+#define JS_ALLOC_SAMPLE_MAX_DEPTH 64
+#define JS_ALLOC_SAMPLE_FRAME_NAME_SIZE 128
+
+typedef struct JSAllocSampleFrame {
+    JSProfileEntry header; /* must come first */
+    char name[0];
+} JSAllocSampleFrame;
+
+typedef struct JSAllocSampleStack {
+    JSProfileEntry header; /* must come first */
+    int64_t count; /* number of samples */
+    double size; /* estimated number of allocated bytes */
+    int depth;
+    JSAllocSampleFrame *frames[0]; /* leaf first */
+} JSAllocSampleStack;
+
+typedef struct JSAllocSampler {
+    double interval; /* average number of bytes between two samples */
+    uint64_t random_state;
+    JSProfileHash frames; /* frame names */
+    JSProfileHash stacks;
+} JSAllocSampler;
+
+static JSAllocSampleFrame *js_alloc_sample_get_frame(JSRuntime *rt,
+                                                     JSAllocSampler *s,
+                                                     const char *name)
+{
+    JSProfileEntry *e;
+    JSAllocSampleFrame *fr;
+    size_t len;
+    uint32_t h;
+
+    len = strlen(name);
+    h = hash_string8((const uint8_t *)name, len, 0);
+    for(e = s->frames.hash[h & ((1 << s->frames.hash_bits) - 1)];
+        e != NULL; e = e->hash_next) {
+        fr = (JSAllocSampleFrame *)e;
+        if (e->hash == h && !strcmp(fr->name, name))
+            return fr;
+    }
+    fr = js_malloc_rt(rt, sizeof(*fr) + len + 1);
+    if (!fr)
+        return NULL;
+    memcpy(fr->name, name, len + 1);
+    if (js_profile_hash_add(rt, &s->frames, &fr->header, h)) {
+        js_free_rt(rt, fr);
+        return NULL;
+    }
+    return fr;
+}
+
+static void js_alloc_sample_frame_name(JSRuntime *rt, char *buf, int buf_size,
+                                       JSValueConst func)
+{
+    char name[ATOM_GET_STR_BUF_SIZE];
+    char filename[ATOM_GET_STR_BUF_SIZE];
+    int line_num, col_num;
+    char *q;
+
+    js_profile_get_func_info(rt, func, name, sizeof(name),
+                             filename, sizeof(filename), &line_num, &col_num);
+    if (name[0] == '\0')
+        pstrcpy(name, sizeof(name), "<anonymous>");
+    if (line_num != 0)
+        snprintf(buf, buf_size, "%s %s:%d", name, filename, line_num);
+    else
+        pstrcpy(buf, buf_size, name);
+    /* ';' is the frame separator in the folded format */
+    for(q = buf; *q != '\0'; q++) {
+        if (*q == ';')
+            *q = ',';
+    }
+}
+
+/* random number in ]0, 1] */
+static double js_alloc_sample_random(JSAllocSampler *s)
+{
+    uint64_t x = s->random_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    s->random_state = x;
+    return ((x >> 11) + 1) * 0x1p-53;
+}
+
+static void js_alloc_sample_reset_countdown(JSRuntime *rt)
+{
+    JSAllocSampler *s = rt->alloc_sampler;
+    if (!s) {
+        rt->alloc_sample_countdown = INT64_MAX;
+    } else {
+        /* exponential distribution of the intervals */
+        rt->alloc_sample_countdown =
+            (int64_t)(-log(js_alloc_sample_random(s)) * s->interval);
+    }
+}
+
+static void js_alloc_sample(JSRuntime *rt, size_t size)
+{
+    JSAllocSampler *s = rt->alloc_sampler;
+    JSAllocSampleFrame *frames[JS_ALLOC_SAMPLE_MAX_DEPTH];
+    JSProfileEntry *e;
+    JSAllocSampleStack *st;
+    JSStackFrame *sf;
+    char buf[JS_ALLOC_SAMPLE_FRAME_NAME_SIZE];
+    int depth, i;
+    uint32_t h;
+
+    if (!s) {
+        js_alloc_sample_reset_countdown(rt);
+        return;
+    }
+    /* no sampling of the memory allocated here */
+    rt->alloc_sample_countdown = INT64_MAX;
+
+    depth = 0;
+    if (rt->alloc_sample_class_id != 0) {
+        char class_buf[ATOM_GET_STR_BUF_SIZE];
+        snprintf(buf, sizeof(buf), "(%s)",
+                 JS_AtomGetStrRT(rt, class_buf, sizeof(class_buf),
+                                 rt->class_array[rt->alloc_sample_class_id].class_name));
+        frames[depth] = js_alloc_sample_get_frame(rt, s, buf);
+        if (!frames[depth])
+            goto done;
+        depth++;
+    }
+    /* the last slot is kept for the "(truncated)" frame */
+    for(sf = rt->current_stack_frame;
+        sf != NULL && depth < countof(frames) - 1;
+        sf = sf->prev_frame) {
+        js_alloc_sample_frame_name(rt, buf, sizeof(buf), sf->cur_func);
+        frames[depth] = js_alloc_sample_get_frame(rt, s, buf);
+        if (!frames[depth])
+            goto done;
+        depth++;
+    }
+    if (sf != NULL) {
+        /* same as the CPU profiler: the outer frames of the deeper
+           stacks are replaced by a "(truncated)" frame */
+        frames[depth] = js_alloc_sample_get_frame(rt, s, "(truncated)");
+        if (!frames[depth])
+            goto done;
+        depth++;
+    }
+
+    h = 1;
+    for(i = 0; i < depth; i++)
+        h = h * 263 + (uint32_t)(uintptr_t)frames[i];
+    for(e = s->stacks.hash[h & ((1 << s->stacks.hash_bits) - 1)];
+        e != NULL; e = e->hash_next) {
+        st = (JSAllocSampleStack *)e;
+        if (e->hash == h && st->depth == depth &&
+            !memcmp(st->frames, frames, sizeof(frames[0]) * depth))
+            goto found;
+    }
+    st = js_mallocz_rt(rt, sizeof(*st) + sizeof(frames[0]) * depth);
+    if (!st)
+        goto done;
+    st->depth = depth;
+    memcpy(st->frames, frames, sizeof(frames[0]) * depth);
+    if (js_profile_hash_add(rt, &s->stacks, &st->header, h)) {
+        js_free_rt(rt, st);
+        goto done;
+    }
+ found:
+    st->count++;
+    /* an allocation of 'size' bytes is sampled with the probability
+       1 - exp(-size / interval) */
+    st->size += size / (1 - exp(-(double)size / s->interval));
+ done:
+    js_alloc_sample_reset_countdown(rt);
+}
+
+/* Start sampling the allocations on average every 'interval'
+   bytes. The previous samples are discarded. Return 0 if OK or -1 if
+   memory error. */
+int JS_StartAllocationSampling(JSRuntime *rt, size_t interval)
+{
+    JSAllocSampler *s;
+
+    JS_StopAllocationSampling(rt);
+    s = js_mallocz_rt(rt, sizeof(*s));
+    if (!s)
+        return -1;
+    s->interval = interval ? (double)interval : 1;
+    s->random_state = 0x853c49e6748fea9b;
+    if (js_profile_hash_init(rt, &s->frames) ||
+        js_profile_hash_init(rt, &s->stacks)) {
+        js_free_rt(rt, s->frames.hash);
+        js_free_rt(rt, s->stacks.hash);
+        js_free_rt(rt, s);
+        return -1;
+    }
+    rt->alloc_sampler = s;
+    js_alloc_sample_reset_countdown(rt);
+    return 0;
+}
+
+/* Stop sampling and free the samples */
+void JS_StopAllocationSampling(JSRuntime *rt)
+{
+    JSAllocSampler *s = rt->alloc_sampler;
+
+    if (!s)
+        return;
+    rt->alloc_sampler = NULL;
+    js_alloc_sample_reset_countdown(rt);
+    js_profile_hash_free(rt, &s->stacks);
+    js_profile_hash_free(rt, &s->frames);
+    js_free_rt(rt, s);
+}
+
+/* Write the samples in the folded stack format used by the flame
+   graph tools: one line per stack with the frames separated by ';'
+   (outermost frame first) followed by the estimated number of
+   allocated bytes. Return 0 if OK or -1 if I/O error or if the
+   sampling is not enabled. */
+int JS_WriteAllocationProfile(JSRuntime *rt, FILE *f)
+{
+    JSAllocSampler *s = rt->alloc_sampler;
+    JSProfileEntry *e;
+    JSAllocSampleStack *st;
+    int i, j;
+
+    if (!s)
+        return -1;
+    for(i = 0; i < (1 << s->stacks.hash_bits); i++) {
+        for(e = s->stacks.hash[i]; e != NULL; e = e->hash_next) {
+            st = (JSAllocSampleStack *)e;
+            if (st->depth == 0)
+                fputs("(native)", f);
+            for(j = st->depth - 1; j >= 0; j--) {
+                fputs(st->frames[j]->name, f);
+                if (j != 0)
+                    fputc(';', f);
+            }
+            fprintf(f, " %" PRId64 "\n", (int64_t)(st->size + 0.5));
+        }
+    }
+    return ferror(f) ? -1 : 0;
+}
+
+/* CPU profiling: JS_ProfileTick() is called periodically, typically
+   from a SIGPROF handler. The JS stack is sampled at the next
+   interrupt poll point, so that no stack walk is done in the signal
+   handler. The samples form a call tree which is written in the
+   Chrome .cpuprofile format. */
+
+/* only the innermost frames of deeper stacks are kept. They are
+   attached to a "(truncated)" node. */
+#define JS_CPU_PROFILE_MAX_DEPTH 128
+
+typedef struct JSCPUProfileNode {
+    JSProfileEntry header; /* must come first */
+    int id; /* index in JSCPUProfiler.nodes */
+    int parent_id; /* -1 for the root node */
+    int first_child; /* -1 if none */
+    int next_sibling; /* -1 if none */
+    int hit_count;
+    int line_num; /* 0 if unknown */
+    int col_num;
+    char *filename; /* points inside 'name' */
+    char name[0];
+} JSCPUProfileNode;
+
+typedef struct JSCPUProfiler {
+    JSProfileHash node_hash;
+    JSCPUProfileNode **nodes; /* indexed by node id */
+    int node_count;
+    int node_size;
+    int *samples; /* node id of each sample */
+    int64_t *timestamps; /* time of each sample in us */
+    int sample_count;
+    int sample_size;
+    int64_t start_time;
+} JSCPUProfiler;
+
+/* OS dependent: return a time in us */
+static int64_t js_profile_time_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static JSCPUProfileNode *js_cpu_profile_get_node(JSRuntime *rt,
+                                                 JSCPUProfiler *s,
+                                                 int parent_id,
+                                                 const char *name,
+                                                 const char *filename,
+                                                 int line_num, int col_num)
+{
+    JSProfileEntry *e;
+    JSCPUProfileNode *n, *parent;
+    size_t name_len, filename_len;
+    uint32_t h;
+
+    name_len = strlen(name);
+    filename_len = strlen(filename);
+    h = hash_string8((const uint8_t *)name, name_len, parent_id);
+    h = hash_string8((const uint8_t *)filename, filename_len, h);
+    h = (h * 263 + line_num) * 263 + col_num;
+    for(e = s->node_hash.hash[h & ((1 << s->node_hash.hash_bits) - 1)];
+        e != NULL; e = e->hash_next) {
+        n = (JSCPUProfileNode *)e;
+        if (e->hash == h && n->parent_id == parent_id &&
+            n->line_num == line_num && n->col_num == col_num &&
+            !strcmp(n->name, name) && !strcmp(n->filename, filename))
+            return n;
+    }
+
+    if (s->node_count >= s->node_size) {
+        int new_size = max_int(s->node_size * 3 / 2, 64);
+        JSCPUProfileNode **new_nodes;
+        new_nodes = js_realloc_rt(rt, s->nodes, sizeof(s->nodes[0]) * new_size);
+        if (!new_nodes)
+            return NULL;
+        s->nodes = new_nodes;
+        s->node_size = new_size;
+    }
+    n = js_malloc_rt(rt, sizeof(*n) + name_len + 1 + filename_len + 1);
+    if (!n)
+        return NULL;
+    n->id = s->node_count;
+    n->parent_id = parent_id;
+    n->first_child = -1;
+    n->next_sibling = -1;
+    n->hit_count = 0;
+    n->line_num = line_num;
+    n->col_num = col_num;
+    memcpy(n->name, name, name_len + 1);
+    n->filename = n->name + name_len + 1;
+    memcpy(n->filename, filename, filename_len + 1);
+    if (js_profile_hash_add(rt, &s->node_hash, &n->header, h)) {
+        js_free_rt(rt, n);
+        return NULL;
+    }
+    s->nodes[s->node_count++] = n;
+    if (parent_id >= 0) {
+        parent = s->nodes[parent_id];
+        n->next_sibling = parent->first_child;
+        parent->first_child = n->id;
+    }
+    return n;
+}
+
+/* record 'count' samples of the current stack. Their timestamps are
+   spread between the previous sample and now. */
+static void js_cpu_profile_sample(JSRuntime *rt, int count)
+{
+    JSCPUProfiler *s = rt->cpu_profiler;
+    JSStackFrame *frames[JS_CPU_PROFILE_MAX_DEPTH], *sf;
+    JSCPUProfileNode *n;
+    char name[ATOM_GET_STR_BUF_SIZE];
+    char filename[256];
+    int depth, line_num, col_num, i;
+    int64_t t, last_t;
+
+    depth = 0;
+    for(sf = rt->current_stack_frame; sf != NULL && depth < countof(frames);
+        sf = sf->prev_frame) {
+        frames[depth++] = sf;
+    }
+    /* the root node is the first node */
+    n = s->nodes[0];
+    if (sf != NULL) {
+        n = js_cpu_profile_get_node(rt, s, n->id, "(truncated)", "", 0, 0);
+        if (!n)
+            return;
+    }
+    while (depth > 0) {
+        sf = frames[--depth];
+        js_profile_get_func_info(rt, sf->cur_func, name, sizeof(name),
+                                 filename, sizeof(filename),
+                                 &line_num, &col_num);
+        n = js_cpu_profile_get_node(rt, s, n->id, name, filename,
+                                    line_num, col_num);
+        if (!n)
+            return;
+    }
+    if (s->sample_count > s->sample_size - count) {
+        int new_size = max_int(max_int(s->sample_size * 3 / 2, 256),
+                               s->sample_count + count);
+        int *new_samples;
+        int64_t *new_timestamps;
+        new_samples = js_realloc_rt(rt, s->samples,
+                                    sizeof(s->samples[0]) * new_size);
+        if (!new_samples)
+            return;
+        s->samples = new_samples;
+        new_timestamps = js_realloc_rt(rt, s->timestamps,
+                                       sizeof(s->timestamps[0]) * new_size);
+        if (!new_timestamps)
+            return;
+        s->timestamps = new_timestamps;
+        s->sample_size = new_size;
+    }
+    t = js_profile_time_us();
+    if (s->sample_count > 0)
+        last_t = s->timestamps[s->sample_count - 1];
+    else
+        last_t = s->start_time;
+    n->hit_count += count;
+    for(i = 1; i <= count; i++) {
+        s->samples[s->sample_count] = n->id;
+        s->timestamps[s->sample_count] = last_t + (t - last_t) * i / count;
+        s->sample_count++;
+    }
+}
+
+/* return the number of pending profiling ticks and reset it */
+static inline int js_cpu_profile_get_ticks(JSRuntime *rt)
+{
+#ifdef CONFIG_ATOMICS
+    if (atomic_load_explicit(&rt->cpu_profile_ticks, memory_order_relaxed) == 0)
+        return 0;
+    return atomic_exchange(&rt->cpu_profile_ticks, 0);
+#else
+    int n = rt->cpu_profile_ticks;
+    rt->cpu_profile_ticks = 0;
+    return n;
+#endif
+}
+
+/* attribute the pending ticks to the current stack. Called at the
+   interrupt poll points and when a function is entered or left, so
+   that the ticks are charged to the function which received them. */
+static inline void js_cpu_profile_poll(JSRuntime *rt)
+{
+    if (unlikely(rt->cpu_profiler)) {
+        int n = js_cpu_profile_get_ticks(rt);
+        if (n != 0)
+            js_cpu_profile_sample(rt, n);
+    }
+}
+
+/* Can be called from a signal handler or from another thread: a
+   sample of the JS stack is taken at the next interrupt poll point
+   or at the next function call or return. */
+void JS_ProfileTick(JSRuntime *rt)
+{
+#ifdef CONFIG_ATOMICS
+    atomic_fetch_add(&rt->cpu_profile_ticks, 1);
+#else
+    rt->cpu_profile_ticks++;
+#endif
+}
+
+/* Start recording the samples requested with JS_ProfileTick(). The
+   previous samples are discarded. Return 0 if OK or -1 if memory
+   error. */
+int JS_StartProfiling(JSRuntime *rt)
+{
+    JSCPUProfiler *s;
+
+    JS_StopProfiling(rt);
+    s = js_mallocz_rt(rt, sizeof(*s));
+    if (!s)
+        return -1;
+    if (js_profile_hash_init(rt, &s->node_hash))
+        goto fail;
+    if (!js_cpu_profile_get_node(rt, s, -1, "(root)", "", 0, 0)) {
+        js_profile_hash_free(rt, &s->node_hash);
+    fail:
+        js_free_rt(rt, s->nodes);
+        js_free_rt(rt, s);
+        return -1;
+    }
+    s->start_time = js_profile_time_us();
+#ifdef CONFIG_ATOMICS
+    atomic_store(&rt->cpu_profile_ticks, 0);
+#else
+    rt->cpu_profile_ticks = 0;
+#endif
+    rt->cpu_profiler = s;
+    return 0;
+}
+
+/* Stop the profiling and free the samples */
+void JS_StopProfiling(JSRuntime *rt)
+{
+    JSCPUProfiler *s = rt->cpu_profiler;
+
+    if (!s)
+        return;
+    rt->cpu_profiler = NULL;
+    /* the nodes are freed with the hash table */
+    js_profile_hash_free(rt, &s->node_hash);
+    js_free_rt(rt, s->nodes);
+    js_free_rt(rt, s->samples);
+    js_free_rt(rt, s->timestamps);
+    js_free_rt(rt, s);
+}
+
+/* The non-ASCII characters are escaped. Invalid UTF-8 sequences and
+   lone surrogates are replaced by U+FFFD so that the output is always
+   valid JSON. */
+static void js_profile_write_json_string(FILE *f, const char *str)
+{
+    const uint8_t *p, *p_next, *p1;
+    int c, c1;
+
+    fputc('\"', f);
+    p = (const uint8_t *)str;
+    while (*p != '\0') {
+        c = *p;
+        if (c < 0x80) {
+            if (c == '\"' || c == '\\') {
+                fputc('\\', f);
+                fputc(c, f);
+            } else if (c < 0x20) {
+                fprintf(f, "\\u%04x", c);
+            } else {
+                fputc(c, f);
+            }
+            p++;
+        } else {
+            c = unicode_from_utf8(p, UTF8_CHAR_LEN_MAX, &p_next);
+            if (c < 0 || c > 0x10ffff) {
+                c = 0xfffd;
+                p_next = p + 1;
+            } else if (is_hi_surrogate(c)) {
+                /* JS_AtomGetStr() encodes the surrogate pairs as two
+                   3 byte sequences */
+                c1 = unicode_from_utf8(p_next, UTF8_CHAR_LEN_MAX, &p1);
+                if (is_lo_surrogate(c1)) {
+                    c = from_surrogate(c, c1);
+                    p_next = p1;
+                } else {
+                    c = 0xfffd;
+                }
+            } else if (is_lo_surrogate(c)) {
+                c = 0xfffd;
+            }
+            if (c >= 0x10000) {
+                fprintf(f, "\\u%04x\\u%04x", get_hi_surrogate(c),
+                        get_lo_surrogate(c));
+            } else {
+                fprintf(f, "\\u%04x", c);
+            }
+            p = p_next;
+        }
+    }
+    fputc('\"', f);
+}
+
+/* Write the samples in the Chrome .cpuprofile format. Return 0 if OK
+   or -1 if I/O error or if the profiling is not enabled. */
+int JS_WriteCPUProfile(JSRuntime *rt, FILE *f)
+{
+    JSCPUProfiler *s = rt->cpu_profiler;
+    JSCPUProfileNode *n;
+    int64_t last_time;
+    int i, id;
+
+    if (!s)
+        return -1;
+    fprintf(f, "{\"nodes\":[");
+    for(i = 0; i < s->node_count; i++) {
+        n = s->nodes[i];
+        /* the node ids start from 1 */
+        fprintf(f, "%s\n{\"id\":%d,\"callFrame\":{\"functionName\":",
+                i == 0 ? "" : ",", n->id + 1);
+        js_profile_write_json_string(f, n->name);
+        fprintf(f, ",\"scriptId\":\"0\",\"url\":");
+        js_profile_write_json_string(f, n->filename);
+        fprintf(f, ",\"lineNumber\":%d,\"columnNumber\":%d},\"hitCount\":%d,"
+                "\"children\":[", n->line_num - 1, n->col_num - 1,
+                n->hit_count);
+        for(id = n->first_child; id >= 0; id = s->nodes[id]->next_sibling) {
+            fprintf(f, "%s%d", id == n->first_child ? "" : ",", id + 1);
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "],\n\"startTime\":%" PRId64 ",\"endTime\":%" PRId64 ",\n"
+            "\"samples\":[", s->start_time, js_profile_time_us());
+    for(i = 0; i < s->sample_count; i++) {
+        fprintf(f, "%s%d", i == 0 ? "" : ",", s->samples[i] + 1);
+    }
+    fprintf(f, "],\n\"timeDeltas\":[");
+    last_time = s->start_time;
+    for(i = 0; i < s->sample_count; i++) {
+        fprintf(f, "%s%" PRId64, i == 0 ? "" : ",",
+                s->timestamps[i] - last_time);
+        last_time = s->timestamps[i];
+    }
+    fprintf(f, "]}\n");
+    return ferror(f) ? -1 : 0;
+}
+
+/* Function tracing: the bytecode and C function calls, the GC and
+   the jobs are recorded as complete events with their start time and
+   duration in a ring buffer, so that only the most recent events are
+   kept. */
+
+static const char * const js_trace_event_category[] = {
+    "function", "gc", "job",
+};
+
+typedef struct JSTraceName {
+    JSProfileEntry header; /* must come first */
+    int id; /* index in JSTracer.names */
+    JSTraceEventKindEnum kind : 8;
+    int line_num; /* 0 if unknown */
+    int col_num;
+    char *filename; /* points inside 'name' */
+    char name[0];
+} JSTraceName;
+
+typedef struct JSTraceEvent {
+    int64_t start_time; /* in us */
+    int64_t duration; /* in us */
+    int name_id;
+} JSTraceEvent;
+
+typedef struct JSTracer {
+    JSTraceEvent *events; /* ring buffer */
+    int event_size;
+    int64_t event_count; /* total number of recorded events */
+    int sample_rate; /* trace one top level event out of 'sample_rate' */
+    int sample_count;
+    BOOL sampled; /* TRUE if the current top level event is traced */
+    int64_t min_duration; /* shorter events are not recorded */
+    JSProfileHash name_hash;
+    JSTraceName **names; /* indexed by name id */
+    int name_count;
+    int name_size;
+} JSTracer;
+
+static JSTraceName *js_trace_get_name(JSRuntime *rt, JSTracer *s,
+                                      JSTraceEventKindEnum kind,
+                                      const char *name, const char *filename,
+                                      int line_num, int col_num)
+{
+    JSProfileEntry *e;
+    JSTraceName *n;
+    size_t name_len, filename_len;
+    uint32_t h;
+
+    name_len = strlen(name);
+    filename_len = strlen(filename);
+    h = hash_string8((const uint8_t *)name, name_len, kind);
+    h = hash_string8((const uint8_t *)filename, filename_len, h);
+    h = (h * 263 + line_num) * 263 + col_num;
+    for(e = s->name_hash.hash[h & ((1 << s->name_hash.hash_bits) - 1)];
+        e != NULL; e = e->hash_next) {
+        n = (JSTraceName *)e;
+        if (e->hash == h && n->kind == kind &&
+            n->line_num == line_num && n->col_num == col_num &&
+            !strcmp(n->name, name) && !strcmp(n->filename, filename))
+            return n;
+    }
+
+    if (s->name_count >= s->name_size) {
+        int new_size = max_int(s->name_size * 3 / 2, 64);
+        JSTraceName **new_names;
+        new_names = js_realloc_rt(rt, s->names, sizeof(s->names[0]) * new_size);
+        if (!new_names)
+            return NULL;
+        s->names = new_names;
+        s->name_size = new_size;
+    }
+    n = js_malloc_rt(rt, sizeof(*n) + name_len + 1 + filename_len + 1);
+    if (!n)
+        return NULL;
+    n->id = s->name_count;
+    n->kind = kind;
+    n->line_num = line_num;
+    n->col_num = col_num;
+    memcpy(n->name, name, name_len + 1);
+    n->filename = n->name + name_len + 1;
+    memcpy(n->filename, filename, filename_len + 1);
+    if (js_profile_hash_add(rt, &s->name_hash, &n->header, h)) {
+        js_free_rt(rt, n);
+        return NULL;
+    }
+    s->names[s->name_count++] = n;
+    return n;
+}
+
+/* 'func' is only used for JS_TRACE_EVENT_CALL */
+static void js_trace_add_event(JSRuntime *rt, JSTraceEventKindEnum kind,
+                               int64_t start_time, JSValueConst func)
+{
+    JSTracer *s = rt->tracer;
+    JSTraceEvent *ev;
+    JSTraceName *n;
+    char name[ATOM_GET_STR_BUF_SIZE];
+    char filename[256];
+    int64_t duration;
+    int line_num, col_num;
+
+    duration = js_profile_time_us() - start_time;
+    if (duration < s->min_duration)
+        return;
+    if (kind == JS_TRACE_EVENT_CALL) {
+        js_profile_get_func_info(rt, func, name, sizeof(name),
+                                 filename, sizeof(filename),
+                                 &line_num, &col_num);
+        if (name[0] == '\0')
+            pstrcpy(name, sizeof(name), "(anonymous)");
+        n = js_trace_get_name(rt, s, kind, name, filename, line_num, col_num);
+    } else {
+        n = js_trace_get_name(rt, s, kind,
+                              kind == JS_TRACE_EVENT_GC ? "(GC)" : "(job)",
+                              "", 0, 0);
+    }
+    if (!n)
+        return; /* the event is lost */
+    ev = &s->events[s->event_count % s->event_size];
+    ev->start_time = start_time;
+    ev->duration = duration;
+    ev->name_id = n->id;
+    s->event_count++;
+}
+
+/* Called at the start of a call or job event. Return its start time,
+   or -1 if it is not sampled. js_trace_end() must be called at the
+   end of the event. */
+static int64_t js_trace_begin(JSRuntime *rt)
+{
+    JSTracer *s = rt->tracer;
+
+    if (rt->trace_depth++ == 0) {
+        /* new top level event: the nested events are traced only if
+           it is sampled */
+        s->sampled = (s->sample_count++ % s->sample_rate) == 0;
+    }
+    if (!s->sampled)
+        return -1;
+    return js_profile_time_us();
+}
+
+static void js_trace_end(JSRuntime *rt, int64_t start_time,
+                         JSTraceEventKindEnum kind, JSValueConst func)
+{
+    rt->trace_depth--;
+    /* the tracing may have been stopped during the event */
+    if (start_time >= 0 && rt->tracer)
+        js_trace_add_event(rt, kind, start_time, func);
+}
+
+/* Start recording the function calls, GC and jobs in a ring buffer
+   of 'max_events' events. Only one top level call or job out of
+   'sample_rate' is traced with its nested calls. The events shorter
+   than 'min_duration' microseconds are not recorded. The previous
+   events are discarded. Return 0 if OK or -1 if memory error. */
+int JS_StartTracing(JSRuntime *rt, int max_events, int sample_rate,
+                    int64_t min_duration)
+{
+    JSTracer *s;
+
+    JS_StopTracing(rt);
+    s = js_mallocz_rt(rt, sizeof(*s));
+    if (!s)
+        return -1;
+    s->event_size = max_int(max_events, 1);
+    s->events = js_malloc_rt(rt, sizeof(s->events[0]) * s->event_size);
+    if (!s->events)
+        goto fail;
+    if (js_profile_hash_init(rt, &s->name_hash)) {
+    fail:
+        js_free_rt(rt, s->events);
+        js_free_rt(rt, s);
+        return -1;
+    }
+    s->sample_rate = max_int(sample_rate, 1);
+    s->min_duration = min_duration;
+    /* the calls in progress are considered as sampled */
+    s->sampled = TRUE;
+    rt->tracer = s;
+    return 0;
+}
+
+/* Stop the tracing and free the events */
+void JS_StopTracing(JSRuntime *rt)
+{
+    JSTracer *s = rt->tracer;
+
+    if (!s)
+        return;
+    rt->tracer = NULL;
+    /* the names are freed with the hash table */
+    js_profile_hash_free(rt, &s->name_hash);
+    js_free_rt(rt, s->names);
+    js_free_rt(rt, s->events);
+    js_free_rt(rt, s);
+}
+
+/* Write the recorded events in the Chrome trace event format. Return
+   0 if OK or -1 if I/O error or if the tracing is not enabled. */
+int JS_WriteTrace(JSRuntime *rt, FILE *f)
+{
+    JSTracer *s = rt->tracer;
+    JSTraceEvent *ev;
+    JSTraceName *n;
+    int64_t i, first;
+
+    if (!s)
+        return -1;
+    first = max_int64(s->event_count - s->event_size, 0);
+    fprintf(f, "{\"traceEvents\":[");
+    for(i = first; i < s->event_count; i++) {
+        ev = &s->events[i % s->event_size];
+        n = s->names[ev->name_id];
+        fprintf(f, "%s\n{\"name\":", i == first ? "" : ",");
+        js_profile_write_json_string(f, n->name);
+        fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%" PRId64
+                ",\"dur\":%" PRId64 ",\"pid\":1,\"tid\":1",
+                js_trace_event_category[n->kind], ev->start_time,
+                ev->duration);
+        if (n->filename[0] != '\0') {
+            fprintf(f, ",\"args\":{\"url\":");
+            js_profile_write_json_string(f, n->filename);
+            fprintf(f, ",\"lineNumber\":%d,\"columnNumber\":%d}",
+                    n->line_num, n->col_num);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "],\n\"displayTimeUnit\":\"ms\"}\n");
+    return ferror(f) ? -1 : 0;
+}
+
 JSValue JS_GetGlobalObject(JSContext *ctx)
 {
     return JS_DupValue(ctx, ctx->global_obj);
@@ -7856,6 +11117,16 @@ static no_inline __exception int __js_poll_interrupts(JSContext *ctx)
 {
     JSRuntime *rt = ctx->rt;
     ctx->interrupt_counter = JS_INTERRUPT_COUNTER_INIT;
+    if (unlikely(rt->cpu_profiler)) {
+        /* check the profiling ticks more often */
+        ctx->interrupt_counter = JS_PROFILE_INTERRUPT_COUNTER;
+        js_cpu_profile_poll(rt);
+        /* but call the interrupt handler at the usual rate */
+        ctx->interrupt_handler_countdown -= JS_PROFILE_INTERRUPT_COUNTER;
+        if (ctx->interrupt_handler_countdown > 0)
+            return 0;
+        ctx->interrupt_handler_countdown = JS_INTERRUPT_COUNTER_INIT;
+    }
     if (rt->interrupt_handler) {
         if (rt->interrupt_handler(rt, rt->interrupt_opaque)) {
             JS_ThrowInterrupted(ctx);
@@ -8237,7 +11508,7 @@ JSValue JS_GetPropertyInternal(JSContext *ctx, JSValueConst obj,
                     uint32_t idx;
                     idx = __JS_AtomToUInt32(prop);
                     if (idx < p1->len) {
-                        return js_new_string_char(ctx, string_rope_get(obj, idx));
+                        return js_new_string_char(ctx, string_rope_get(ctx->rt, obj, idx));
                     }
                 } else if (prop == JS_ATOM_length) {
                     return JS_NewInt32(ctx, p1->len);
@@ -13576,10 +16847,37 @@ static JSValue js_dtoa2(JSContext *ctx,
     return res;
 }
 
+/* Same as js_dtoa2(ctx, d, 10, 0, JS_DTOA_FORMAT_FREE). The recently
+   converted numbers are kept in a direct mapped cache. */
+static JSValue js_float64_to_string(JSContext *ctx, double d)
+{
+    JSRuntime *rt = ctx->rt;
+    JSFloat64StringCacheEntry *e;
+    uint64_t a;
+    JSValue val;
+
+    if (d >= 0 && d < JS_INT_STRING_CACHE_SIZE && d == (int)d)
+        return js_new_string_int32(ctx, (int)d);
+    a = float64_as_uint64(d);
+    e = &rt->float64_string_cache[(a * UINT64_C(0x61C8864680B583EB)) >>
+                                  (64 - JS_FLOAT64_STRING_CACHE_BITS)];
+    if (e->str && e->bits == a) {
+        js_rc(e->str)->ref_count++;
+        return JS_MKPTR(JS_TAG_STRING, e->str);
+    }
+    val = js_dtoa2(ctx, d, 10, 0, JS_DTOA_FORMAT_FREE);
+    if (JS_IsException(val))
+        return val;
+    if (e->str)
+        js_free_string(rt, e->str);
+    e->bits = a;
+    e->str = JS_VALUE_GET_STRING(JS_DupValue(ctx, val));
+    return val;
+}
+
 static JSValue JS_ToStringInternal(JSContext *ctx, JSValueConst val, BOOL is_ToPropertyKey)
 {
     uint32_t tag;
-    char buf[32];
 
     tag = JS_VALUE_GET_NORM_TAG(val);
     switch(tag) {
@@ -13588,12 +16886,7 @@ static JSValue JS_ToStringInternal(JSContext *ctx, JSValueConst val, BOOL is_ToP
     case JS_TAG_STRING_ROPE:
         return js_linearize_string_rope(ctx, JS_DupValue(ctx, val));
     case JS_TAG_INT:
-        {
-            size_t len;
-            len = i32toa(buf, JS_VALUE_GET_INT(val));
-            return js_new_string8_len(ctx, buf, len);
-        }
-        break;
+        return js_new_string_int32(ctx, JS_VALUE_GET_INT(val));
     case JS_TAG_BOOL:
         return JS_AtomToString(ctx, JS_VALUE_GET_BOOL(val) ?
                           JS_ATOM_true : JS_ATOM_false);
@@ -13623,8 +16916,7 @@ static JSValue JS_ToStringInternal(JSContext *ctx, JSValueConst val, BOOL is_ToP
             return JS_ThrowTypeError(ctx, "cannot convert symbol to string");
         }
     case JS_TAG_FLOAT64:
-        return js_dtoa2(ctx, JS_VALUE_GET_FLOAT64(val), 10, 0,
-                        JS_DTOA_FORMAT_FREE);
+        return js_float64_to_string(ctx, JS_VALUE_GET_FLOAT64(val));
     case JS_TAG_SHORT_BIG_INT:
     case JS_TAG_BIG_INT:
         return js_bigint_to_string(ctx, val);
@@ -13666,6 +16958,15 @@ static JSValue JS_ToStringCheckObject(JSContext *ctx, JSValueConst val)
     return JS_ToString(ctx, val);
 }
 
+/* same as JS_ToStringCheckObject() but a rope is returned as is */
+static JSValue js_to_string_or_rope_check_object(JSContext *ctx,
+                                                 JSValueConst val)
+{
+    if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING_ROPE)
+        return JS_DupValue(ctx, val);
+    return JS_ToStringCheckObject(ctx, val);
+}
+
 #define JS_PRINT_MAX_DEPTH 8
 
 typedef struct {
@@ -17588,6 +20889,7 @@ static JSValue js_call_c_function(JSContext *ctx, JSValueConst func_obj,
     JSValueConst *arg_buf;
     int arg_count, i;
     JSCFunctionEnum cproto;
+    int64_t trace_start;
 
     p = JS_VALUE_GET_OBJ(func_obj);
     cproto = p->u.cfunc.cproto;
@@ -17597,6 +20899,11 @@ static JSValue js_call_c_function(JSContext *ctx, JSValueConst func_obj,
     if (js_check_stack_overflow(rt, sizeof(arg_buf[0]) * arg_count))
         return JS_ThrowStackOverflow(ctx);
 
+    trace_start = JS_TRACE_NONE;
+    if (unlikely(rt->tracer))
+        trace_start = js_trace_begin(rt);
+    /* the pending ticks belong to the caller */
+    js_cpu_profile_poll(rt);
     prev_sf = rt->current_stack_frame;
     sf->prev_frame = prev_sf;
     rt->current_stack_frame = sf;
@@ -17701,7 +21008,11 @@ static JSValue js_call_c_function(JSContext *ctx, JSValueConst func_obj,
         abort();
     }
 
+    /* the ticks received during the native call are attributed to it */
+    js_cpu_profile_poll(rt);
     rt->current_stack_frame = sf->prev_frame;
+    if (unlikely(trace_start != JS_TRACE_NONE))
+        js_trace_end(rt, trace_start, JS_TRACE_EVENT_CALL, func_obj);
     return ret_val;
 }
 
@@ -17754,6 +21065,52 @@ typedef enum {
 #define FUNC_RET_YIELD_STAR    2
 #define FUNC_RET_INITIAL_YIELD 3
 
+/* 'op1 + op2' is being computed and 'pc' points to the next
+   opcode. If it stores the result to a local variable which holds
+   the only other reference to the string op1 (e.g. 's += a.b'), return
+   the variable so that op2 can be appended to op1 in place. */
+static JSValue *js_add_get_loc_target(const uint8_t *pc, JSValue *var_buf,
+                                      JSValueConst op1)
+{
+    int idx;
+
+    if (JS_VALUE_GET_TAG(op1) != JS_TAG_STRING ||
+        js_rc(JS_VALUE_GET_STRING(op1))->ref_count != 2)
+        return NULL;
+    switch(pc[0]) {
+#if SHORT_OPCODES
+    case OP_put_loc0:
+    case OP_put_loc1:
+    case OP_put_loc2:
+    case OP_put_loc3:
+        idx = pc[0] - OP_put_loc0;
+        break;
+    case OP_set_loc0:
+    case OP_set_loc1:
+    case OP_set_loc2:
+    case OP_set_loc3:
+        idx = pc[0] - OP_set_loc0;
+        break;
+    case OP_put_loc8:
+    case OP_set_loc8:
+        idx = pc[1];
+        break;
+#endif
+    case OP_put_loc:
+    case OP_set_loc:
+    case OP_put_loc_check:
+    case OP_set_loc_check:
+        idx = get_u16(pc + 1);
+        break;
+    default:
+        return NULL;
+    }
+    if (JS_VALUE_GET_TAG(var_buf[idx]) != JS_TAG_STRING ||
+        JS_VALUE_GET_PTR(var_buf[idx]) != JS_VALUE_GET_PTR(op1))
+        return NULL;
+    return &var_buf[idx];
+}
+
 /* argv[] is modified if (flags & JS_CALL_FLAG_COPY_ARGV) = 0. */
 static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                                JSValueConst this_obj, JSValueConst new_target,
@@ -17769,9 +21126,14 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
     JSValue *local_buf, *stack_buf, *var_buf, *arg_buf, *sp, ret_val, *pval;
     JSVarRef **var_refs;
     size_t alloca_size;
+    int64_t trace_start;
 
 #if !DIRECT_DISPATCH
+#ifdef CONFIG_OPCODE_STATS
+#define SWITCH(pc)      switch (opcode = *pc++, js_opcode_stats_update(rt, b, pc), opcode)
+#else
 #define SWITCH(pc)      switch (opcode = *pc++)
+#endif
 #define CASE(op)        case op
 #define DEFAULT         default
 #define BREAK           break
@@ -17786,7 +21148,11 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
 #include "quickjs-opcode.h"
         [ OP_COUNT ... 255 ] = &&case_default
     };
+#ifdef CONFIG_OPCODE_STATS
+#define SWITCH(pc)      goto *dispatch_table[opcode = *pc++, js_opcode_stats_update(rt, b, pc), opcode];
+#else
 #define SWITCH(pc)      goto *dispatch_table[opcode = *pc++];
+#endif
 #define CASE(op)        case_ ## op
 #define DEFAULT         case_default
 #define BREAK           SWITCH(pc)
@@ -17810,6 +21176,10 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             sp = sf->cur_sp;
             sf->cur_sp = NULL; /* cur_sp is NULL if the function is running */
             pc = sf->cur_pc;
+            trace_start = JS_TRACE_NONE;
+            if (unlikely(rt->tracer))
+                trace_start = js_trace_begin(rt);
+            js_cpu_profile_poll(rt);
             sf->prev_frame = rt->current_stack_frame;
             rt->current_stack_frame = sf;
             if (s->throw_flag)
@@ -17874,6 +21244,11 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
         sf->var_refs[i] = NULL;
     sp = stack_buf;
     pc = b->byte_code_buf;
+    trace_start = JS_TRACE_NONE;
+    if (unlikely(rt->tracer))
+        trace_start = js_trace_begin(rt);
+    /* the pending ticks belong to the caller */
+    js_cpu_profile_poll(rt);
     sf->prev_frame = rt->current_stack_frame;
     rt->current_stack_frame = sf;
     ctx = b->realm; /* set the current realm */
@@ -17929,7 +21304,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             BREAK;
 #endif
         CASE(OP_push_atom_value):
-            *sp++ = JS_AtomToValue(ctx, get_u32(pc));
+            *sp++ = JS_AtomToValue(ctx, b->atoms[get_u32(pc)]);
             pc += 4;
             BREAK;
         CASE(OP_undefined):
@@ -18346,7 +21721,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             {
                 JSAtom atom;
                 int type;
-                atom = get_u32(pc);
+                atom = b->atoms[get_u32(pc)];
                 type = pc[4];
                 pc += 5;
                 if (type == JS_THROW_VAR_RO)
@@ -18790,7 +22165,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 JSProperty *pr;
                 JSAtom atom;
                 int idx;
-                atom = get_u32(pc);
+                atom = b->atoms[get_u32(pc)];
                 idx = get_u16(pc + 4);
                 pc += 6;
                 *sp++ = JS_NewObjectProto(ctx, JS_NULL);
@@ -18817,7 +22192,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
         CASE(OP_make_var_ref):
             {
                 JSAtom atom;
-                atom = get_u32(pc);
+                atom = b->atoms[get_u32(pc)];
                 pc += 4;
                 sf->cur_pc = pc;
 
@@ -19123,7 +22498,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 if (is_length) {                                        \
                     atom = JS_ATOM_length;                              \
                 } else {                                                \
-                    atom = get_u32(pc);                                 \
+                    atom = b->atoms[get_u32(pc)];                       \
                     pc += 4;                                            \
                 }                                                       \
                                                                         \
@@ -19191,7 +22566,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 JSProperty *pr;
                 JSShapeProperty *prs;
 
-                atom = get_u32(pc);
+                atom = b->atoms[get_u32(pc)];
                 pc += 4;
 
                 obj = sp[-2];
@@ -19228,7 +22603,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 JSAtom atom;
                 JSValue val;
 
-                atom = get_u32(pc);
+                atom = b->atoms[get_u32(pc)];
                 pc += 4;
                 val = JS_NewSymbolFromAtom(ctx, atom, JS_ATOM_TYPE_PRIVATE);
                 if (JS_IsException(val))
@@ -19278,7 +22653,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             {
                 int ret;
                 JSAtom atom;
-                atom = get_u32(pc);
+                atom = b->atoms[get_u32(pc)];
                 pc += 4;
 
                 ret = JS_DefinePropertyValue(ctx, sp[-2], atom, sp[-1],
@@ -19293,7 +22668,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             {
                 int ret;
                 JSAtom atom;
-                atom = get_u32(pc);
+                atom = b->atoms[get_u32(pc)];
                 pc += 4;
 
                 ret = JS_DefineObjectName(ctx, sp[-1], atom, JS_PROP_CONFIGURABLE);
@@ -19345,7 +22720,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                         goto exception;
                     opcode += OP_define_method - OP_define_method_computed;
                 } else {
-                    atom = get_u32(pc);
+                    atom = b->atoms[get_u32(pc)];
                     pc += 4;
                 }
                 op_flags = *pc++;
@@ -19391,7 +22766,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 int class_flags;
                 JSAtom atom;
 
-                atom = get_u32(pc);
+                atom = b->atoms[get_u32(pc)];
                 class_flags = pc[4];
                 pc += 5;
                 if (js_op_define_class(ctx, sp, atom, class_flags,
@@ -19720,7 +23095,17 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                                              JS_VALUE_GET_FLOAT64(op2));
                     sp--;
                 } else if (JS_IsString(op1) && JS_IsString(op2)) {
-                    sp[-2] = JS_ConcatString(ctx, op1, op2);
+                    JSValue *pv;
+                    JSString *p;
+                    pv = js_add_get_loc_target(pc, var_buf, op1);
+                    if (pv &&
+                        (p = js_string_append_in_place(ctx, JS_VALUE_GET_STRING(op1), op2, TRUE))) {
+                        /* the variable is overwritten by the next opcode */
+                        sp[-2] = *pv = JS_MKPTR(JS_TAG_STRING, p);
+                        JS_FreeValue(ctx, op2);
+                    } else {
+                        sp[-2] = JS_ConcatString(ctx, op1, op2);
+                    }
                     sp--;
                     if (JS_IsException(sp[-1]))
                         goto exception;
@@ -19757,9 +23142,13 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                     sp--;
                 } else if (JS_VALUE_GET_TAG(*pv) == JS_TAG_STRING &&
                            JS_VALUE_GET_TAG(op2) == JS_TAG_STRING) {
+                    JSString *p;
                     sp--;
                     sf->cur_pc = pc;
-                    if (JS_ConcatStringInPlace(ctx, JS_VALUE_GET_STRING(*pv), op2)) {
+                    p = JS_VALUE_GET_STRING(*pv);
+                    if (js_rc(p)->ref_count == 1 &&
+                        (p = js_string_append_in_place(ctx, p, op2, TRUE))) {
+                        *pv = JS_MKPTR(JS_TAG_STRING, p);
                         JS_FreeValue(ctx, op2);
                     } else {
                         op2 = JS_ConcatString(ctx, JS_DupValue(ctx, *pv), op2);
@@ -20255,7 +23644,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 JSAtom atom;
                 int ret;
 
-                atom = get_u32(pc);
+                atom = b->atoms[get_u32(pc)];
                 pc += 4;
                 sf->cur_pc = pc;
 
@@ -20315,7 +23704,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 int32_t diff;
                 JSValue obj, val;
                 int ret, is_with;
-                atom = get_u32(pc);
+                atom = b->atoms[get_u32(pc)];
                 diff = get_u32(pc + 4);
                 is_with = pc[8];
                 pc += 9;
@@ -20524,7 +23913,10 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             JS_FreeValue(ctx, *pval);
         }
     }
+    js_cpu_profile_poll(rt);
     rt->current_stack_frame = sf->prev_frame;
+    if (unlikely(trace_start != JS_TRACE_NONE))
+        js_trace_end(rt, trace_start, JS_TRACE_EVENT_CALL, sf->cur_func);
     return ret_val;
 }
 
@@ -20827,6 +24219,11 @@ static void async_func_free(JSRuntime *rt, JSAsyncFunctionState *s)
             if (rt->gc_phase == JS_GC_PHASE_NONE) {
                 free_zero_refcount(rt);
             }
+        } else if (js_rc(s)->mark == 0) {
+            /* see __JS_FreeValueRT() */
+            list_del(&s->header.link);
+            list_add_tail(&s->header.link, &rt->tmp_obj_list);
+            js_rc(s)->mark = 1;
         }
     }
 }
@@ -21964,7 +25361,7 @@ typedef struct JSParseState {
 } JSParseState;
 
 typedef struct JSOpCode {
-#ifdef DUMP_BYTECODE
+#if defined(DUMP_BYTECODE) || defined(CONFIG_OPCODE_STATS)
     const char *name;
 #endif
     uint8_t size; /* in bytes */
@@ -21977,7 +25374,7 @@ typedef struct JSOpCode {
 
 static const JSOpCode opcode_info[OP_COUNT + (OP_TEMP_END - OP_TEMP_START)] = {
 #define FMT(f)
-#ifdef DUMP_BYTECODE
+#if defined(DUMP_BYTECODE) || defined(CONFIG_OPCODE_STATS)
 #define DEF(id, size, n_pop, n_push, f) { #id, size, n_pop, n_push, OP_FMT_ ## f },
 #else
 #define DEF(id, size, n_pop, n_push, f) { size, n_pop, n_push, OP_FMT_ ## f },
@@ -21999,6 +25396,296 @@ static const JSOpCode opcode_info[OP_COUNT + (OP_TEMP_END - OP_TEMP_START)] = {
 #define short_opcode_info(op) opcode_info[op]
 #endif
 
+#ifdef CONFIG_OPCODE_STATS
+
+/* Opcode execution statistics. Each executed opcode is counted
+   globally, per function and with the previous opcode when it is
+   executed just after it in the same bytecode (fall-through), which
+   gives the candidates for superinstructions. */
+
+#define JS_OPCODE_STATS_DUMP_PAIRS 50
+#define JS_OPCODE_STATS_DUMP_FUNCS 30
+
+typedef struct JSOpcodeStatsFunc {
+    struct list_head link;
+    JSFunctionBytecode *b; /* NULL if the function was freed */
+    int64_t count;
+    int line_num;
+    char name[64];
+    char filename[64];
+} JSOpcodeStatsFunc;
+
+typedef struct JSOpcodeStats {
+    BOOL enabled;
+    int last_opcode;
+    const uint8_t *next_pc; /* pc following last_opcode */
+    int64_t opcode_count[256];
+    int64_t pair_count[256][256];
+    struct list_head func_list; /* list of JSOpcodeStatsFunc.link */
+} JSOpcodeStats;
+
+static no_inline JSOpcodeStatsFunc *js_opcode_stats_new_func(JSRuntime *rt,
+                                                             JSOpcodeStats *s,
+                                                             JSFunctionBytecode *b)
+{
+    JSOpcodeStatsFunc *e;
+    int col_num;
+
+    e = js_malloc_rt(rt, sizeof(*e));
+    if (!e)
+        return NULL;
+    e->b = b;
+    e->count = 0;
+    e->name[0] = '\0';
+    e->filename[0] = '\0';
+    e->line_num = 0;
+    if (b->func_name != JS_ATOM_NULL)
+        js_profile_atom_str(rt, e->name, sizeof(e->name), b->func_name);
+    if (b->has_debug) {
+        js_profile_atom_str(rt, e->filename, sizeof(e->filename),
+                            b->debug.filename);
+        e->line_num = find_line_num(NULL, b, -1, &col_num);
+    }
+    list_add_tail(&e->link, &s->func_list);
+    b->opcode_stats = e;
+    return e;
+}
+
+/* 'pc' points after the opcode byte */
+static inline void js_opcode_stats_update(JSRuntime *rt, JSFunctionBytecode *b,
+                                          const uint8_t *pc)
+{
+    JSOpcodeStats *s = rt->opcode_stats;
+    int op;
+
+    if (!s || !s->enabled)
+        return;
+    op = pc[-1];
+    s->opcode_count[op]++;
+    if (pc - 1 == s->next_pc)
+        s->pair_count[s->last_opcode][op]++;
+    s->last_opcode = op;
+    s->next_pc = pc - 1 + short_opcode_info(op).size;
+    if (unlikely(!b->opcode_stats)) {
+        if (!js_opcode_stats_new_func(rt, s, b))
+            return;
+    }
+    b->opcode_stats->count++;
+}
+
+static void js_opcode_stats_free_funcs(JSRuntime *rt, JSOpcodeStats *s)
+{
+    struct list_head *el, *el1;
+    JSOpcodeStatsFunc *e;
+
+    list_for_each_safe(el, el1, &s->func_list) {
+        e = list_entry(el, JSOpcodeStatsFunc, link);
+        if (e->b)
+            e->b->opcode_stats = NULL;
+        js_free_rt(rt, e);
+    }
+    init_list_head(&s->func_list);
+}
+
+static void js_free_opcode_stats(JSRuntime *rt)
+{
+    JSOpcodeStats *s = rt->opcode_stats;
+    if (!s)
+        return;
+    js_opcode_stats_free_funcs(rt, s);
+    js_free_rt(rt, s);
+    rt->opcode_stats = NULL;
+}
+
+/* Start or stop counting the executed opcodes. The counts are kept
+   when the counting is stopped. Return -1 if memory error or if
+   QuickJS was not compiled with CONFIG_OPCODE_STATS. */
+int JS_EnableOpcodeStats(JSRuntime *rt, JS_BOOL enable)
+{
+    JSOpcodeStats *s = rt->opcode_stats;
+
+    if (!s) {
+        if (!enable)
+            return 0;
+        s = js_mallocz_rt(rt, sizeof(*s));
+        if (!s)
+            return -1;
+        init_list_head(&s->func_list);
+        rt->opcode_stats = s;
+    }
+    s->enabled = enable;
+    s->next_pc = NULL;
+    return 0;
+}
+
+void JS_ResetOpcodeStats(JSRuntime *rt)
+{
+    JSOpcodeStats *s = rt->opcode_stats;
+    if (!s)
+        return;
+    js_opcode_stats_free_funcs(rt, s);
+    memset(s->opcode_count, 0, sizeof(s->opcode_count));
+    memset(s->pair_count, 0, sizeof(s->pair_count));
+    s->next_pc = NULL;
+}
+
+int64_t JS_GetOpcodeCount(JSRuntime *rt, int opcode)
+{
+    JSOpcodeStats *s = rt->opcode_stats;
+    if (!s || opcode < 0 || opcode >= OP_COUNT)
+        return 0;
+    return s->opcode_count[opcode];
+}
+
+/* number of times 'opcode2' was executed just after 'opcode1' */
+int64_t JS_GetOpcodePairCount(JSRuntime *rt, int opcode1, int opcode2)
+{
+    JSOpcodeStats *s = rt->opcode_stats;
+    if (!s || opcode1 < 0 || opcode1 >= OP_COUNT ||
+        opcode2 < 0 || opcode2 >= OP_COUNT)
+        return 0;
+    return s->pair_count[opcode1][opcode2];
+}
+
+/* return NULL if invalid opcode */
+const char *JS_GetOpcodeName(int opcode)
+{
+    if (opcode < 0 || opcode >= OP_COUNT)
+        return NULL;
+    return short_opcode_info(opcode).name;
+}
+
+static int js_opcode_stats_count_cmp(const void *a, const void *b, void *opaque)
+{
+    int64_t *tab = opaque;
+    int64_t v1 = tab[*(const int *)a];
+    int64_t v2 = tab[*(const int *)b];
+    /* decreasing count, then increasing index */
+    if (v1 != v2)
+        return (v1 < v2) - (v1 > v2);
+    return (*(const int *)a > *(const int *)b) -
+        (*(const int *)a < *(const int *)b);
+}
+
+static int js_opcode_stats_func_cmp(const void *a, const void *b, void *opaque)
+{
+    const JSOpcodeStatsFunc *e1 = *(JSOpcodeStatsFunc * const *)a;
+    const JSOpcodeStatsFunc *e2 = *(JSOpcodeStatsFunc * const *)b;
+    return (e1->count < e2->count) - (e1->count > e2->count);
+}
+
+static double js_opcode_stats_percent(int64_t count, int64_t total)
+{
+    return total ? count * 100.0 / total : 0;
+}
+
+void JS_DumpOpcodeStats(JSRuntime *rt, FILE *fp)
+{
+    JSOpcodeStats *s = rt->opcode_stats;
+    JSOpcodeStatsFunc *e, **func_tab;
+    struct list_head *el;
+    int64_t total, count;
+    int op, i, n, *tab;
+
+    if (!s)
+        return;
+    tab = js_malloc_rt(rt, sizeof(tab[0]) * OP_COUNT * OP_COUNT);
+    if (!tab)
+        return;
+
+    total = 0;
+    n = 0;
+    for(op = 0; op < OP_COUNT; op++) {
+        if (s->opcode_count[op] != 0) {
+            total += s->opcode_count[op];
+            tab[n++] = op;
+        }
+    }
+    rqsort(tab, n, sizeof(tab[0]), js_opcode_stats_count_cmp, s->opcode_count);
+    fprintf(fp, "%" PRId64 " opcodes executed:\n", total);
+    fprintf(fp, "%16s %6s  %s\n", "COUNT", "%", "OPCODE");
+    for(i = 0; i < n; i++) {
+        op = tab[i];
+        fprintf(fp, "%16" PRId64 " %6.2f  %s\n", s->opcode_count[op],
+                js_opcode_stats_percent(s->opcode_count[op], total),
+                JS_GetOpcodeName(op));
+    }
+
+    /* the pair index is op1 * 256 + op2 */
+    n = 0;
+    for(op = 0; op < OP_COUNT; op++) {
+        for(i = 0; i < OP_COUNT; i++) {
+            if (s->pair_count[op][i] != 0)
+                tab[n++] = op * 256 + i;
+        }
+    }
+    rqsort(tab, n, sizeof(tab[0]), js_opcode_stats_count_cmp, s->pair_count);
+    fprintf(fp, "\nmost frequent opcode pairs:\n");
+    fprintf(fp, "%16s %6s  %s\n", "COUNT", "%", "OPCODES");
+    for(i = 0; i < min_int(n, JS_OPCODE_STATS_DUMP_PAIRS); i++) {
+        count = ((int64_t *)s->pair_count)[tab[i]];
+        fprintf(fp, "%16" PRId64 " %6.2f  %s %s\n", count,
+                js_opcode_stats_percent(count, total),
+                JS_GetOpcodeName(tab[i] >> 8), JS_GetOpcodeName(tab[i] & 0xff));
+    }
+    js_free_rt(rt, tab);
+
+    n = 0;
+    list_for_each(el, &s->func_list) {
+        n++;
+    }
+    func_tab = js_malloc_rt(rt, sizeof(func_tab[0]) * max_int(n, 1));
+    if (!func_tab)
+        return;
+    i = 0;
+    list_for_each(el, &s->func_list) {
+        func_tab[i++] = list_entry(el, JSOpcodeStatsFunc, link);
+    }
+    rqsort(func_tab, n, sizeof(func_tab[0]), js_opcode_stats_func_cmp, NULL);
+    fprintf(fp, "\nfunctions executing the most opcodes:\n");
+    fprintf(fp, "%16s %6s  %s\n", "COUNT", "%", "FUNCTION");
+    for(i = 0; i < min_int(n, JS_OPCODE_STATS_DUMP_FUNCS); i++) {
+        e = func_tab[i];
+        fprintf(fp, "%16" PRId64 " %6.2f  %s %s:%d\n", e->count,
+                js_opcode_stats_percent(e->count, total),
+                e->name[0] ? e->name : "<anonymous>",
+                e->filename[0] ? e->filename : "<unknown>", e->line_num);
+    }
+    js_free_rt(rt, func_tab);
+}
+
+#else
+
+int JS_EnableOpcodeStats(JSRuntime *rt, JS_BOOL enable)
+{
+    return -1;
+}
+
+void JS_ResetOpcodeStats(JSRuntime *rt)
+{
+}
+
+int64_t JS_GetOpcodeCount(JSRuntime *rt, int opcode)
+{
+    return 0;
+}
+
+int64_t JS_GetOpcodePairCount(JSRuntime *rt, int opcode1, int opcode2)
+{
+    return 0;
+}
+
+const char *JS_GetOpcodeName(int opcode)
+{
+    return NULL;
+}
+
+void JS_DumpOpcodeStats(JSRuntime *rt, FILE *fp)
+{
+}
+
+#endif /* !CONFIG_OPCODE_STATS */
+
 static __exception int next_token(JSParseState *s);
 
 static void free_token(JSParseState *s, JSToken *token)
@@ -31968,6 +35655,86 @@ static void free_bytecode_atoms(JSRuntime *rt,
     }
 }
 
+static BOOL is_atom_fmt(int fmt)
+{
+    switch(fmt) {
+    case OP_FMT_atom:
+    case OP_FMT_atom_u8:
+    case OP_FMT_atom_u16:
+    case OP_FMT_atom_label_u8:
+    case OP_FMT_atom_label_u16:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/* Build the table of the distinct atoms referenced by the final
+   bytecode of 'fd'. 'patom_idx' receives the table index of each atom
+   operand, in bytecode order. The bytecode is not modified. */
+static int compute_atom_table(JSContext *ctx, JSFunctionDef *fd,
+                              JSAtom **patoms, int *patom_count,
+                              uint32_t **patom_idx)
+{
+    const uint8_t *bc_buf = fd->byte_code.buf;
+    int bc_len = fd->byte_code.size;
+    int pos, n, count, hash_size;
+    uint32_t h, *hash, *atom_idx;
+    JSAtom atom, *atoms;
+
+    *patoms = NULL;
+    *patom_count = 0;
+    *patom_idx = NULL;
+
+    n = 0;
+    for(pos = 0; pos < bc_len; pos += short_opcode_info(bc_buf[pos]).size) {
+        if (is_atom_fmt(short_opcode_info(bc_buf[pos]).fmt))
+            n++;
+    }
+    if (n == 0)
+        return 0;
+
+    hash_size = 1;
+    while (hash_size < 2 * n)
+        hash_size <<= 1;
+    atoms = js_malloc(ctx, sizeof(atoms[0]) * n);
+    atom_idx = js_malloc(ctx, sizeof(atom_idx[0]) * n);
+    hash = js_mallocz(ctx, sizeof(hash[0]) * hash_size);
+    if (!atoms || !atom_idx || !hash) {
+        js_free(ctx, atoms);
+        js_free(ctx, atom_idx);
+        js_free(ctx, hash);
+        return -1;
+    }
+
+    n = 0;
+    count = 0;
+    for(pos = 0; pos < bc_len; pos += short_opcode_info(bc_buf[pos]).size) {
+        if (!is_atom_fmt(short_opcode_info(bc_buf[pos]).fmt))
+            continue;
+        atom = get_u32(bc_buf + pos + 1);
+        /* hash[] contains the table index + 1, 0 for an empty entry */
+        h = (atom * 0x9e3779b1) & (hash_size - 1);
+        for(;;) {
+            if (hash[h] == 0) {
+                atoms[count++] = atom;
+                hash[h] = count;
+                break;
+            }
+            if (atoms[hash[h] - 1] == atom)
+                break;
+            h = (h + 1) & (hash_size - 1);
+        }
+        atom_idx[n++] = hash[h] - 1;
+    }
+    js_free(ctx, hash);
+
+    *patoms = atoms;
+    *patom_count = count;
+    *patom_idx = atom_idx;
+    return 0;
+}
+
 static void js_free_function_def(JSContext *ctx, JSFunctionDef *fd)
 {
     int i;
@@ -32054,6 +35821,15 @@ static void print_lines(const char *source, int line, int line1) {
     }
 }
 
+/* the atom operands of the final bytecode are indexes in b->atoms */
+static JSAtom dump_get_atom(const JSFunctionBytecode *b, const uint8_t *p)
+{
+    JSAtom atom = get_u32(p);
+    if (b)
+        atom = b->atoms[atom];
+    return atom;
+}
+
 static void dump_byte_code(JSContext *ctx, int pass,
                            const uint8_t *tab, int len,
                            const JSBytecodeVarDef *vardefs, 
@@ -32254,22 +36030,22 @@ static void dump_byte_code(JSContext *ctx, int pass,
             break;
         case OP_FMT_atom:
             printf(" ");
-            print_atom(ctx, get_u32(tab + pos));
+            print_atom(ctx, dump_get_atom(b, tab + pos));
             break;
         case OP_FMT_atom_u8:
             printf(" ");
-            print_atom(ctx, get_u32(tab + pos));
+            print_atom(ctx, dump_get_atom(b, tab + pos));
             printf(",%d", get_u8(tab + pos + 4));
             break;
         case OP_FMT_atom_u16:
             printf(" ");
-            print_atom(ctx, get_u32(tab + pos));
+            print_atom(ctx, dump_get_atom(b, tab + pos));
             printf(",%d", get_u16(tab + pos + 4));
             break;
         case OP_FMT_atom_label_u8:
         case OP_FMT_atom_label_u16:
             printf(" ");
-            print_atom(ctx, get_u32(tab + pos));
+            print_atom(ctx, dump_get_atom(b, tab + pos));
             addr = get_u32(tab + pos + 4);
             if (pass == 1)
                 printf(",%u:%u", addr, label_slots[addr].pos);
@@ -35832,7 +39608,10 @@ static JSValue js_create_function(JSContext *ctx, JSFunctionDef *fd)
     struct list_head *el, *el1;
     int stack_size, scope, idx;
     int function_size, byte_code_offset, cpool_offset;
-    int closure_var_offset, vardefs_offset;
+    int closure_var_offset, vardefs_offset, atoms_offset;
+    int atom_count;
+    JSAtom *atoms;
+    uint32_t *atom_idx;
     BOOL strip_var_debug;
     
     /* recompute scope linkage */
@@ -35922,6 +39701,9 @@ static JSValue js_create_function(JSContext *ctx, JSFunctionDef *fd)
     if (compute_stack_size(ctx, fd, &stack_size) < 0)
         goto fail;
 
+    if (compute_atom_table(ctx, fd, &atoms, &atom_count, &atom_idx))
+        goto fail;
+
     if (fd->strip_debug) {
         function_size = offsetof(JSFunctionBytecode, debug);
     } else {
@@ -35933,12 +39715,17 @@ static JSValue js_create_function(JSContext *ctx, JSFunctionDef *fd)
     function_size += (fd->arg_count + fd->var_count) * sizeof(*b->vardefs);
     closure_var_offset = function_size;
     function_size += fd->closure_var_count * sizeof(*fd->closure_var);
+    atoms_offset = function_size;
+    function_size += atom_count * sizeof(*atoms);
     byte_code_offset = function_size;
     function_size += fd->byte_code.size;
 
     b = js_mallocz(ctx, function_size);
-    if (!b)
+    if (!b) {
+        js_free(ctx, atoms);
+        js_free(ctx, atom_idx);
         goto fail;
+    }
     js_rc(b)->ref_count = 1;
 
     b->byte_code_buf = (void *)((uint8_t*)b + byte_code_offset);
@@ -35947,6 +39734,33 @@ static JSValue js_create_function(JSContext *ctx, JSFunctionDef *fd)
     js_free(ctx, fd->byte_code.buf);
     fd->byte_code.buf = NULL;
 
+    /* replace the atom operands by their index in the atom table. The
+       table keeps one reference for each distinct atom. */
+    b->atom_count = atom_count;
+    if (atom_count) {
+        int pos, n, next_idx;
+        uint32_t idx;
+
+        b->atoms = (void *)((uint8_t*)b + atoms_offset);
+        memcpy(b->atoms, atoms, atom_count * sizeof(*atoms));
+        n = 0;
+        next_idx = 0;
+        for(pos = 0; pos < b->byte_code_len;
+            pos += short_opcode_info(b->byte_code_buf[pos]).size) {
+            if (!is_atom_fmt(short_opcode_info(b->byte_code_buf[pos]).fmt))
+                continue;
+            idx = atom_idx[n++];
+            /* the indexes are allocated in order of first occurrence */
+            if (idx == next_idx)
+                next_idx++;
+            else
+                JS_FreeAtom(ctx, b->atoms[idx]);
+            put_u32(b->byte_code_buf + pos + 1, idx);
+        }
+    }
+    js_free(ctx, atoms);
+    js_free(ctx, atom_idx);
+
     strip_var_debug = fd->strip_debug && !fd->has_eval_call; /* XXX: check */
     b->func_name = fd->func_name;
     if (fd->arg_count + fd->var_count > 0) {
@@ -36095,8 +39909,8 @@ static void free_function_bytecode(JSRuntime *rt, JSFunctionBytecode *b)
                JS_AtomGetStrRT(rt, buf, sizeof(buf), b->func_name));
     }
 #endif
-    if (b->byte_code_buf)
-        free_bytecode_atoms(rt, b->byte_code_buf, b->byte_code_len, TRUE);
+    for(i = 0; i < b->atom_count; i++)
+        JS_FreeAtomRT(rt, b->atoms[i]);
 
     if (b->vardefs) {
         for(i = 0; i < b->arg_count + b->var_count; i++) {
@@ -36113,6 +39927,10 @@ static void free_function_bytecode(JSRuntime *rt, JSFunctionBytecode *b)
     if (b->realm)
         JS_FreeContext(b->realm);
 
+#ifdef CONFIG_OPCODE_STATS
+    if (b->opcode_stats)
+        b->opcode_stats->b = NULL;
+#endif
     JS_FreeAtomRT(rt, b->func_name);
     if (b->has_debug) {
         JS_FreeAtomRT(rt, b->debug.filename);
@@ -37306,7 +41124,7 @@ typedef enum BCTagEnum {
     BC_TAG_OBJECT_REFERENCE,
 } BCTagEnum;
 
-#define BC_VERSION 5
+#define BC_VERSION 6
 
 typedef struct BCWriterState {
     JSContext *ctx;
@@ -37352,15 +41170,6 @@ static const char * const bc_tag_str[] = {
 };
 #endif
 
-static inline BOOL is_be(void)
-{
-    union {
-        uint16_t a;
-        uint8_t  b;
-    } u = {0x100};
-    return u.b;
-}
-
 static void bc_put_u8(BCWriterState *s, uint8_t v)
 {
     dbuf_putc(&s->dbuf, v);
@@ -37518,50 +41327,26 @@ static void bc_byte_swap(uint8_t *bc_buf, int bc_len)
     }
 }
 
+/* the atom operands are indexes in the function atom table, so the
+   bytecode is written as is */
 static int JS_WriteFunctionBytecode(BCWriterState *s,
                                     const uint8_t *bc_buf1, int bc_len)
 {
-    int pos, len, op;
-    JSAtom atom;
     uint8_t *bc_buf;
-    uint32_t val;
+
+    if (!is_be()) {
+        dbuf_put(&s->dbuf, bc_buf1, bc_len);
+        return 0;
+    }
 
     bc_buf = js_malloc(s->ctx, bc_len);
     if (!bc_buf)
         return -1;
     memcpy(bc_buf, bc_buf1, bc_len);
-
-    pos = 0;
-    while (pos < bc_len) {
-        op = bc_buf[pos];
-        len = short_opcode_info(op).size;
-        switch(short_opcode_info(op).fmt) {
-        case OP_FMT_atom:
-        case OP_FMT_atom_u8:
-        case OP_FMT_atom_u16:
-        case OP_FMT_atom_label_u8:
-        case OP_FMT_atom_label_u16:
-            atom = get_u32(bc_buf + pos + 1);
-            if (bc_atom_to_idx(s, &val, atom))
-                goto fail;
-            put_u32(bc_buf + pos + 1, val);
-            break;
-        default:
-            break;
-        }
-        pos += len;
-    }
-
-    if (is_be())
-        bc_byte_swap(bc_buf, bc_len);
-
+    bc_byte_swap(bc_buf, bc_len);
     dbuf_put(&s->dbuf, bc_buf, bc_len);
-
     js_free(s->ctx, bc_buf);
     return 0;
- fail:
-    js_free(s->ctx, bc_buf);
-    return -1;
 }
 
 static void JS_WriteString(BCWriterState *s, JSString *p)
@@ -37570,9 +41355,9 @@ static void JS_WriteString(BCWriterState *s, JSString *p)
     bc_put_leb128(s, ((uint32_t)p->len << 1) | p->is_wide_char);
     if (p->is_wide_char) {
         for(i = 0; i < p->len; i++)
-            bc_put_u16(s, p->u.str16[i]);
+            bc_put_u16(s, str16_ptr(p)[i]);
     } else {
-        dbuf_put(&s->dbuf, p->u.str8, p->len);
+        dbuf_put(&s->dbuf, str8_ptr(p), p->len);
     }
 }
 
@@ -37658,6 +41443,7 @@ static int JS_WriteFunctionTag(BCWriterState *s, JSValueConst obj)
     bc_put_leb128(s, b->var_ref_count);
     bc_put_leb128(s, b->closure_var_count);
     bc_put_leb128(s, b->cpool_count);
+    bc_put_leb128(s, b->atom_count);
     bc_put_leb128(s, b->byte_code_len);
     if (b->vardefs) {
         bc_put_leb128(s, b->arg_count + b->var_count);
@@ -37692,6 +41478,11 @@ static int JS_WriteFunctionTag(BCWriterState *s, JSValueConst obj)
         bc_put_u16(s, flags);
     }
 
+    for(i = 0; i < b->atom_count; i++) {
+        if (bc_put_atom(s, b->atoms[i]))
+            goto fail;
+    }
+
     if (JS_WriteFunctionBytecode(s, b->byte_code_buf, b->byte_code_len))
         goto fail;
 
@@ -38418,7 +42209,6 @@ static int JS_ReadFunctionBytecode(BCReaderState *s, JSFunctionBytecode *b,
 {
     uint8_t *bc_buf;
     int pos, len, op;
-    JSAtom atom;
     uint32_t idx;
 
     if (s->is_rom_data) {
@@ -38437,34 +42227,18 @@ static int JS_ReadFunctionBytecode(BCReaderState *s, JSFunctionBytecode *b,
     if (is_be())
         bc_byte_swap(bc_buf, bc_len);
 
+    /* check the atom indexes */
     pos = 0;
     while (pos < bc_len) {
         op = bc_buf[pos];
         len = short_opcode_info(op).size;
-        switch(short_opcode_info(op).fmt) {
-        case OP_FMT_atom:
-        case OP_FMT_atom_u8:
-        case OP_FMT_atom_u16:
-        case OP_FMT_atom_label_u8:
-        case OP_FMT_atom_label_u16:
+        if (is_atom_fmt(short_opcode_info(op).fmt)) {
             idx = get_u32(bc_buf + pos + 1);
-            if (s->is_rom_data) {
-                /* just increment the reference count of the atom */
-                JS_DupAtom(s->ctx, (JSAtom)idx);
-            } else {
-                if (bc_idx_to_atom(s, &atom, idx)) {
-                    /* Note: the atoms will be freed up to this position */
-                    b->byte_code_len = pos;
-                    return -1;
-                }
-                put_u32(bc_buf + pos + 1, atom);
-#ifdef DUMP_READ_OBJECT
-                bc_read_trace(s, "at %d, fixup atom: ", pos + 1); print_atom(s->ctx, atom); printf("\n");
-#endif
+            if (idx >= b->atom_count) {
+                JS_ThrowSyntaxError(s->ctx, "invalid atom index (pos=%u)",
+                                    (unsigned int)(s->ptr - s->buf_start));
+                return s->error_state = -1;
             }
-            break;
-        default:
-            break;
         }
         pos += len;
     }
@@ -38551,7 +42325,7 @@ static JSValue JS_ReadFunctionTag(BCReaderState *s)
     uint8_t v8;
     int idx, i, local_count;
     int cpool_offset, byte_code_offset;
-    int closure_var_offset, vardefs_offset;
+    int closure_var_offset, vardefs_offset, atoms_offset;
     uint64_t function_size;
     
     memset(&bc, 0, sizeof(bc));
@@ -38590,6 +42364,8 @@ static JSValue JS_ReadFunctionTag(BCReaderState *s)
         goto fail;
     if (bc_get_leb128_int(s, &bc.cpool_count))
         goto fail;
+    if (bc_get_leb128_int(s, &bc.atom_count))
+        goto fail;
     if (bc_get_leb128_int(s, &bc.byte_code_len))
         goto fail;
     if (bc_get_leb128_int(s, &local_count))
@@ -38606,6 +42382,8 @@ static JSValue JS_ReadFunctionTag(BCReaderState *s)
     function_size += (uint64_t)local_count * sizeof(*bc.vardefs);
     closure_var_offset = function_size;
     function_size += (uint64_t)bc.closure_var_count * sizeof(*bc.closure_var);
+    atoms_offset = function_size;
+    function_size += (uint64_t)bc.atom_count * sizeof(*bc.atoms);
     byte_code_offset = function_size;
     if (!bc.read_only_bytecode) {
         function_size += bc.byte_code_len;
@@ -38628,6 +42406,9 @@ static JSValue JS_ReadFunctionTag(BCReaderState *s)
     if (b->cpool_count != 0) {
         b->cpool = (void *)((uint8_t*)b + cpool_offset);
     }
+    if (b->atom_count != 0) {
+        b->atoms = (void *)((uint8_t*)b + atoms_offset);
+    }
 
     js_rc(b)->ref_count = 1;
     add_gc_object(ctx->rt, &b->header, JS_GC_OBJ_TYPE_FUNCTION_BYTECODE);
@@ -38687,6 +42468,17 @@ static JSValue JS_ReadFunctionTag(BCReaderState *s)
             cv->var_kind = bc_get_flags(v16, &idx, 4);
 #ifdef DUMP_READ_OBJECT
             bc_read_trace(s, "name: "); print_atom(s->ctx, cv->var_name); printf("\n");
+#endif
+        }
+        bc_read_trace(s, "}\n");
+    }
+    if (b->atom_count != 0) {
+        bc_read_trace(s, "atoms {\n");
+        for(i = 0; i < b->atom_count; i++) {
+            if (bc_get_atom(s, &b->atoms[i]))
+                goto fail;
+#ifdef DUMP_READ_OBJECT
+            bc_read_trace(s, "atom: "); print_atom(s->ctx, b->atoms[i]); printf("\n");
 #endif
         }
         bc_read_trace(s, "}\n");
@@ -39256,8 +43048,6 @@ static int JS_ReadObjectAtoms(BCReaderState *s)
         if (atom == JS_ATOM_NULL)
             return s->error_state = -1;
         s->idx_to_atom[i] = atom;
-        if (s->is_rom_data && (atom != (i + s->first_atom)))
-            s->is_rom_data = FALSE; /* atoms must be relocated */
     }
     bc_read_trace(s, "}\n");
     return 0;
@@ -42440,7 +46230,7 @@ static JSValue js_array_join(JSContext *ctx, JSValueConst this_val,
             goto exception;
         p = JS_VALUE_GET_STRING(sep);
         if (p->len == 1 && !p->is_wide_char)
-            c = p->u.str8[0];
+            c = str8_ptr(p)[0];
         else
             c = -1;
     }
@@ -43289,8 +47079,8 @@ static JSValue js_create_array_iterator(JSContext *ctx, JSValueConst this_val,
 
     kind = magic & 3;
     if (magic & 4) {
-        /* string iterator case */
-        arr = JS_ToStringCheckObject(ctx, this_val);
+        /* string iterator case. A rope is not linearized. */
+        arr = js_to_string_or_rope_check_object(ctx, this_val);
         class_id = JS_CLASS_STRING_ITERATOR;
     } else {
         arr = JS_ToObject(ctx, this_val);
@@ -44670,11 +48460,15 @@ static JSValue js_number_toString(JSContext *ctx, JSValueConst this_val,
     if (JS_VALUE_GET_TAG(val) == JS_TAG_INT) {
         char buf1[70];
         int len;
+        if (base == 10)
+            return js_new_string_int32(ctx, JS_VALUE_GET_INT(val));
         len = i64toa_radix(buf1, JS_VALUE_GET_INT(val), base);
         return js_new_string8_len(ctx, buf1, len);
     }
     if (JS_ToFloat64Free(ctx, &d, val))
         return JS_EXCEPTION;
+    if (base == 10)
+        return js_float64_to_string(ctx, d);
     flags = JS_DTOA_FORMAT_FREE;
     if (base != 10)
         flags |= JS_DTOA_EXP_DISABLED;
@@ -45133,25 +48927,94 @@ static JSValue js_string___isSpace(JSContext *ctx, JSValueConst this_val,
 }
 #endif
 
+/* Compare 'len' characters of the string or rope 'val' at position
+   'pos' with the characters of 'p1' at position 'pos1'. Return 0 if
+   they are equal. */
+static int string_rope_cmp(JSValueConst val, uint32_t pos,
+                           JSString *p1, uint32_t pos1, uint32_t len)
+{
+    JSStringRope *r;
+    uint32_t l;
+    int res;
+
+    while (JS_VALUE_GET_TAG(val) == JS_TAG_STRING_ROPE) {
+        r = JS_VALUE_GET_STRING_ROPE(val);
+        l = string_rope_get_len(r->left);
+        if (pos + len <= l) {
+            val = r->left;
+        } else if (pos >= l) {
+            val = r->right;
+            pos -= l;
+        } else {
+            /* recursion is acceptable because the rope depth is bounded */
+            res = string_rope_cmp(r->left, pos, p1, pos1, l - pos);
+            if (res != 0)
+                return res;
+            val = r->right;
+            pos1 += l - pos;
+            len -= l - pos;
+            pos = 0;
+        }
+    }
+    return js_string_memcmp(JS_VALUE_GET_STRING(val), pos, p1, pos1, len);
+}
+
+/* Return the substring [start, end) of the string or rope 'val'. The
+   rope is not linearized and its subtrees are shared with the result
+   when possible. */
+static JSValue js_sub_string_rope(JSContext *ctx, JSValueConst val,
+                                  uint32_t start, uint32_t end)
+{
+    JSStringRope *r;
+    JSValue a, b;
+    uint32_t len;
+
+    for(;;) {
+        if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING)
+            return js_sub_string(ctx, JS_VALUE_GET_STRING(val), start, end);
+        r = JS_VALUE_GET_STRING_ROPE(val);
+        if (start == 0 && end == r->len)
+            return JS_DupValue(ctx, val);
+        len = string_rope_get_len(r->left);
+        if (end <= len) {
+            val = r->left;
+        } else if (start >= len) {
+            val = r->right;
+            start -= len;
+            end -= len;
+        } else {
+            break;
+        }
+    }
+    /* recursion is acceptable because the rope depth is bounded */
+    a = js_sub_string_rope(ctx, r->left, start, len);
+    if (JS_IsException(a))
+        return a;
+    b = js_sub_string_rope(ctx, r->right, 0, end - len);
+    if (JS_IsException(b)) {
+        JS_FreeValue(ctx, a);
+        return b;
+    }
+    return JS_ConcatString(ctx, a, b);
+}
+
 static JSValue js_string_charCodeAt(JSContext *ctx, JSValueConst this_val,
                                      int argc, JSValueConst *argv)
 {
     JSValue val, ret;
-    JSString *p;
     int idx, c;
 
-    val = JS_ToStringCheckObject(ctx, this_val);
+    val = js_to_string_or_rope_check_object(ctx, this_val);
     if (JS_IsException(val))
         return val;
-    p = JS_VALUE_GET_STRING(val);
     if (JS_ToInt32Sat(ctx, &idx, argv[0])) {
         JS_FreeValue(ctx, val);
         return JS_EXCEPTION;
     }
-    if (idx < 0 || idx >= p->len) {
+    if (idx < 0 || idx >= string_rope_get_len(val)) {
         ret = JS_NAN;
     } else {
-        c = string_get(p, idx);
+        c = string_rope_get(ctx->rt, val, idx);
         ret = JS_NewInt32(ctx, c);
     }
     JS_FreeValue(ctx, val);
@@ -45162,26 +49025,25 @@ static JSValue js_string_charAt(JSContext *ctx, JSValueConst this_val,
                                 int argc, JSValueConst *argv, int is_at)
 {
     JSValue val, ret;
-    JSString *p;
-    int idx, c;
+    int idx, c, len;
 
-    val = JS_ToStringCheckObject(ctx, this_val);
+    val = js_to_string_or_rope_check_object(ctx, this_val);
     if (JS_IsException(val))
         return val;
-    p = JS_VALUE_GET_STRING(val);
+    len = string_rope_get_len(val);
     if (JS_ToInt32Sat(ctx, &idx, argv[0])) {
         JS_FreeValue(ctx, val);
         return JS_EXCEPTION;
     }
     if (idx < 0 && is_at)
-        idx += p->len;
-    if (idx < 0 || idx >= p->len) {
+        idx += len;
+    if (idx < 0 || idx >= len) {
         if (is_at)
             ret = JS_UNDEFINED;
         else
             ret = JS_AtomToString(ctx, JS_ATOM_empty_string);
     } else {
-        c = string_get(p, idx);
+        c = string_rope_get(ctx->rt, val, idx);
         ret = js_new_string_char(ctx, c);
     }
     JS_FreeValue(ctx, val);
@@ -45192,21 +49054,19 @@ static JSValue js_string_codePointAt(JSContext *ctx, JSValueConst this_val,
                                      int argc, JSValueConst *argv)
 {
     JSValue val, ret;
-    JSString *p;
     int idx, c;
 
-    val = JS_ToStringCheckObject(ctx, this_val);
+    val = js_to_string_or_rope_check_object(ctx, this_val);
     if (JS_IsException(val))
         return val;
-    p = JS_VALUE_GET_STRING(val);
     if (JS_ToInt32Sat(ctx, &idx, argv[0])) {
         JS_FreeValue(ctx, val);
         return JS_EXCEPTION;
     }
-    if (idx < 0 || idx >= p->len) {
+    if (idx < 0 || idx >= string_rope_get_len(val)) {
         ret = JS_UNDEFINED;
     } else {
-        c = string_getc(p, &idx);
+        c = string_rope_getc(ctx->rt, val, (uint32_t *)&idx);
         ret = JS_NewInt32(ctx, c);
     }
     JS_FreeValue(ctx, val);
@@ -45241,21 +49101,118 @@ static int string_cmp(JSString *p1, JSString *p2, int x1, int x2, int len)
     return 0;
 }
 
+/* return the index of the first 'c' in tab[from..len) or -1. The
+   comparison is done 4 characters at a time. */
+static int memchr16(const uint16_t *tab, int c, int from, int len)
+{
+    const uint64_t ones = 0x0001000100010001;
+    uint64_t v, mask;
+    int i;
+
+    mask = ones * c;
+    for (i = from; i + 4 <= len; i += 4) {
+        v = get_u64((const uint8_t *)(tab + i)) ^ mask;
+        /* non zero if one of the 16 bit words of 'v' is zero */
+        if (((v - ones) & ~v & (ones << 15)) != 0)
+            break;
+    }
+    for (; i < len; i++) {
+        if (tab[i] == c)
+            return i;
+    }
+    return -1;
+}
+
 static int string_indexof_char(JSString *p, int c, int from)
 {
     /* assuming 0 <= from <= p->len */
-    int i, len = p->len;
+    const uint8_t *q;
     if (p->is_wide_char) {
-        for (i = from; i < len; i++) {
-            if (p->u.str16[i] == c)
-                return i;
-        }
+        if (c > 0xffff)
+            return -1;
+        return memchr16(str16_ptr(p), c, from, p->len);
     } else {
         if ((c & ~0xff) == 0) {
-            for (i = from; i < len; i++) {
-                if (p->u.str8[i] == (uint8_t)c)
-                    return i;
+            q = memchr(str8_ptr(p) + from, c, p->len - from);
+            if (q)
+                return q - str8_ptr(p);
+        }
+    }
+    return -1;
+}
+
+/* Compute the maximal suffix of 'p' for the character order (or the
+   reverse order if 'rev' is TRUE). Return the position before its
+   start and its period in '*pper'. */
+static int string_max_suffix(JSString *p, int *pper, BOOL rev)
+{
+    int ms, j, k, per, a, b, len = p->len;
+
+    ms = -1;
+    j = 0;
+    k = per = 1;
+    while (j + k < len) {
+        a = string_get(p, j + k);
+        b = string_get(p, ms + k);
+        if (rev ? a > b : a < b) {
+            j += k;
+            k = 1;
+            per = j - ms;
+        } else if (a == b) {
+            if (k != per) {
+                k++;
+            } else {
+                j += per;
+                k = 1;
             }
+        } else {
+            ms = j;
+            j = ms + 1;
+            k = per = 1;
+        }
+    }
+    *pper = per;
+    return ms;
+}
+
+/* Two-Way string matching (Crochemore and Perrin): linear time and
+   constant space. 'p2' must not be empty. */
+static int string_indexof_two_way(JSString *p1, JSString *p2, int from)
+{
+    int i, j, ell, mem, per, per1, len1 = p1->len, len2 = p2->len;
+    BOOL periodic;
+
+    /* critical factorization */
+    i = string_max_suffix(p2, &per, FALSE);
+    j = string_max_suffix(p2, &per1, TRUE);
+    if (j > i) {
+        i = j;
+        per = per1;
+    }
+    ell = i;
+    periodic = !string_cmp(p2, p2, 0, per, ell + 1);
+    if (!periodic)
+        per = max_int(ell + 1, len2 - ell - 1) + 1;
+    mem = -1;
+    j = from;
+    while (j <= len1 - len2) {
+        /* match the right part, then the left part */
+        i = max_int(ell, mem) + 1;
+        while (i < len2 && string_get(p2, i) == string_get(p1, i + j))
+            i++;
+        if (i < len2) {
+            j += i - ell;
+            mem = -1;
+        } else {
+            i = ell;
+            while (i > mem && string_get(p2, i) == string_get(p1, i + j))
+                i--;
+            if (i <= mem)
+                return j;
+            j += per;
+            /* the prefix of length len2 - per is already matched */
+            if (periodic)
+                mem = len2 - per - 1;
         }
     }
     return -1;
@@ -45264,15 +49221,31 @@ static int string_indexof_char(JSString *p, int c, int from)
 static int string_indexof(JSString *p1, JSString *p2, int from)
 {
     /* assuming 0 <= from <= p1->len */
-    int c, i, j, len1 = p1->len, len2 = p2->len;
+    int c, c_last, i, j, len1 = p1->len, len2 = p2->len;
+    int64_t work;
+
     if (len2 == 0)
         return from;
-    for (i = from, c = string_get(p2, 0); i + len2 <= len1; i = j + 1) {
+    c = string_get(p2, 0);
+    if (len2 == 1)
+        return string_indexof_char(p1, c, from);
+    /* find the candidate positions with the first character, then
+       check the last one before comparing the rest */
+    c_last = string_get(p2, len2 - 1);
+    work = 0;
+    for (i = from; i + len2 <= len1; i = j + 1) {
         j = string_indexof_char(p1, c, i);
         if (j < 0 || j + len2 > len1)
             break;
-        if (!string_cmp(p1, p2, j + 1, 1, len2 - 1))
-            return j;
+        if (string_get(p1, j + len2 - 1) == c_last) {
+            if (!js_string_memcmp(p1, j + 1, p2, 1, len2 - 2))
+                return j;
+            /* avoid the quadratic worst case when the comparisons
+               cost more than the scanned length */
+            work += len2;
+            if (work > 2 * (int64_t)(j - from) + 256)
+                return string_indexof_two_way(p1, p2, j + 1);
+        }
     }
     return -1;
 }
@@ -45297,10 +49270,10 @@ static int js_string_find_invalid_codepoint(JSString *p)
     if (!p->is_wide_char)
         return -1;
     for(i = 0; i < p->len; i++) {
-        uint32_t c = p->u.str16[i];
+        uint32_t c = str16_ptr(p)[i];
         if (is_surrogate(c)) {
             if (is_hi_surrogate(c) && (i + 1) < p->len
-            &&  is_lo_surrogate(p->u.str16[i + 1])) {
+            &&  is_lo_surrogate(str16_ptr(p)[i + 1])) {
                 i++;
             } else {
                 return i;
@@ -45343,7 +49316,7 @@ static JSValue js_string_toWellFormed(JSContext *ctx, JSValueConst this_val,
     if (i < 0)
         return str;
 
-    ret = js_new_string16_len(ctx, p->u.str16, p->len);
+    ret = js_new_string16_len(ctx, str16_ptr(p), p->len);
     JS_FreeValue(ctx, str);
     if (JS_IsException(ret))
         return JS_EXCEPTION;
@@ -45409,13 +49382,17 @@ static JSValue js_string_indexOf(JSContext *ctx, JSValueConst this_val,
     }
     ret = -1;
     if (len >= v_len && inc * (stop - start) >= 0) {
-        for (i = start;; i += inc) {
-            if (!string_cmp(p, p1, i, 0, v_len)) {
-                ret = i;
-                break;
+        if (inc > 0) {
+            ret = string_indexof(p, p1, start);
+        } else {
+            for (i = start;; i += inc) {
+                if (!string_cmp(p, p1, i, 0, v_len)) {
+                    ret = i;
+                    break;
+                }
+                if (i == stop)
+                    break;
             }
-            if (i == stop)
-                break;
         }
     }
     JS_FreeValue(ctx, str);
@@ -45435,11 +49412,14 @@ static JSValue js_string_includes(JSContext *ctx, JSValueConst this_val,
                                   int argc, JSValueConst *argv, int magic)
 {
     JSValue str, v = JS_UNDEFINED;
-    int i, len, v_len, pos, start, stop, ret;
-    JSString *p;
+    int len, v_len, pos, start, stop, ret;
     JSString *p1;
 
-    str = JS_ToStringCheckObject(ctx, this_val);
+    /* startsWith and endsWith do not need to linearize a rope */
+    if (magic == 0)
+        str = JS_ToStringCheckObject(ctx, this_val);
+    else
+        str = js_to_string_or_rope_check_object(ctx, this_val);
     if (JS_IsException(str))
         return str;
     ret = js_is_regexp(ctx, argv[0]);
@@ -45451,9 +49431,8 @@ static JSValue js_string_includes(JSContext *ctx, JSValueConst this_val,
     v = JS_ToString(ctx, argv[0]);
     if (JS_IsException(v))
         goto fail;
-    p = JS_VALUE_GET_STRING(str);
     p1 = JS_VALUE_GET_STRING(v);
-    len = p->len;
+    len = string_rope_get_len(str);
     v_len = p1->len;
     pos = (magic == 2) ? len : 0;
     if (argc > 1 && !JS_IsUndefined(argv[1])) {
@@ -45475,13 +49454,10 @@ static JSValue js_string_includes(JSContext *ctx, JSValueConst this_val,
         start = stop = pos;
     }
     if (start >= 0 && start <= stop) {
-        for (i = start;; i++) {
-            if (!string_cmp(p, p1, i, 0, v_len)) {
-                ret = 1;
-                break;
-            }
-            if (i == stop)
-                break;
+        if (magic == 0) {
+            ret = (string_indexof(JS_VALUE_GET_STRING(str), p1, start) >= 0);
+        } else {
+            ret = !string_rope_cmp(str, start, p1, 0, v_len);
         }
     }
  done:
@@ -45653,8 +49629,8 @@ static int js_string_GetSubstitution(JSContext *ctx,
                 if (captures) {
                     int start, end;
                     if (captures[2 * k] && captures[2 * k + 1]) {
-                        start = (captures[2 * k] - sp->u.str8) >> shift;
-                        end = (captures[2 * k + 1] - sp->u.str8) >> shift;
+                        start = (captures[2 * k] - str8_ptr(sp)) >> shift;
+                        end = (captures[2 * k + 1] - str8_ptr(sp)) >> shift;
                         string_buffer_concat(b, sp, start, end);
                     }
                 } else {
@@ -45902,20 +49878,19 @@ static JSValue js_string_substring(JSContext *ctx, JSValueConst this_val,
                                    int argc, JSValueConst *argv)
 {
     JSValue str, ret;
-    int a, b, start, end;
-    JSString *p;
+    int a, b, start, end, len;
 
-    str = JS_ToStringCheckObject(ctx, this_val);
+    str = js_to_string_or_rope_check_object(ctx, this_val);
     if (JS_IsException(str))
         return str;
-    p = JS_VALUE_GET_STRING(str);
-    if (JS_ToInt32Clamp(ctx, &a, argv[0], 0, p->len, 0)) {
+    len = string_rope_get_len(str);
+    if (JS_ToInt32Clamp(ctx, &a, argv[0], 0, len, 0)) {
         JS_FreeValue(ctx, str);
         return JS_EXCEPTION;
     }
-    b = p->len;
+    b = len;
     if (!JS_IsUndefined(argv[1])) {
-        if (JS_ToInt32Clamp(ctx, &b, argv[1], 0, p->len, 0)) {
+        if (JS_ToInt32Clamp(ctx, &b, argv[1], 0, len, 0)) {
             JS_FreeValue(ctx, str);
             return JS_EXCEPTION;
         }
@@ -45927,7 +49902,7 @@ static JSValue js_string_substring(JSContext *ctx, JSValueConst this_val,
         start = b;
         end = a;
     }
-    ret = js_sub_string(ctx, p, start, end);
+    ret = js_sub_string_rope(ctx, str, start, end);
     JS_FreeValue(ctx, str);
     return ret;
 }
@@ -45937,13 +49912,11 @@ static JSValue js_string_substr(JSContext *ctx, JSValueConst this_val,
 {
     JSValue str, ret;
     int a, len, n;
-    JSString *p;
 
-    str = JS_ToStringCheckObject(ctx, this_val);
+    str = js_to_string_or_rope_check_object(ctx, this_val);
     if (JS_IsException(str))
         return str;
-    p = JS_VALUE_GET_STRING(str);
-    len = p->len;
+    len = string_rope_get_len(str);
     if (JS_ToInt32Clamp(ctx, &a, argv[0], 0, len, len)) {
         JS_FreeValue(ctx, str);
         return JS_EXCEPTION;
@@ -45955,7 +49928,7 @@ static JSValue js_string_substr(JSContext *ctx, JSValueConst this_val,
             return JS_EXCEPTION;
         }
     }
-    ret = js_sub_string(ctx, p, a, a + n);
+    ret = js_sub_string_rope(ctx, str, a, a + n);
     JS_FreeValue(ctx, str);
     return ret;
 }
@@ -45965,13 +49938,11 @@ static JSValue js_string_slice(JSContext *ctx, JSValueConst this_val,
 {
     JSValue str, ret;
     int len, start, end;
-    JSString *p;
 
-    str = JS_ToStringCheckObject(ctx, this_val);
+    str = js_to_string_or_rope_check_object(ctx, this_val);
     if (JS_IsException(str))
         return str;
-    p = JS_VALUE_GET_STRING(str);
-    len = p->len;
+    len = string_rope_get_len(str);
     if (JS_ToInt32Clamp(ctx, &start, argv[0], 0, len, len)) {
         JS_FreeValue(ctx, str);
         return JS_EXCEPTION;
@@ -45983,7 +49954,7 @@ static JSValue js_string_slice(JSContext *ctx, JSValueConst this_val,
             return JS_EXCEPTION;
         }
     }
-    ret = js_sub_string(ctx, p, start, max_int(end, start));
+    ret = js_sub_string_rope(ctx, str, start, max_int(end, start));
     JS_FreeValue(ctx, str);
     return ret;
 }
@@ -46140,16 +50111,16 @@ static int string_prevc(JSString *p, int *pidx)
         return 0;
     idx--;
     if (p->is_wide_char) {
-        c = p->u.str16[idx];
+        c = str16_ptr(p)[idx];
         if (is_lo_surrogate(c) && idx > 0) {
-            c1 = p->u.str16[idx - 1];
+            c1 = str16_ptr(p)[idx - 1];
             if (is_hi_surrogate(c1)) {
                 c = from_surrogate(c1, c);
                 idx--;
             }
         }
     } else {
-        c = p->u.str8[idx];
+        c = str8_ptr(p)[idx];
     }
     *pidx = idx;
     return c;
@@ -46183,10 +50154,112 @@ static BOOL test_final_sigma(JSString *p, int sigma_pos)
     return !lre_is_cased(c1);
 }
 
+/* Return a mask with 0x20 in the bytes of 'v' which are letters to
+   convert. All the bytes of 'v' must be ASCII characters. */
+static inline uint64_t ascii_case_conv_mask(uint64_t v, int to_lower)
+{
+    uint64_t a, b;
+    int lo, hi;
+
+    if (to_lower) {
+        lo = 'A';
+        hi = 'Z';
+    } else {
+        lo = 'a';
+        hi = 'z';
+    }
+    /* bit 7 of each byte is set if the byte is >= lo (a), resp. > hi
+       (b). There is no carry between the bytes. */
+    a = v + UINT64_C(0x0101010101010101) * (0x80 - lo);
+    b = v + UINT64_C(0x0101010101010101) * (0x7f - hi);
+    return ((a & ~b) & UINT64_C(0x8080808080808080)) >> 2;
+}
+
+/* Latin-1 case conversion. Return -1 if the result is not a Latin-1
+   character (or more than one character). */
+static inline int latin1_case_conv(int c, int to_lower)
+{
+    if (to_lower) {
+        if ((c >= 'A' && c <= 'Z') ||
+            (c >= 0xc0 && c <= 0xde && c != 0xd7))
+            c += 0x20;
+    } else {
+        if ((c >= 'a' && c <= 'z') ||
+            (c >= 0xe0 && c <= 0xfe && c != 0xf7))
+            c -= 0x20;
+        else if (c == 0xb5 || c == 0xdf || c == 0xff)
+            return -1;
+    }
+    return c;
+}
+
+/* Case conversion of a 8 bit string. The ASCII characters are
+   converted 8 at a time. 'val' is returned if it is not modified.
+   Return JS_UNINITIALIZED if the result does not fit in 8 bits. */
+static JSValue js_string_case_conv8(JSContext *ctx, JSValue val,
+                                    int to_lower)
+{
+    JSString *p, *str;
+    const uint8_t *src;
+    uint8_t *dst;
+    uint64_t v, m;
+    int i, len, c;
+
+    p = JS_VALUE_GET_STRING(val);
+    src = str8_ptr(p);
+    len = p->len;
+    /* look for the first character to convert */
+    i = 0;
+    for(;;) {
+        for(; i + 8 <= len; i += 8) {
+            v = get_u64(src + i);
+            if ((v & UINT64_C(0x8080808080808080)) != 0 ||
+                ascii_case_conv_mask(v, to_lower) != 0)
+                break;
+        }
+        if (i >= len)
+            return val;
+        c = latin1_case_conv(src[i], to_lower);
+        if (c < 0)
+            return JS_UNINITIALIZED;
+        if (c != src[i])
+            break;
+        i++;
+    }
+
+    str = js_alloc_string(ctx, len, 0);
+    if (!str) {
+        JS_FreeValue(ctx, val);
+        return JS_EXCEPTION;
+    }
+    dst = str->u.str8;
+    memcpy(dst, src, i);
+    while (i < len) {
+        if (i + 8 <= len) {
+            v = get_u64(src + i);
+            if ((v & UINT64_C(0x8080808080808080)) == 0) {
+                m = ascii_case_conv_mask(v, to_lower);
+                put_u64(dst + i, v ^ m);
+                i += 8;
+                continue;
+            }
+        }
+        c = latin1_case_conv(src[i], to_lower);
+        if (c < 0) {
+            js_free_string(ctx->rt, str);
+            return JS_UNINITIALIZED;
+        }
+        dst[i++] = c;
+    }
+    dst[len] = '\0';
+    JS_FreeValue(ctx, val);
+    return JS_MKPTR(JS_TAG_STRING, str);
+}
+
 static JSValue js_string_toLowerCase(JSContext *ctx, JSValueConst this_val,
                                      int argc, JSValueConst *argv, int to_lower)
 {
-    JSValue val;
+    JSValue val, ret;
     StringBuffer b_s, *b = &b_s;
     JSString *p;
     int i, c, j, l;
@@ -46198,6 +50271,11 @@ static JSValue js_string_toLowerCase(JSContext *ctx, JSValueConst this_val,
     p = JS_VALUE_GET_STRING(val);
     if (p->len == 0)
         return val;
+    if (!p->is_wide_char) {
+        ret = js_string_case_conv8(ctx, val, to_lower);
+        if (!JS_IsUninitialized(ret))
+            return ret;
+    }
     if (string_buffer_init(ctx, b, p->len))
         goto fail;
     for(i = 0; i < p->len;) {
@@ -46268,6 +50346,72 @@ static JSValue JS_NewUTF32String(JSContext *ctx, const uint32_t *buf, int len)
     return JS_EXCEPTION;
 }
 
+#define NORM_QUICK_CHECK_MAX 0x300
+
+/* bitmaps of the characters < NORM_QUICK_CHECK_MAX which are left
+   unchanged by each normalization form. These characters do not
+   combine with each other, so a string containing only these
+   characters is already normalized. */
+static const uint32_t norm_quick_check_table[4][NORM_QUICK_CHECK_MAX / 32] = {
+    { /* NFC */
+        0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+        0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+        0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+        0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+    },
+    { /* NFD */
+        0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+        0xc1810040, 0x41810040, 0x00030000, 0x810e00c0, 0x000c0e07, 0x800000c0,
+        0xffffffff, 0xfffe7ffc, 0x20001fff, 0x00ce0030, 0x30000000, 0xfff0003f,
+        0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+    },
+    { /* NFKC */
+        0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0x88c37afe,
+        0xffffffff, 0xffffffff, 0xffffffff, 0x7ff3ffff, 0xfffffdfe, 0x7fffffff,
+        0xffffffff, 0xffffffff, 0xffffe00f, 0xfff1ffff, 0xffffffff, 0xffffffff,
+        0xffffffff, 0xffffffff, 0xffffffff, 0xfe00ffff, 0xc0ffffff, 0xffffffe0,
+    },
+    { /* NFKD */
+        0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0x88c37afe,
+        0xc1810040, 0x41810040, 0x00030000, 0x010200c0, 0x000c0c06, 0x000000c0,
+        0xffffffff, 0xfffe7ffc, 0x2000000f, 0x00c00030, 0x30000000, 0xfff0003f,
+        0xffffffff, 0xffffffff, 0xffffffff, 0xfe00ffff, 0xc0ffffff, 0xffffffe0,
+    },
+};
+
+/* return TRUE if 'p' is known to be normalized in the form 'n_type'
+   without decoding it */
+static BOOL js_string_is_normalized_quick(JSString *p,
+                                          UnicodeNormalizationEnum n_type)
+{
+    const uint32_t *tab = norm_quick_check_table[n_type];
+    uint32_t i, c;
+
+    if (p->is_wide_char) {
+        const uint16_t *str = str16_ptr(p);
+        for(i = 0; i < p->len; i++) {
+            c = str[i];
+            if (c >= NORM_QUICK_CHECK_MAX ||
+                !((tab[c >> 5] >> (c & 31)) & 1))
+                return FALSE;
+        }
+    } else {
+        const uint8_t *str = str8_ptr(p);
+        i = 0;
+        /* the ASCII characters are always normalized */
+        while (i + 8 <= p->len &&
+               (get_u64(str + i) & UINT64_C(0x8080808080808080)) == 0) {
+            i += 8;
+        }
+        for(; i < p->len; i++) {
+            c = str[i];
+            if (!((tab[c >> 5] >> (c & 31)) & 1))
+                return FALSE;
+        }
+    }
+    return TRUE;
+}
+
 static int js_string_normalize1(JSContext *ctx, uint32_t **pout_buf,
                                 JSValueConst val,
                                 UnicodeNormalizationEnum n_type)
@@ -46331,6 +50475,8 @@ static JSValue js_string_normalize(JSContext *ctx, JSValueConst this_val,
         JS_FreeCString(ctx, form);
     }
 
+    if (js_string_is_normalized_quick(JS_VALUE_GET_STRING(val), n_type))
+        return val;
     out_len = js_string_normalize1(ctx, &out_buf, val, n_type);
     JS_FreeValue(ctx, val);
     if (out_len < 0)
@@ -46361,6 +50507,25 @@ static int js_UTF32_compare(const uint32_t *buf1, int buf1_len,
     return res;
 }
 
+/* same as js_UTF32_compare() for strings without surrogates */
+static int js_string_compare_chars(const JSString *p1, const JSString *p2)
+{
+    int i, len, c;
+
+    len = min_int(p1->len, p2->len);
+    for(i = 0; i < len; i++) {
+        c = string_get(p1, i) - string_get(p2, i);
+        if (c != 0)
+            return c;
+    }
+    if (p1->len == p2->len)
+        return 0;
+    else if (p1->len < p2->len)
+        return -1;
+    else
+        return 1;
+}
+
 static JSValue js_string_localeCompare(JSContext *ctx, JSValueConst this_val,
                                        int argc, JSValueConst *argv)
 {
@@ -46376,6 +50541,14 @@ static JSValue js_string_localeCompare(JSContext *ctx, JSValueConst this_val,
         JS_FreeValue(ctx, a);
         return JS_EXCEPTION;
     }
+    if (js_string_is_normalized_quick(JS_VALUE_GET_STRING(a), UNICODE_NFC) &&
+        js_string_is_normalized_quick(JS_VALUE_GET_STRING(b), UNICODE_NFC)) {
+        cmp = js_string_compare_chars(JS_VALUE_GET_STRING(a),
+                                      JS_VALUE_GET_STRING(b));
+        JS_FreeValue(ctx, a);
+        JS_FreeValue(ctx, b);
+        return JS_NewInt32(ctx, cmp);
+    }
     a_len = js_string_normalize1(ctx, &a_buf, a, UNICODE_NFC);
     JS_FreeValue(ctx, a);
     if (a_len < 0) {
@@ -46430,8 +50603,8 @@ static JSValue js_string_iterator_next(JSContext *ctx, JSValueConst this_val,
                                        BOOL *pdone, int magic)
 {
     JSArrayIteratorData *it;
-    uint32_t idx, c, start;
-    JSString *p;
+    uint32_t idx, c;
+    uint16_t buf[2];
 
     it = JS_GetOpaque2(ctx, this_val, JS_CLASS_STRING_ITERATOR);
     if (!it) {
@@ -46440,9 +50613,8 @@ static JSValue js_string_iterator_next(JSContext *ctx, JSValueConst this_val,
     }
     if (JS_IsUndefined(it->obj))
         goto done;
-    p = JS_VALUE_GET_STRING(it->obj);
     idx = it->idx;
-    if (idx >= p->len) {
+    if (idx >= string_rope_get_len(it->obj)) {
         JS_FreeValue(ctx, it->obj);
         it->obj = JS_UNDEFINED;
     done:
@@ -46450,14 +50622,15 @@ static JSValue js_string_iterator_next(JSContext *ctx, JSValueConst this_val,
         return JS_UNDEFINED;
     }
 
-    start = idx;
-    c = string_getc(p, (int *)&idx);
+    c = string_rope_getc(ctx->rt, it->obj, &idx);
     it->idx = idx;
     *pdone = FALSE;
     if (c <= 0xffff) {
         return js_new_string_char(ctx, c);
     } else {
-        return js_new_string16_len(ctx, p->u.str16 + start, 2);
+        buf[0] = get_hi_surrogate(c);
+        buf[1] = get_lo_surrogate(c);
+        return js_new_string16_len(ctx, buf, 2);
     }
 }
 
@@ -47843,7 +52016,7 @@ static JSValue js_regexp_exec(JSContext *ctx, JSValueConst this_val,
     }
     capture_count = lre_get_capture_count(re_bytecode);
     shift = str->is_wide_char;
-    str_buf = str->u.str8;
+    str_buf = (uint8_t *)str8_ptr(str);
     if (last_index > str->len) {
         rc = 2;
     } else {
@@ -48068,7 +52241,7 @@ static JSValue js_regexp_replace(JSContext *ctx, JSValueConst this_val, JSValueC
     capture_count = lre_get_capture_count(re_bytecode);
     fullUnicode = ((re_flags & (LRE_FLAG_UNICODE | LRE_FLAG_UNICODE_SETS)) != 0);
     shift = str->is_wide_char;
-    str_buf = str->u.str8;
+    str_buf = (uint8_t *)str8_ptr(str);
     next_src_pos = 0;
     for (;;) {
         if (last_index > str->len) {
@@ -51410,47 +55583,160 @@ static BOOL js_weakref_is_live(JSValueConst val)
     return (js_rc(p)->ref_count != 0);
 }
 
+static inline JSWeakTarget *js_weak_target_get(JSRuntime *rt, uint32_t idx)
+{
+    return &rt->weak_target_chunks[idx >> JS_WEAK_TARGET_CHUNK_BITS]
+        [idx & (JS_WEAK_TARGET_CHUNK_SIZE - 1)];
+}
+
+static no_inline int js_weak_target_add_chunk(JSRuntime *rt)
+{
+    JSWeakTarget *chunk, *wt, **new_chunks;
+    uint32_t n, new_size;
+    int i, first;
+
+    n = rt->weak_target_chunk_count;
+    /* the index must fit in the hash field of the symbols and be
+       different from JS_ATOM_HASH_PRIVATE */
+    if (n >= (JS_ATOM_HASH_PRIVATE >> JS_WEAK_TARGET_CHUNK_BITS))
+        return -1;
+    if (n >= rt->weak_target_chunk_size) {
+        new_size = max_int(16, rt->weak_target_chunk_size * 3 / 2);
+        new_chunks = js_realloc_rt(rt, rt->weak_target_chunks,
+                                   sizeof(new_chunks[0]) * new_size);
+        if (!new_chunks)
+            return -1;
+        rt->weak_target_chunks = new_chunks;
+        rt->weak_target_chunk_size = new_size;
+    }
+    chunk = js_malloc_rt(rt, sizeof(chunk[0]) * JS_WEAK_TARGET_CHUNK_SIZE);
+    if (!chunk)
+        return -1;
+    rt->weak_target_chunks[n] = chunk;
+    rt->weak_target_chunk_count = n + 1;
+    /* the index 0 is not used */
+    first = (n == 0);
+    for(i = JS_WEAK_TARGET_CHUNK_SIZE - 1; i >= first; i--) {
+        wt = &chunk[i];
+        wt->index = (n << JS_WEAK_TARGET_CHUNK_BITS) | i;
+        wt->u.free_next = rt->weak_target_free_list;
+        rt->weak_target_free_list = wt;
+    }
+    return 0;
+}
+
+/* return NULL if memory error */
+static JSWeakTarget *js_weak_target_alloc(JSRuntime *rt)
+{
+    JSWeakTarget *wt;
+
+    if (unlikely(!rt->weak_target_free_list)) {
+        if (js_weak_target_add_chunk(rt))
+            return NULL;
+    }
+    wt = rt->weak_target_free_list;
+    rt->weak_target_free_list = wt->u.free_next;
+    init_list_head(&wt->refs);
+    wt->is_dead = FALSE;
+    rt->weak_target_count++;
+    return wt;
+}
+
+static void js_weak_target_free(JSRuntime *rt, JSWeakTarget *wt)
+{
+    wt->u.free_next = rt->weak_target_free_list;
+    rt->weak_target_free_list = wt;
+    rt->weak_target_count--;
+}
+
+/* called when the last weak reference to a target is removed */
+static void js_weak_target_remove(JSRuntime *rt, uint32_t idx)
+{
+    JSWeakTarget *wt = js_weak_target_get(rt, idx);
+
+    assert(list_empty(&wt->refs));
+    /* if dead, it is freed in gc_remove_weak_objects() */
+    if (!wt->is_dead)
+        js_weak_target_free(rt, wt);
+}
+
+/* called when the object or symbol having the weak references of
+   'idx' is freed */
+static void js_weak_target_set_dead(JSRuntime *rt, uint32_t idx)
+{
+    JSWeakTarget *wt = js_weak_target_get(rt, idx);
+    if (!wt->is_dead) {
+        wt->is_dead = TRUE;
+        list_add_tail(&wt->u.dead_link, &rt->weak_dead_list);
+    }
+}
+
 /* 'val' can be JS_UNDEFINED */
-static void js_weakref_free(JSRuntime *rt, JSValue val)
+static void js_weakref_free(JSRuntime *rt, JSValue val, JSWeakRefLink *wl)
 {
     if (JS_VALUE_GET_TAG(val) == JS_TAG_OBJECT) {
         JSObject *p = JS_VALUE_GET_OBJ(val);
-        assert(p->weakref_count >= 1);
-        p->weakref_count--;
-        /* 'mark' is tested to avoid freeing the object structure when
-           it is about to be freed in a cycle or in
-           free_zero_refcount() */
-        if (p->weakref_count == 0 && js_rc(p)->ref_count == 0 &&
-            js_rc(p)->mark == 0) {
-            js_free_rt(rt, p);
+        assert(p->weak_target != 0);
+        list_del(&wl->link);
+        if (list_empty(&js_weak_target_get(rt, p->weak_target)->refs)) {
+            js_weak_target_remove(rt, p->weak_target);
+            p->weak_target = 0;
+            /* 'mark' is tested to avoid freeing the object structure
+               when it is about to be freed in a cycle or in
+               free_zero_refcount() */
+            if (js_rc(p)->ref_count == 0 && js_rc(p)->mark == 0)
+                js_free_rt(rt, p);
         }
     } else if (JS_VALUE_GET_TAG(val) == JS_TAG_SYMBOL) {
         JSString *p = JS_VALUE_GET_STRING(val);
-        assert(p->hash >= 1);
-        p->hash--;
-        if (p->hash == 0 && js_rc(p)->ref_count == 0) {
-            /* can remove the dummy structure */
-            js_free_rt(rt, p);
+        assert(p->hash != 0);
+        list_del(&wl->link);
+        if (list_empty(&js_weak_target_get(rt, p->hash)->refs)) {
+            js_weak_target_remove(rt, p->hash);
+            p->hash = 0;
+            if (js_rc(p)->ref_count == 0) {
+                /* can remove the dummy structure */
+                js_free_rt(rt, p);
+            }
         }
     }
 }
 
 /* val must be an object, a symbol or undefined (see
-   js_weakref_is_target). */
-static JSValue js_weakref_new(JSContext *ctx, JSValueConst val)
+   js_weakref_is_target). 'wl' is added to the weak references of
+   'val' and 'wh' is its container. Return -1 if memory error. */
+static int js_weakref_new(JSContext *ctx, JSValueConst val,
+                          JSWeakRefLink *wl, JSWeakRefHeader *wh)
 {
+    JSRuntime *rt = ctx->rt;
+    JSWeakTarget *wt;
+    uint32_t idx;
+
     if (JS_VALUE_GET_TAG(val) == JS_TAG_OBJECT) {
-        JSObject *p = JS_VALUE_GET_OBJ(val);
-        p->weakref_count++;
+        idx = JS_VALUE_GET_OBJ(val)->weak_target;
     } else if (JS_VALUE_GET_TAG(val) == JS_TAG_SYMBOL) {
-        JSString *p = JS_VALUE_GET_STRING(val);
-        /* XXX: could return an exception if too many references */
-        assert(p->hash < JS_ATOM_HASH_MASK - 2);
-        p->hash++;
+        idx = JS_VALUE_GET_STRING(val)->hash;
+    } else if (JS_IsUndefined(val)) {
+        return 0;
+    } else {
+        abort();
+    }
+    if (idx != 0) {
+        wt = js_weak_target_get(rt, idx);
     } else {
-        assert(JS_IsUndefined(val));
+        wt = js_weak_target_alloc(rt);
+        if (!wt) {
+            JS_ThrowOutOfMemory(ctx);
+            return -1;
+        }
+        if (JS_VALUE_GET_TAG(val) == JS_TAG_OBJECT)
+            JS_VALUE_GET_OBJ(val)->weak_target = wt->index;
+        else
+            JS_VALUE_GET_STRING(val)->hash = wt->index;
     }
-    return (JSValue)val;
+    list_add_tail(&wl->link, &wt->refs);
+    wl->wh = wh;
+    return 0;
 }
 
 #define MAGIC_SET (1 << 0)
@@ -51476,7 +55762,6 @@ static JSValue js_map_constructor(JSContext *ctx, JSValueConst new_target,
     s->is_weak = is_weak;
     if (is_weak) {
         s->weakref_header.weakref_type = JS_WEAKREF_TYPE_MAP;
-        list_add_tail(&s->weakref_header.link, &ctx->rt->weakref_list);
     }
     JS_SetOpaque(obj, s);
     s->hash_bits = 1;
@@ -51609,7 +55894,7 @@ static uint32_t map_hash_pointer(uintptr_t a, int hash_bits)
 
 /* XXX: better hash ? */
 /* precondition: 1 <= hash_bits <= 32 */
-static uint32_t map_hash_key(JSValueConst key, int hash_bits)
+static uint32_t map_hash_key(JSRuntime *rt, JSValueConst key, int hash_bits)
 {
     uint32_t tag = JS_VALUE_GET_NORM_TAG(key);
     uint32_t h;
@@ -51622,10 +55907,10 @@ static uint32_t map_hash_key(JSValueConst key, int hash_bits)
         h = map_hash32(JS_VALUE_GET_INT(key) ^ JS_TAG_BOOL, hash_bits);
         break;
     case JS_TAG_STRING:
-        h = map_hash32(hash_string(JS_VALUE_GET_STRING(key), 0) ^ JS_TAG_STRING, hash_bits);
+        h = map_hash32(js_string_get_hash(rt, JS_VALUE_GET_STRING(key)) ^ JS_TAG_STRING, hash_bits);
         break;
     case JS_TAG_STRING_ROPE:
-        h = map_hash32(hash_string_rope(key, 0) ^ JS_TAG_STRING, hash_bits);
+        h = map_hash32(js_string_rope_get_hash(rt, key) ^ JS_TAG_STRING, hash_bits);
         break;
     case JS_TAG_OBJECT:
     case JS_TAG_SYMBOL:
@@ -51671,7 +55956,7 @@ static JSMapRecord *map_find_record(JSContext *ctx, JSMapState *s,
 {
     JSMapRecord *mr;
     uint32_t h;
-    h = map_hash_key(key, s->hash_bits);
+    h = map_hash_key(ctx->rt, key, s->hash_bits);
     for(mr = s->hash_table[h]; mr != NULL; mr = mr->hash_next) {
         if (mr->empty || (s->is_weak && !js_weakref_is_live(mr->key))) {
             /* cannot match */
@@ -51704,7 +55989,7 @@ static void map_hash_resize(JSContext *ctx, JSMapState *s)
         mr = list_entry(el, JSMapRecord, link);
         if (mr->empty || (s->is_weak && !js_weakref_is_live(mr->key))) {
         } else {
-            h = map_hash_key(mr->key, new_hash_bits);
+            h = map_hash_key(ctx->rt, mr->key, new_hash_bits);
             mr->hash_next = new_hash_table[h];
             new_hash_table[h] = mr;
         }
@@ -51721,17 +56006,24 @@ static JSMapRecord *map_add_record(JSContext *ctx, JSMapState *s,
     uint32_t h;
     JSMapRecord *mr;
 
-    mr = js_malloc(ctx, sizeof(*mr));
-    if (!mr)
-        return NULL;
-    mr->ref_count = 1;
-    mr->empty = FALSE;
     if (s->is_weak) {
-        mr->key = js_weakref_new(ctx, key);
+        mr = js_malloc(ctx, sizeof(*mr));
+        if (!mr)
+            return NULL;
+        if (js_weakref_new(ctx, key, &mr->key_link, &s->weakref_header)) {
+            js_free(ctx, mr);
+            return NULL;
+        }
+        mr->key = (JSValue)key;
     } else {
+        mr = js_malloc(ctx, offsetof(JSMapRecord, key_link));
+        if (!mr)
+            return NULL;
         mr->key = JS_DupValue(ctx, key);
     }
-    h = map_hash_key(key, s->hash_bits);
+    mr->ref_count = 1;
+    mr->empty = FALSE;
+    h = map_hash_key(ctx->rt, key, s->hash_bits);
     mr->hash_next = s->hash_table[h];
     s->hash_table[h] = mr;
     list_add_tail(&mr->link, &s->records);
@@ -51760,7 +56052,7 @@ static void map_delete_record_internal(JSRuntime *rt, JSMapState *s, JSMapRecord
         return;
     
     if (s->is_weak) {
-        js_weakref_free(rt, mr->key);
+        js_weakref_free(rt, mr->key, &mr->key_link);
     } else {
         JS_FreeValueRT(rt, mr->key);
     }
@@ -51787,36 +56079,31 @@ static void map_decref_record(JSRuntime *rt, JSMapRecord *mr)
     }
 }
 
-static void map_delete_weakrefs(JSRuntime *rt, JSWeakRefHeader *wh)
+/* 'wl' is the key of a record whose target is dead */
+static void map_delete_weakref(JSRuntime *rt, JSWeakRefLink *wl)
 {
-    JSMapState *s = container_of(wh, JSMapState, weakref_header);
-    struct list_head *el, *el1;
+    JSMapState *s = container_of(wl->wh, JSMapState, weakref_header);
+    JSMapRecord *mr = container_of(wl, JSMapRecord, key_link);
     JSMapRecord *mr1, **pmr;
     uint32_t h;
 
-    list_for_each_safe(el, el1, &s->records) {
-        JSMapRecord *mr = list_entry(el, JSMapRecord, link);
-        if (!js_weakref_is_live(mr->key)) {
-
-            /* even if key is not live it can be hashed as a pointer */
-            h = map_hash_key(mr->key, s->hash_bits);
-            pmr = &s->hash_table[h];
-            for(;;) {
-                mr1 = *pmr;
-                /* the entry may already be removed from the hash
-                   table if the map was resized */
-                if (mr1 == NULL)
-                    goto done; 
-                if (mr1 == mr)
-                    break;
-                pmr = &mr1->hash_next;
-            }
-            /* remove from the hash table */
-            *pmr = mr1->hash_next;
-        done:
-            map_delete_record_internal(rt, s, mr);
-        }
+    /* even if key is not live it can be hashed as a pointer */
+    h = map_hash_key(rt, mr->key, s->hash_bits);
+    pmr = &s->hash_table[h];
+    for(;;) {
+        mr1 = *pmr;
+        /* the entry may already be removed from the hash
+           table if the map was resized */
+        if (mr1 == NULL)
+            goto done; 
+        if (mr1 == mr)
+            break;
+        pmr = &mr1->hash_next;
     }
+    /* remove from the hash table */
+    *pmr = mr1->hash_next;
+ done:
+    map_delete_record_internal(rt, s, mr);
 }
 
 static JSValue js_map_set(JSContext *ctx, JSValueConst this_val,
@@ -51872,7 +56159,7 @@ static JSValue map_delete_record(JSContext *ctx, JSMapState *s, JSValueConst key
 
     key = map_normalize_key_const(ctx, key);
     
-    h = map_hash_key(key, s->hash_bits);
+    h = map_hash_key(ctx->rt, key, s->hash_bits);
     pmr = &s->hash_table[h];
     for(;;) {
         mr = *pmr;
@@ -52163,7 +56450,7 @@ static void js_map_finalizer(JSRuntime *rt, JSValue val)
             mr = list_entry(el, JSMapRecord, link);
             if (!mr->empty) {
                 if (s->is_weak)
-                    js_weakref_free(rt, mr->key);
+                    js_weakref_free(rt, mr->key, &mr->key_link);
                 else
                     JS_FreeValueRT(rt, mr->key);
                 JS_FreeValueRT(rt, mr->value);
@@ -52171,9 +56458,6 @@ static void js_map_finalizer(JSRuntime *rt, JSValue val)
             js_free_rt(rt, mr);
         }
         js_free_rt(rt, s->hash_table);
-        if (s->is_weak) {
-            list_del(&s->weakref_header.link);
-        }
         js_free_rt(rt, s);
     }
 }
@@ -58053,7 +62337,7 @@ static JSValue js_typed_array_join(JSContext *ctx, JSValueConst this_val,
             goto exception;
         s = JS_VALUE_GET_STRING(sep);
         if (s->len == 1 && !s->is_wide_char)
-            c = s->u.str8[0];
+            c = str8_ptr(s)[0];
         else
             c = -1;
         // ToString(sep) can detach or resize the arraybuffer as a side effect
@@ -60808,6 +65092,7 @@ int JS_AddIntrinsicTypedArrays(JSContext *ctx)
 typedef struct JSWeakRefData {
     JSWeakRefHeader weakref_header;
     JSValue target;
+    JSWeakRefLink target_link;
 } JSWeakRefData;
 
 static void js_weakref_finalizer(JSRuntime *rt, JSValue val)
@@ -60815,19 +65100,16 @@ static void js_weakref_finalizer(JSRuntime *rt, JSValue val)
     JSWeakRefData *wrd = JS_GetOpaque(val, JS_CLASS_WEAK_REF);
     if (!wrd)
         return;
-    js_weakref_free(rt, wrd->target);
-    list_del(&wrd->weakref_header.link);
+    js_weakref_free(rt, wrd->target, &wrd->target_link);
     js_free_rt(rt, wrd);
 }
 
-static void weakref_delete_weakref(JSRuntime *rt, JSWeakRefHeader *wh)
+static void weakref_delete_weakref(JSRuntime *rt, JSWeakRefLink *wl)
 {
-    JSWeakRefData *wrd = container_of(wh, JSWeakRefData, weakref_header);
+    JSWeakRefData *wrd = container_of(wl, JSWeakRefData, target_link);
 
-    if (!js_weakref_is_live(wrd->target)) {
-        js_weakref_free(rt, wrd->target);
-        wrd->target = JS_UNDEFINED;
-    }
+    js_weakref_free(rt, wrd->target, &wrd->target_link);
+    wrd->target = JS_UNDEFINED;
 }
 
 static JSValue js_weakref_constructor(JSContext *ctx, JSValueConst new_target,
@@ -60849,9 +65131,13 @@ static JSValue js_weakref_constructor(JSContext *ctx, JSValueConst new_target,
         JS_FreeValue(ctx, obj);
         return JS_EXCEPTION;
     }
-    wrd->target = js_weakref_new(ctx, arg);
     wrd->weakref_header.weakref_type = JS_WEAKREF_TYPE_WEAKREF;
-    list_add_tail(&wrd->weakref_header.link, &ctx->rt->weakref_list);
+    if (js_weakref_new(ctx, arg, &wrd->target_link, &wrd->weakref_header)) {
+        js_free(ctx, wrd);
+        JS_FreeValue(ctx, obj);
+        return JS_EXCEPTION;
+    }
+    wrd->target = (JSValue)arg;
     JS_SetOpaque(obj, wrd);
     return obj;
 }
@@ -60881,10 +65167,13 @@ typedef struct JSFinRecEntry {
     JSValue target;
     JSValue held_val;
     JSValue token;
+    JSWeakRefLink target_link;
+    JSWeakRefLink token_link;
 } JSFinRecEntry;
 
 typedef struct JSFinalizationRegistryData {
-    JSWeakRefHeader weakref_header;
+    JSWeakRefHeader weakref_header; /* container of the targets */
+    JSWeakRefHeader token_weakref_header; /* container of the tokens */
     struct list_head entries; /* list of JSFinRecEntry.link */
     JSContext *realm;
     JSValue cb;
@@ -60897,14 +65186,13 @@ static void js_finrec_finalizer(JSRuntime *rt, JSValue val)
         struct list_head *el, *el1;
         list_for_each_safe(el, el1, &frd->entries) {
             JSFinRecEntry *fre = list_entry(el, JSFinRecEntry, link);
-            js_weakref_free(rt, fre->target);
-            js_weakref_free(rt, fre->token);
+            js_weakref_free(rt, fre->target, &fre->target_link);
+            js_weakref_free(rt, fre->token, &fre->token_link);
             JS_FreeValueRT(rt, fre->held_val);
             js_free_rt(rt, fre);
         }
         JS_FreeValueRT(rt, frd->cb);
         JS_FreeContext(frd->realm);
-        list_del(&frd->weakref_header.link);
         js_free_rt(rt, frd);
     }
 }
@@ -60929,32 +65217,29 @@ static JSValue js_finrec_job(JSContext *ctx, int argc, JSValueConst *argv)
     return JS_Call(ctx, argv[0], JS_UNDEFINED, 1, &argv[1]);
 }
 
-static void finrec_delete_weakref(JSRuntime *rt, JSWeakRefHeader *wh)
+static void finrec_delete_weakref(JSRuntime *rt, JSWeakRefLink *wl)
 {
-    JSFinalizationRegistryData *frd = container_of(wh, JSFinalizationRegistryData, weakref_header);
-    struct list_head *el, *el1;
-
-    list_for_each_safe(el, el1, &frd->entries) {
-        JSFinRecEntry *fre = list_entry(el, JSFinRecEntry, link);
-
-        if (!js_weakref_is_live(fre->token)) {
-            js_weakref_free(rt, fre->token);
-            fre->token = JS_UNDEFINED;
-        }
+    JSFinalizationRegistryData *frd;
+    JSFinRecEntry *fre;
 
-        if (!js_weakref_is_live(fre->target)) {
-            JSValueConst args[2];
-            args[0] = frd->cb;
-            args[1] = fre->held_val;
-            /* no exception is raised to avoid recursing into the GC */
-            JS_EnqueueJob2(frd->realm, js_finrec_job, 2, args, TRUE);
+    if (wl->wh->weakref_type == JS_WEAKREF_TYPE_FINREC_TOKEN) {
+        fre = container_of(wl, JSFinRecEntry, token_link);
+        js_weakref_free(rt, fre->token, &fre->token_link);
+        fre->token = JS_UNDEFINED;
+    } else {
+        JSValueConst args[2];
+        frd = container_of(wl->wh, JSFinalizationRegistryData, weakref_header);
+        fre = container_of(wl, JSFinRecEntry, target_link);
+        args[0] = frd->cb;
+        args[1] = fre->held_val;
+        /* no exception is raised to avoid recursing into the GC */
+        JS_EnqueueJob2(frd->realm, js_finrec_job, 2, args, TRUE);
                 
-            js_weakref_free(rt, fre->target);
-            js_weakref_free(rt, fre->token);
-            JS_FreeValueRT(rt, fre->held_val);
-            list_del(&fre->link);
-            js_free_rt(rt, fre);
-        }
+        js_weakref_free(rt, fre->target, &fre->target_link);
+        js_weakref_free(rt, fre->token, &fre->token_link);
+        JS_FreeValueRT(rt, fre->held_val);
+        list_del(&fre->link);
+        js_free_rt(rt, fre);
     }
 }
 
@@ -60980,7 +65265,7 @@ static JSValue js_finrec_constructor(JSContext *ctx, JSValueConst new_target,
         return JS_EXCEPTION;
     }
     frd->weakref_header.weakref_type = JS_WEAKREF_TYPE_FINREC;
-    list_add_tail(&frd->weakref_header.link, &ctx->rt->weakref_list);
+    frd->token_weakref_header.weakref_type = JS_WEAKREF_TYPE_FINREC_TOKEN;
     init_list_head(&frd->entries);
     frd->realm = JS_DupContext(ctx);
     frd->cb = JS_DupValue(ctx, cb);
@@ -61011,9 +65296,17 @@ static JSValue js_finrec_register(JSContext *ctx, JSValueConst this_val,
     fre = js_malloc(ctx, sizeof(*fre));
     if (!fre)
         return JS_EXCEPTION;
-    fre->target = js_weakref_new(ctx, target);
+    if (js_weakref_new(ctx, target, &fre->target_link, &frd->weakref_header))
+        goto fail;
+    if (js_weakref_new(ctx, token, &fre->token_link, &frd->token_weakref_header)) {
+        js_weakref_free(ctx->rt, (JSValue)target, &fre->target_link);
+    fail:
+        js_free(ctx, fre);
+        return JS_EXCEPTION;
+    }
+    fre->target = (JSValue)target;
+    fre->token = (JSValue)token;
     fre->held_val = JS_DupValue(ctx, held_val);
-    fre->token = js_weakref_new(ctx, token);
     list_add_tail(&fre->link, &frd->entries);
     return JS_UNDEFINED;
 }
@@ -61035,8 +65328,8 @@ static JSValue js_finrec_unregister(JSContext *ctx, JSValueConst this_val, int a
     list_for_each_safe(el, el1, &frd->entries) {
         JSFinRecEntry *fre = list_entry(el, JSFinRecEntry, link);
         if (js_weakref_is_live(fre->token) && js_same_value(ctx, fre->token, token)) {
-            js_weakref_free(ctx->rt, fre->target);
-            js_weakref_free(ctx->rt, fre->token);
+            js_weakref_free(ctx->rt, fre->target, &fre->target_link);
+            js_weakref_free(ctx->rt, fre->token, &fre->token_link);
             JS_FreeValue(ctx, fre->held_val);
             list_del(&fre->link);
             js_free(ctx, fre);
@@ -61095,3 +65388,740 @@ int JS_AddIntrinsicWeakRef(JSContext *ctx)
     JS_FreeValue(ctx, obj);
     return 0;
 }
+
+/* TextEncoder and TextDecoder (only UTF-8 is supported) */
+
+typedef struct JSTextDecoder {
+    BOOL fatal;
+    BOOL ignore_bom;
+    BOOL bom_seen;
+    BOOL do_not_flush; /* TRUE if the last decode() was in stream mode */
+    int pending_len;
+    uint8_t pending[4]; /* truncated UTF-8 sequence of the last chunk */
+} JSTextDecoder;
+
+/* Return the length of the UTF-8 encoding of 'p' in which the lone
+   surrogates are replaced by U+FFFD. */
+static size_t utf8_encode_len(const JSString *p)
+{
+    size_t len, i;
+    uint32_t c;
+
+    len = p->len;
+    if (!p->is_wide_char) {
+        const uint8_t *s = str8_ptr(p);
+        i = 0;
+        for(;;) {
+            i += count_ascii(s + i, p->len - i);
+            if (i >= p->len)
+                break;
+            len++;
+            i++;
+        }
+    } else {
+        const uint16_t *s = str16_ptr(p);
+        for(i = 0; i < p->len; i++) {
+            c = s[i];
+            if (c >= 0x80) {
+                if (c < 0x800) {
+                    len += 1;
+                } else if (is_hi_surrogate(c) && i + 1 < p->len &&
+                           is_lo_surrogate(s[i + 1])) {
+                    len += 2;
+                    i++;
+                } else {
+                    len += 2;
+                }
+            }
+        }
+    }
+    return len;
+}
+
+/* Encode 'p' from the position '*ppos' to UTF-8 into 'buf' of
+   'buf_size' bytes. Only whole characters are written and the lone
+   surrogates are replaced by U+FFFD. '*ppos' is updated and the
+   number of written bytes is returned. */
+static size_t utf8_encode_string(uint8_t *buf, size_t buf_size,
+                                 const JSString *p, uint32_t *ppos)
+{
+    uint8_t *q, *q_end;
+    uint32_t pos, len, c;
+    size_t n;
+
+    q = buf;
+    q_end = buf + buf_size;
+    pos = *ppos;
+    len = p->len;
+    if (!p->is_wide_char) {
+        const uint8_t *s = str8_ptr(p);
+        while (pos < len) {
+            c = s[pos];
+            if (c < 0x80) {
+                n = len - pos;
+                if (n > q_end - q)
+                    n = q_end - q;
+                n = count_ascii(s + pos, n);
+                if (n == 0)
+                    break;
+                memcpy(q, s + pos, n);
+                q += n;
+                pos += n;
+            } else {
+                if (q_end - q < 2)
+                    break;
+                q[0] = (c >> 6) | 0xc0;
+                q[1] = (c & 0x3f) | 0x80;
+                q += 2;
+                pos++;
+            }
+        }
+    } else {
+        const uint16_t *s = str16_ptr(p);
+        while (pos < len) {
+            c = s[pos];
+            if (c < 0x80) {
+                /* narrow the ASCII characters 4 at a time */
+                if (len - pos >= 4 && q_end - q >= 4 &&
+                    (get_u64((const uint8_t *)(s + pos)) &
+                     0xff80ff80ff80ff80) == 0) {
+                    q[0] = c;
+                    q[1] = s[pos + 1];
+                    q[2] = s[pos + 2];
+                    q[3] = s[pos + 3];
+                    q += 4;
+                    pos += 4;
+                } else {
+                    if (q >= q_end)
+                        break;
+                    *q++ = c;
+                    pos++;
+                }
+            } else {
+                n = 1;
+                if (is_surrogate(c)) {
+                    if (is_hi_surrogate(c) && pos + 1 < len &&
+                        is_lo_surrogate(s[pos + 1])) {
+                        c = from_surrogate(c, s[pos + 1]);
+                        n = 2;
+                    } else {
+                        c = 0xfffd;
+                    }
+                }
+                if (q_end - q < (c < 0x800 ? 2 : (c < 0x10000 ? 3 : 4)))
+                    break;
+                q += unicode_to_utf8(q, c);
+                pos += n;
+            }
+        }
+    }
+    *ppos = pos;
+    return q - buf;
+}
+
+/* Decode the UTF-8 sequence at 'p' whose first byte is not ASCII
+   following the WHATWG Encoding Standard. Return the code point, -1
+   if the sequence is invalid or -2 if it is truncated by the end of
+   the buffer. '*plen' is set to the number of bytes to consume. In
+   case of error, it is the length of the maximal subpart which is
+   replaced by a single U+FFFD. */
+static int utf8_decode_whatwg(const uint8_t *p, size_t len, int *plen)
+{
+    uint32_t c, lower, upper;
+    int i, n;
+
+    c = p[0];
+    lower = 0x80;
+    upper = 0xbf;
+    if (c >= 0xc2 && c <= 0xdf) {
+        n = 1;
+        c &= 0x1f;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        if (c == 0xe0)
+            lower = 0xa0; /* overlong */
+        else if (c == 0xed)
+            upper = 0x9f; /* surrogate */
+        n = 2;
+        c &= 0x0f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        if (c == 0xf0)
+            lower = 0x90; /* overlong */
+        else if (c == 0xf4)
+            upper = 0x8f; /* > 0x10ffff */
+        n = 3;
+        c &= 0x07;
+    } else {
+        *plen = 1;
+        return -1;
+    }
+    for(i = 1; i <= n; i++) {
+        if (i >= len) {
+            *plen = i;
+            return -2;
+        }
+        if (p[i] < lower || p[i] > upper) {
+            *plen = i;
+            return -1;
+        }
+        lower = 0x80;
+        upper = 0xbf;
+        c = (c << 6) | (p[i] & 0x3f);
+    }
+    *plen = n + 1;
+    return c;
+}
+
+/* First pass of the decoder: return the UTF-16 length of the decoded
+   bytes and their maximum code point in '*pc_max'. If 'flush' is
+   FALSE, a truncated sequence at the end is not decoded and '*pend'
+   is set to its position. Return -1 if 'fatal' is TRUE and the data
+   is invalid. */
+static int64_t text_decoder_scan(const uint8_t *buf, size_t len,
+                                 BOOL flush, BOOL fatal,
+                                 size_t *pend, uint32_t *pc_max)
+{
+    size_t i, n1;
+    int64_t out_len;
+    uint32_t c_max;
+    int c, n;
+
+    i = 0;
+    out_len = 0;
+    c_max = 0;
+    while (i < len) {
+        if (buf[i] < 0x80) {
+            n1 = count_ascii(buf + i, len - i);
+            i += n1;
+            out_len += n1;
+            continue;
+        }
+        c = utf8_decode_whatwg(buf + i, len - i, &n);
+        if (c < 0) {
+            if (c == -2 && !flush)
+                break;
+            if (fatal)
+                return -1;
+            c = 0xfffd;
+        }
+        c_max = max_uint32(c_max, c);
+        out_len += 1 + (c >= 0x10000);
+        i += n;
+    }
+    *pend = i;
+    *pc_max = c_max;
+    return out_len;
+}
+
+static uint32_t text_decoder_put_char(JSString *str, uint32_t pos, uint32_t c)
+{
+    if (!str->is_wide_char) {
+        str->u.str8[pos++] = c;
+    } else {
+        if (c >= 0x10000) {
+            str->u.str16[pos++] = get_hi_surrogate(c);
+            c = get_lo_surrogate(c);
+        }
+        str->u.str16[pos++] = c;
+    }
+    return pos;
+}
+
+/* Second pass of the decoder: write the characters to 'str' from
+   'pos'. The invalid and truncated sequences give U+FFFD. */
+static uint32_t text_decoder_write(JSString *str, uint32_t pos,
+                                   const uint8_t *buf, size_t len)
+{
+    size_t i, n1;
+    int c, n;
+
+    i = 0;
+    while (i < len) {
+        if (buf[i] < 0x80) {
+            n1 = count_ascii(buf + i, len - i);
+            if (!str->is_wide_char) {
+                memcpy(str->u.str8 + pos, buf + i, n1);
+                pos += n1;
+                i += n1;
+            } else {
+                while (n1-- != 0)
+                    str->u.str16[pos++] = buf[i++];
+            }
+            continue;
+        }
+        c = utf8_decode_whatwg(buf + i, len - i, &n);
+        if (c < 0)
+            c = 0xfffd;
+        pos = text_decoder_put_char(str, pos, c);
+        i += n;
+    }
+    return pos;
+}
+
+/* Get the bytes of an ArrayBuffer, a SharedArrayBuffer, a typed array
+   or a DataView. A detached or out of bounds buffer has no bytes. The
+   pointer is only valid until the next call to JS code. */
+static int js_get_buffer_source(JSContext *ctx, JSValueConst obj,
+                                const uint8_t **pbuf, size_t *plen)
+{
+    JSObject *p;
+    JSArrayBuffer *abuf;
+    JSTypedArray *ta;
+
+    *pbuf = NULL;
+    *plen = 0;
+    if (JS_VALUE_GET_TAG(obj) != JS_TAG_OBJECT)
+        goto fail;
+    p = JS_VALUE_GET_OBJ(obj);
+    switch(p->class_id) {
+    case JS_CLASS_ARRAY_BUFFER:
+    case JS_CLASS_SHARED_ARRAY_BUFFER:
+        abuf = p->u.array_buffer;
+        if (!abuf->detached) {
+            *pbuf = abuf->data;
+            *plen = abuf->byte_length;
+        }
+        break;
+    case JS_CLASS_DATAVIEW:
+        if (!dataview_is_oob(p)) {
+            ta = p->u.typed_array;
+            abuf = ta->buffer->u.array_buffer;
+            *pbuf = abuf->data + ta->offset;
+            if (ta->track_rab)
+                *plen = abuf->byte_length - ta->offset;
+            else
+                *plen = ta->length;
+        }
+        break;
+    default:
+        if (p->class_id >= JS_CLASS_UINT8C_ARRAY &&
+            p->class_id <= JS_CLASS_FLOAT64_ARRAY) {
+            if (!typed_array_is_oob(p)) {
+                *pbuf = p->u.array.u.uint8_ptr;
+                *plen = (size_t)p->u.array.count <<
+                    typed_array_size_log2(p->class_id);
+            }
+            break;
+        }
+    fail:
+        JS_ThrowTypeError(ctx, "not an ArrayBuffer or an ArrayBuffer view");
+        return -1;
+    }
+    return 0;
+}
+
+/* Create a Uint8Array owning 'buf' which must be allocated with
+   js_malloc(). 'buf' is freed in case of error. */
+static JSValue js_new_uint8_array_owned(JSContext *ctx, uint8_t *buf,
+                                        size_t len)
+{
+    JSValue buffer, obj;
+
+    buffer = js_array_buffer_constructor3(ctx, JS_UNDEFINED, len, NULL,
+                                          JS_CLASS_ARRAY_BUFFER, buf,
+                                          js_array_buffer_free, NULL,
+                                          FALSE);
+    if (JS_IsException(buffer)) {
+        js_free(ctx, buf);
+        return JS_EXCEPTION;
+    }
+    obj = js_create_from_ctor(ctx, JS_UNDEFINED, JS_CLASS_UINT8_ARRAY);
+    if (JS_IsException(obj)) {
+        JS_FreeValue(ctx, buffer);
+        return JS_EXCEPTION;
+    }
+    if (typed_array_init(ctx, obj, buffer, 0, len, /*track_rab*/FALSE)) {
+        JS_FreeValue(ctx, obj);
+        return JS_EXCEPTION;
+    }
+    return obj;
+}
+
+static int js_text_encoder_check(JSContext *ctx, JSValueConst this_val)
+{
+    if (JS_VALUE_GET_TAG(this_val) != JS_TAG_OBJECT ||
+        JS_VALUE_GET_OBJ(this_val)->class_id != JS_CLASS_TEXT_ENCODER) {
+        JS_ThrowTypeErrorInvalidClass(ctx, JS_CLASS_TEXT_ENCODER);
+        return -1;
+    }
+    return 0;
+}
+
+static JSValue js_text_encoder_constructor(JSContext *ctx,
+                                           JSValueConst new_target,
+                                           int argc, JSValueConst *argv)
+{
+    return js_create_from_ctor(ctx, new_target, JS_CLASS_TEXT_ENCODER);
+}
+
+static JSValue js_text_encoder_get_encoding(JSContext *ctx,
+                                            JSValueConst this_val)
+{
+    if (js_text_encoder_check(ctx, this_val))
+        return JS_EXCEPTION;
+    return JS_NewString(ctx, "utf-8");
+}
+
+/* the result is directly encoded in the buffer of the Uint8Array */
+static JSValue js_text_encoder_encode(JSContext *ctx, JSValueConst this_val,
+                                      int argc, JSValueConst *argv)
+{
+    JSValue str;
+    JSString *p;
+    uint8_t *buf;
+    size_t len;
+    uint32_t pos;
+
+    if (js_text_encoder_check(ctx, this_val))
+        return JS_EXCEPTION;
+    if (argc == 0 || JS_IsUndefined(argv[0]))
+        str = JS_AtomToString(ctx, JS_ATOM_empty_string);
+    else
+        str = JS_ToString(ctx, argv[0]);
+    if (JS_IsException(str))
+        return str;
+    p = JS_VALUE_GET_STRING(str);
+    len = utf8_encode_len(p);
+    if (len > INT32_MAX) {
+        JS_FreeValue(ctx, str);
+        return JS_ThrowRangeError(ctx, "invalid array buffer length");
+    }
+    buf = js_malloc(ctx, len ? len : 1);
+    if (!buf) {
+        JS_FreeValue(ctx, str);
+        return JS_EXCEPTION;
+    }
+    pos = 0;
+    utf8_encode_string(buf, len, p, &pos);
+    JS_FreeValue(ctx, str);
+    return js_new_uint8_array_owned(ctx, buf, len);
+}
+
+static JSValue js_text_encoder_encode_into(JSContext *ctx,
+                                           JSValueConst this_val,
+                                           int argc, JSValueConst *argv)
+{
+    JSValue str;
+    JSObject *p;
+    uint8_t *buf;
+    size_t len, written;
+    uint32_t pos;
+
+    if (js_text_encoder_check(ctx, this_val))
+        return JS_EXCEPTION;
+    str = JS_ToString(ctx, argv[0]);
+    if (JS_IsException(str))
+        return str;
+    p = check_uint8array(ctx, argv[1]);
+    if (!p) {
+        JS_FreeValue(ctx, str);
+        return JS_EXCEPTION;
+    }
+    if (typed_array_is_oob(p)) {
+        buf = NULL;
+        len = 0;
+    } else {
+        buf = p->u.array.u.uint8_ptr;
+        len = p->u.array.count;
+    }
+    pos = 0;
+    written = utf8_encode_string(buf, len, JS_VALUE_GET_STRING(str), &pos);
+    JS_FreeValue(ctx, str);
+    return js_make_read_written(ctx, pos, written);
+}
+
+static const JSCFunctionListEntry js_text_encoder_proto_funcs[] = {
+    JS_CGETSET_DEF("encoding", js_text_encoder_get_encoding, NULL ),
+    JS_CFUNC_DEF("encode", 0, js_text_encoder_encode ),
+    JS_CFUNC_DEF("encodeInto", 2, js_text_encoder_encode_into ),
+    JS_PROP_STRING_DEF("[Symbol.toStringTag]", "TextEncoder", JS_PROP_CONFIGURABLE ),
+};
+
+static void js_text_decoder_finalizer(JSRuntime *rt, JSValue val)
+{
+    JSTextDecoder *td = JS_GetOpaque(val, JS_CLASS_TEXT_DECODER);
+    js_free_rt(rt, td);
+}
+
+/* return TRUE if 'label' designates the UTF-8 encoding */
+static BOOL is_utf8_label(const char *label, size_t len)
+{
+    static const char utf8_labels[] =
+        "unicode-1-1-utf-8\0"
+        "unicode11utf8\0"
+        "unicode20utf8\0"
+        "utf-8\0"
+        "utf8\0"
+        "x-unicode20utf8\0";
+    char buf[32];
+    const char *p;
+    size_t i;
+
+    /* remove the leading and trailing ASCII whitespace */
+    while (len > 0 && strchr(" \t\n\f\r", label[0]) && label[0] != '\0') {
+        label++;
+        len--;
+    }
+    while (len > 0 && strchr(" \t\n\f\r", label[len - 1]) &&
+           label[len - 1] != '\0') {
+        len--;
+    }
+    if (len >= sizeof(buf))
+        return FALSE;
+    for(i = 0; i < len; i++) {
+        if (label[i] >= 'A' && label[i] <= 'Z')
+            buf[i] = label[i] - 'A' + 'a';
+        else
+            buf[i] = label[i];
+    }
+    buf[len] = '\0';
+    for(p = utf8_labels; *p != '\0'; p += strlen(p) + 1) {
+        if (!strcmp(p, buf))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* return -1 if exception, 0 or 1 otherwise */
+static int js_get_bool_option(JSContext *ctx, JSValueConst options,
+                              const char *name)
+{
+    JSValue val;
+
+    if (JS_IsUndefined(options) || JS_IsNull(options))
+        return 0;
+    if (!JS_IsObject(options)) {
+        JS_ThrowTypeError(ctx, "options must be an object");
+        return -1;
+    }
+    val = JS_GetPropertyStr(ctx, options, name);
+    if (JS_IsException(val))
+        return -1;
+    return JS_ToBoolFree(ctx, val);
+}
+
+static JSValue js_text_decoder_constructor(JSContext *ctx,
+                                           JSValueConst new_target,
+                                           int argc, JSValueConst *argv)
+{
+    JSValueConst options;
+    JSTextDecoder *td;
+    JSValue obj;
+    const char *label;
+    size_t label_len;
+    int fatal, ignore_bom;
+    BOOL is_utf8;
+
+    is_utf8 = TRUE;
+    if (argc > 0 && !JS_IsUndefined(argv[0])) {
+        label = JS_ToCStringLen(ctx, &label_len, argv[0]);
+        if (!label)
+            return JS_EXCEPTION;
+        is_utf8 = is_utf8_label(label, label_len);
+        JS_FreeCString(ctx, label);
+    }
+    options = argc > 1 ? argv[1] : JS_UNDEFINED;
+    fatal = js_get_bool_option(ctx, options, "fatal");
+    if (fatal < 0)
+        return JS_EXCEPTION;
+    ignore_bom = js_get_bool_option(ctx, options, "ignoreBOM");
+    if (ignore_bom < 0)
+        return JS_EXCEPTION;
+    if (!is_utf8)
+        return JS_ThrowRangeError(ctx, "unsupported encoding");
+
+    obj = js_create_from_ctor(ctx, new_target, JS_CLASS_TEXT_DECODER);
+    if (JS_IsException(obj))
+        return obj;
+    td = js_mallocz(ctx, sizeof(*td));
+    if (!td) {
+        JS_FreeValue(ctx, obj);
+        return JS_EXCEPTION;
+    }
+    td->fatal = fatal;
+    td->ignore_bom = ignore_bom;
+    JS_SetOpaque(obj, td);
+    return obj;
+}
+
+static JSValue js_text_decoder_get(JSContext *ctx, JSValueConst this_val,
+                                   int magic)
+{
+    JSTextDecoder *td = JS_GetOpaque2(ctx, this_val, JS_CLASS_TEXT_DECODER);
+    if (!td)
+        return JS_EXCEPTION;
+    switch(magic) {
+    case 0:
+        return JS_NewString(ctx, "utf-8");
+    case 1:
+        return JS_NewBool(ctx, td->fatal);
+    default:
+        return JS_NewBool(ctx, td->ignore_bom);
+    }
+}
+
+/* The input bytes are decoded in place. In stream mode, a truncated
+   UTF-8 sequence at the end is kept for the next call. */
+static JSValue js_text_decoder_decode(JSContext *ctx, JSValueConst this_val,
+                                      int argc, JSValueConst *argv)
+{
+    JSTextDecoder *td;
+    const uint8_t *buf;
+    uint8_t tmp[4];
+    size_t len, end, k;
+    int64_t out_len;
+    uint32_t c_max, pos;
+    int stream, c0, n, tmp_len;
+    BOOL has_c0;
+    JSString *str;
+
+    td = JS_GetOpaque2(ctx, this_val, JS_CLASS_TEXT_DECODER);
+    if (!td)
+        return JS_EXCEPTION;
+    stream = js_get_bool_option(ctx, argc > 1 ? argv[1] : JS_UNDEFINED,
+                                "stream");
+    if (stream < 0)
+        return JS_EXCEPTION;
+    /* no JS code is called after getting the bytes */
+    buf = NULL;
+    len = 0;
+    if (argc > 0 && !JS_IsUndefined(argv[0])) {
+        if (js_get_buffer_source(ctx, argv[0], &buf, &len))
+            return JS_EXCEPTION;
+    }
+
+    if (!td->do_not_flush) {
+        td->pending_len = 0;
+        td->bom_seen = FALSE;
+    }
+    td->do_not_flush = stream;
+
+    /* complete the truncated sequence of the previous chunk */
+    has_c0 = FALSE;
+    c0 = 0;
+    if (td->pending_len > 0) {
+        k = sizeof(tmp) - td->pending_len;
+        if (k > len)
+            k = len;
+        memcpy(tmp, td->pending, td->pending_len);
+        /* 'buf' is NULL if there is no input */
+        if (k > 0)
+            memcpy(tmp + td->pending_len, buf, k);
+        tmp_len = td->pending_len + k;
+        c0 = utf8_decode_whatwg(tmp, tmp_len, &n);
+        if (c0 == -2 && stream) {
+            /* all the input bytes are in 'tmp' */
+            memcpy(td->pending, tmp, tmp_len);
+            td->pending_len = tmp_len;
+            return JS_AtomToString(ctx, JS_ATOM_empty_string);
+        }
+        if (c0 < 0) {
+            if (td->fatal)
+                goto fail;
+            c0 = 0xfffd;
+        }
+        /* the pending bytes are a prefix of a valid sequence */
+        if (n > td->pending_len) {
+            buf += n - td->pending_len;
+            len -= n - td->pending_len;
+        }
+        td->pending_len = 0;
+        has_c0 = TRUE;
+    }
+
+    /* skip the byte order mark */
+    if (has_c0) {
+        if (!td->ignore_bom && !td->bom_seen && c0 == 0xfeff)
+            has_c0 = FALSE;
+        td->bom_seen = TRUE;
+    }
+    if (!td->ignore_bom && !td->bom_seen && len >= 3 &&
+        buf[0] == 0xef && buf[1] == 0xbb && buf[2] == 0xbf) {
+        buf += 3;
+        len -= 3;
+        td->bom_seen = TRUE;
+    }
+
+    out_len = text_decoder_scan(buf, len, !stream, td->fatal, &end, &c_max);
+    if (out_len < 0)
+        goto fail;
+    if (end > 0)
+        td->bom_seen = TRUE;
+    if (end < len) {
+        td->pending_len = len - end;
+        memcpy(td->pending, buf + end, td->pending_len);
+    }
+
+    if (!has_c0) {
+        if (out_len == 0)
+            return JS_AtomToString(ctx, JS_ATOM_empty_string);
+        if (c_max < 0x80) {
+            /* ASCII: the decoded string is a copy of the input */
+            return js_new_string8_len(ctx, (const char *)buf, end);
+        }
+    } else {
+        c_max = max_uint32(c_max, c0);
+        out_len += 1 + (c0 >= 0x10000);
+    }
+    if (out_len > JS_STRING_LEN_MAX)
+        return JS_ThrowInternalError(ctx, "string too long");
+    str = js_alloc_string(ctx, out_len, c_max >= 0x100);
+    if (!str)
+        return JS_EXCEPTION;
+    pos = 0;
+    if (has_c0)
+        pos = text_decoder_put_char(str, pos, c0);
+    pos = text_decoder_write(str, pos, buf, end);
+    assert(pos == out_len);
+    if (!str->is_wide_char)
+        str->u.str8[pos] = '\0';
+    return JS_MKPTR(JS_TAG_STRING, str);
+ fail:
+    td->pending_len = 0;
+    td->do_not_flush = FALSE;
+    return JS_ThrowTypeError(ctx, "invalid UTF-8 data");
+}
+
+static const JSCFunctionListEntry js_text_decoder_proto_funcs[] = {
+    JS_CGETSET_MAGIC_DEF("encoding", js_text_decoder_get, NULL, 0 ),
+    JS_CGETSET_MAGIC_DEF("fatal", js_text_decoder_get, NULL, 1 ),
+    JS_CGETSET_MAGIC_DEF("ignoreBOM", js_text_decoder_get, NULL, 2 ),
+    JS_CFUNC_DEF("decode", 0, js_text_decoder_decode ),
+    JS_PROP_STRING_DEF("[Symbol.toStringTag]", "TextDecoder", JS_PROP_CONFIGURABLE ),
+};
+
+static const JSClassShortDef js_text_encoding_class_def[] = {
+    { JS_ATOM_TextEncoder, NULL, NULL }, /* JS_CLASS_TEXT_ENCODER */
+    { JS_ATOM_TextDecoder, js_text_decoder_finalizer, NULL }, /* JS_CLASS_TEXT_DECODER */
+};
+
+int JS_AddIntrinsicTextEncoding(JSContext *ctx)
+{
+    JSRuntime *rt = ctx->rt;
+    JSValue obj;
+
+    if (!JS_IsRegisteredClass(rt, JS_CLASS_TEXT_ENCODER)) {
+        if (init_class_range(rt, js_text_encoding_class_def, JS_CLASS_TEXT_ENCODER,
+                             countof(js_text_encoding_class_def)))
+            return -1;
+    }
+    obj = JS_NewCConstructor(ctx, JS_CLASS_TEXT_ENCODER, "TextEncoder",
+                             js_text_encoder_constructor, 0, JS_CFUNC_constructor, 0,
+                             JS_UNDEFINED,
+                             NULL, 0,
+                             js_text_encoder_proto_funcs, countof(js_text_encoder_proto_funcs),
+                             0);
+    if (JS_IsException(obj))
+        return -1;
+    JS_FreeValue(ctx, obj);
+
+    obj = JS_NewCConstructor(ctx, JS_CLASS_TEXT_DECODER, "TextDecoder",
+                             js_text_decoder_constructor, 0, JS_CFUNC_constructor, 0,
+                             JS_UNDEFINED,
+                             NULL, 0,
+                             js_text_decoder_proto_funcs, countof(js_text_decoder_proto_funcs),
+                             0);
+    if (JS_IsException(obj))
+        return -1;
+    JS_FreeValue(ctx, obj);
+    return 0;
+}
@@ -60,11 +60,14 @@ typedef uint32_t JSAtom;
 #define JS_PTR64_DEF(a)
 #endif
 
+/* NaN boxing is always used on 32 bit hosts. On 64 bit hosts, it can
+   be enabled by defining JS_NAN_BOXING. It then assumes that the
+   heap pointers fit in 47 bits (e.g. x86_64 Linux user space). */
 #ifndef JS_PTR64
 #define JS_NAN_BOXING
 #endif
 
-#if defined(__SIZEOF_INT128__) && (INTPTR_MAX >= INT64_MAX)
+#if defined(__SIZEOF_INT128__) && (INTPTR_MAX >= INT64_MAX) && !defined(JS_NAN_BOXING)
 #define JS_LIMB_BITS 64
 #else
 #define JS_LIMB_BITS 32
@@ -142,6 +145,86 @@ static inline JSValue __JS_NewShortBigInt(JSContext *ctx, int32_t d)
     return JS_MKVAL(JS_TAG_SHORT_BIG_INT, d);
 }
 
+#elif defined(JS_NAN_BOXING) && defined(JS_PTR64)
+
+typedef uint64_t JSValue;
+
+#define JSValueConst JSValue
+
+/* The tag is stored in the 17 upper bits and the pointer or integer
+   payload in the 47 lower bits. */
+#define JS_VALUE_PTR_BITS 47
+#define JS_VALUE_PTR_MASK (((uint64_t)1 << JS_VALUE_PTR_BITS) - 1)
+
+#define JS_VALUE_GET_TAG(v) (int)((int64_t)(v) >> JS_VALUE_PTR_BITS)
+#define JS_VALUE_GET_INT(v) (int)(v)
+#define JS_VALUE_GET_BOOL(v) (int)(v)
+#define JS_VALUE_GET_SHORT_BIG_INT(v) (int)(v)
+#define JS_VALUE_GET_PTR(v) (void *)(intptr_t)((v) & JS_VALUE_PTR_MASK)
+
+#define JS_MKVAL(tag, val) (((uint64_t)(tag) << JS_VALUE_PTR_BITS) | (uint32_t)(val))
+#define JS_MKPTR(tag, ptr) (((uint64_t)(tag) << JS_VALUE_PTR_BITS) | (uintptr_t)(ptr))
+
+/* the tags are mapped to the positive NaN encodings whose upper 17
+   bits are between 0xffe1 and 0xfff1 (0x7ff08... to 0x7ff88...). This
+   range contains both signaling and quiet NaNs, including the default
+   quiet NaN 0x7ff8000000000000, so __JS_NewFloat64() replaces any NaN
+   by JS_FLOAT64_CANONICAL_NAN which is outside of it. */
+#define JS_FLOAT64_TAG_ADDEND (0xffe1 - JS_TAG_FIRST)
+#define JS_FLOAT64_CANONICAL_NAN 0x7ffc000000000000
+
+static inline double JS_VALUE_GET_FLOAT64(JSValue v)
+{
+    union {
+        JSValue v;
+        double d;
+    } u;
+    u.v = v;
+    u.v += (uint64_t)JS_FLOAT64_TAG_ADDEND << JS_VALUE_PTR_BITS;
+    return u.d;
+}
+
+#define JS_NAN (JS_FLOAT64_CANONICAL_NAN - ((uint64_t)JS_FLOAT64_TAG_ADDEND << JS_VALUE_PTR_BITS))
+
+static inline JSValue __JS_NewFloat64(JSContext *ctx, double d)
+{
+    union {
+        double d;
+        uint64_t u64;
+    } u;
+    JSValue v;
+    u.d = d;
+    /* normalize NaN */
+    if (js_unlikely((u.u64 & 0x7fffffffffffffff) > 0x7ff0000000000000))
+        v = JS_NAN;
+    else
+        v = u.u64 - ((uint64_t)JS_FLOAT64_TAG_ADDEND << JS_VALUE_PTR_BITS);
+    return v;
+}
+
+#define JS_TAG_IS_FLOAT64(tag) ((unsigned)((tag) - JS_TAG_FIRST) >= (JS_TAG_FLOAT64 - JS_TAG_FIRST))
+
+/* same as JS_VALUE_GET_TAG, but return JS_TAG_FLOAT64 with NaN boxing */
+static inline int JS_VALUE_GET_NORM_TAG(JSValue v)
+{
+    int tag;
+    tag = JS_VALUE_GET_TAG(v);
+    if (JS_TAG_IS_FLOAT64(tag))
+        return JS_TAG_FLOAT64;
+    else
+        return tag;
+}
+
+static inline JS_BOOL JS_VALUE_IS_NAN(JSValue v)
+{
+    return v == JS_NAN;
+}
+
+static inline JSValue __JS_NewShortBigInt(JSContext *ctx, int32_t d)
+{
+    return JS_MKVAL(JS_TAG_SHORT_BIG_INT, d);
+}
+
 #elif defined(JS_NAN_BOXING)
 
 typedef uint64_t JSValue;
@@ -369,6 +452,9 @@ JSRuntime *JS_NewRuntime(void);
 void JS_SetRuntimeInfo(JSRuntime *rt, const char *info);
 void JS_SetMemoryLimit(JSRuntime *rt, size_t limit);
 void JS_SetGCThreshold(JSRuntime *rt, size_t gc_threshold);
+/* free the large memory blocks in a background thread. Return -1 if
+   not supported (only available with the default malloc functions) */
+int JS_SetBackgroundFree(JSRuntime *rt, JS_BOOL enable);
 /* use 0 to disable maximum stack size check */
 void JS_SetMaxStackSize(JSRuntime *rt, size_t stack_size);
 /* should be called when changing thread to update the stack top value
@@ -381,6 +467,89 @@ void JS_SetRuntimeOpaque(JSRuntime *rt, void *opaque);
 typedef void JS_MarkFunc(JSRuntime *rt, JSGCObjectHeader *gp);
 void JS_MarkValue(JSRuntime *rt, JSValueConst val, JS_MarkFunc *mark_func);
 void JS_RunGC(JSRuntime *rt);
+/* incremental cycle removal: examine about 'budget' objects,
+   including the recently allocated ones if they fit. The budget is an
+   object count, not a time limit. If JS_SetGCStepBudget() is used
+   with a non zero budget, the automatic GC does bounded steps, except
+   for the full collections done when the allocated memory has grown
+   by 'full_growth' percent (see JSGCParams): they are not bounded. A host which schedules the full collections itself
+   with JS_RunGC() can make them rare by setting a large
+   'full_growth'. */
+void JS_RunGCStep(JSRuntime *rt, int budget);
+void JS_SetGCStepBudget(JSRuntime *rt, int budget);
+
+/* automatic GC policy. After each automatic collection, the next one
+   is started when the allocated memory has grown by 'growth' percent.
+   'growth' is doubled when a collection frees less than 'low_yield'
+   percent of the examined objects and halved when it frees more than
+   'high_yield' percent. JS_SetGCParams() clamps the values: the
+   growths are between 1 and 100000 with min_growth <= max_growth and
+   the yields between 0 and 100 with low_yield <= high_yield. */
+typedef struct JSGCParams {
+    int min_growth; /* in percent (default = 50) */
+    int max_growth; /* in percent (default = 400) */
+    int low_yield; /* in percent (default = 1) */
+    int high_yield; /* in percent (default = 10) */
+    /* do a full collection when the allocated memory has grown by
+       this percentage since the last one (default = 100) */
+    int full_growth;
+} JSGCParams;
+
+typedef struct JSGCStats {
+    int64_t gc_count; /* number of collections */
+    int64_t full_gc_count; /* number of full collections */
+    int64_t examined_count; /* total number of examined GC objects */
+    int64_t freed_count; /* total number of GC objects freed in cycles */
+    int64_t gc_time; /* total time spent in the collections in us */
+    int64_t max_gc_time; /* longest collection in us */
+    /* last collection */
+    int64_t last_examined_count;
+    int64_t last_freed_count;
+    int64_t last_alloc_size; /* memory allocated since the previous one */
+    int64_t last_heap_size; /* allocated memory after it */
+    int64_t last_gc_time; /* in us */
+    /* current policy state */
+    int growth; /* in percent */
+    int64_t gc_threshold;
+} JSGCStats;
+
+void JS_SetGCParams(JSRuntime *rt, const JSGCParams *p);
+void JS_GetGCParams(JSRuntime *rt, JSGCParams *p);
+void JS_GetGCStats(JSRuntime *rt, JSGCStats *s);
+
+typedef enum JSGCReasonEnum {
+    JS_GC_REASON_ALLOC, /* automatic collection */
+    JS_GC_REASON_RUN_GC, /* JS_RunGC() */
+    JS_GC_REASON_STEP, /* JS_RunGCStep() */
+    JS_GC_REASON_FREE_RUNTIME, /* JS_FreeRuntime() */
+} JSGCReasonEnum;
+
+typedef enum JSGCEventEnum {
+    JS_GC_EVENT_START,
+    JS_GC_EVENT_END,
+} JSGCEventEnum;
+
+typedef struct JSGCEventInfo {
+    JSGCReasonEnum reason;
+    JS_BOOL young_only; /* only the recently allocated objects are examined */
+    int64_t heap_size_before; /* allocated memory before the collection */
+    /* the following fields are only set for JS_GC_EVENT_END */
+    int64_t heap_size_after;
+    int64_t examined_count; /* number of examined GC objects */
+    int64_t freed_count; /* number of GC objects freed in cycles */
+    /* duration of each phase in us */
+    int64_t weak_time; /* removal of the weak references to dead objects */
+    int64_t decref_time;
+    int64_t scan_time;
+    int64_t free_cycles_time;
+    int64_t total_time;
+} JSGCEventInfo;
+
+/* The callback is called at the start and at the end of each
+   collection. It must not allocate or free JS values. */
+typedef void JSGCCallback(JSRuntime *rt, JSGCEventEnum event,
+                          const JSGCEventInfo *info, void *opaque);
+void JS_SetGCCallback(JSRuntime *rt, JSGCCallback *cb, void *opaque);
 JS_BOOL JS_IsLiveObject(JSRuntime *rt, JSValueConst obj);
 
 JSContext *JS_NewContext(JSRuntime *rt);
@@ -407,6 +576,8 @@ int JS_AddIntrinsicMapSet(JSContext *ctx);
 int JS_AddIntrinsicTypedArrays(JSContext *ctx);
 int JS_AddIntrinsicPromise(JSContext *ctx);
 int JS_AddIntrinsicWeakRef(JSContext *ctx);
+/* TextEncoder and TextDecoder (not added by JS_NewContext()) */
+int JS_AddIntrinsicTextEncoding(JSContext *ctx);
 
 JSValue js_string_codePointRange(JSContext *ctx, JSValueConst this_val,
                                  int argc, JSValueConst *argv);
@@ -444,6 +615,25 @@ typedef struct JSMemoryUsage {
 
 void JS_ComputeMemoryUsage(JSRuntime *rt, JSMemoryUsage *s);
 void JS_DumpMemoryUsage(FILE *fp, const JSMemoryUsage *s, JSRuntime *rt);
+int JS_WriteHeapSnapshot(JSRuntime *rt, FILE *f);
+int JS_StartAllocationSampling(JSRuntime *rt, size_t interval);
+void JS_StopAllocationSampling(JSRuntime *rt);
+int JS_WriteAllocationProfile(JSRuntime *rt, FILE *f);
+int JS_StartProfiling(JSRuntime *rt);
+void JS_StopProfiling(JSRuntime *rt);
+void JS_ProfileTick(JSRuntime *rt);
+int JS_WriteCPUProfile(JSRuntime *rt, FILE *f);
+int JS_StartTracing(JSRuntime *rt, int max_events, int sample_rate,
+                    int64_t min_duration);
+void JS_StopTracing(JSRuntime *rt);
+int JS_WriteTrace(JSRuntime *rt, FILE *f);
+/* opcode statistics: only available if compiled with CONFIG_OPCODE_STATS */
+int JS_EnableOpcodeStats(JSRuntime *rt, JS_BOOL enable);
+void JS_ResetOpcodeStats(JSRuntime *rt);
+int64_t JS_GetOpcodeCount(JSRuntime *rt, int opcode);
+int64_t JS_GetOpcodePairCount(JSRuntime *rt, int opcode1, int opcode2);
+const char *JS_GetOpcodeName(int opcode);
+void JS_DumpOpcodeStats(JSRuntime *rt, FILE *fp);
 
 /* atom support */
 #define JS_ATOM_NULL 0
@@ -744,6 +934,29 @@ static inline JSValue JS_NewString(JSContext *ctx, const char *str)
     return JS_NewStringLen(ctx, str, strlen(str));
 }
 JSValue JS_NewAtomString(JSContext *ctx, const char *str);
+/* the characters of an external string are not copied */
+typedef void JSFreeExternalStringFunc(JSRuntime *rt, void *opaque, void *ptr);
+JSValue JS_NewExternalStringLatin1(JSContext *ctx, const uint8_t *buf,
+                                   size_t len,
+                                   JSFreeExternalStringFunc *free_func,
+                                   void *opaque);
+JSValue JS_NewExternalStringUTF16(JSContext *ctx, const uint16_t *buf,
+                                  size_t len,
+                                  JSFreeExternalStringFunc *free_func,
+                                  void *opaque);
+/* build a string without intermediate copies */
+typedef struct JSStringBuilder JSStringBuilder;
+JSStringBuilder *JS_NewStringBuilder(JSContext *ctx, size_t size_hint);
+int JS_StringBuilderPutc(JSStringBuilder *sb, uint32_t c);
+int JS_StringBuilderPutLatin1(JSStringBuilder *sb, const uint8_t *buf,
+                              size_t len);
+int JS_StringBuilderPutUTF16(JSStringBuilder *sb, const uint16_t *buf,
+                             size_t len);
+int JS_StringBuilderPutUTF8(JSStringBuilder *sb, const char *buf,
+                            size_t len);
+int JS_StringBuilderPutValue(JSStringBuilder *sb, JSValueConst val);
+JSValue JS_StringBuilderFinish(JSStringBuilder *sb);
+void JS_FreeStringBuilder(JSStringBuilder *sb);
 JSValue JS_ToString(JSContext *ctx, JSValueConst val);
 JSValue JS_ToPropertyKey(JSContext *ctx, JSValueConst val);
 const char *JS_ToCStringLen2(JSContext *ctx, size_t *plen, JSValueConst val1, JS_BOOL cesu8);
@@ -1361,6 +1361,117 @@ function string_to_float(n)
     return n;
 }
 
+/* UTF-8 conversions: the samples are about 64 KB of ASCII, Latin-1
+   and CJK text */
+var utf8_samples = {};
+
+function utf8_length(str)
+{
+    var i, c, len;
+    len = 0;
+    for(i = 0; i < str.length; i++) {
+        c = str.charCodeAt(i);
+        if (c < 0x80)
+            len += 1;
+        else if (c < 0x800)
+            len += 2;
+        else
+            len += 3; /* no surrogate pair in the samples */
+    }
+    return len;
+}
+
+function utf8_sample(kind)
+{
+    var s, str, words, i;
+    s = utf8_samples[kind];
+    if (s)
+        return s;
+    if (kind == "ascii")
+        words = [ "The", "quick", "brown", "fox", "jumps", "over", "the", "lazy", "dog." ];
+    else if (kind == "latin1")
+        words = [ "Où", "êtes-vous", "allé", "à", "Noël,", "déjà", "après", "l'été?" ];
+    else
+        words = [ "東京", "の", "天気", "は", "晴れ", "です。", "漢字", "かな" ];
+    str = "";
+    for(i = 0; str.length < 65536 / (kind == "cjk" ? 3 : 1); i++)
+        str += words[i % words.length] + (i % 12 == 11 ? "\n" : " ");
+    str = JSON.parse(JSON.stringify(str));
+    s = { str: str, len: utf8_length(str), bytes: null };
+    utf8_samples[kind] = s;
+    return s;
+}
+
+/* JS_NewStringLen() */
+function utf8_decode(n, kind)
+{
+    var s, f, filename, j;
+    s = utf8_sample(kind);
+    filename = "microbench-utf8.tmp";
+    f = std.open(filename, "w");
+    f.puts(s.str);
+    f.close();
+    for(j = 0; j < n; j++) {
+        global_res = std.loadFile(filename);
+    }
+    os.remove(filename);
+    return n * s.len;
+}
+
+function utf8_decode_ascii(n) { return utf8_decode(n, "ascii"); }
+function utf8_decode_latin1(n) { return utf8_decode(n, "latin1"); }
+function utf8_decode_cjk(n) { return utf8_decode(n, "cjk"); }
+
+/* JS_ToCStringLen2() */
+function utf8_encode(n, kind)
+{
+    var s, f, j;
+    s = utf8_sample(kind);
+    f = std.tmpfile();
+    for(j = 0; j < n; j++) {
+        f.seek(0, std.SEEK_SET);
+        f.puts(s.str);
+    }
+    f.close();
+    return n * s.len;
+}
+
+function utf8_encode_ascii(n) { return utf8_encode(n, "ascii"); }
+function utf8_encode_latin1(n) { return utf8_encode(n, "latin1"); }
+function utf8_encode_cjk(n) { return utf8_encode(n, "cjk"); }
+
+function text_decoder(n, kind)
+{
+    var s, d, j;
+    s = utf8_sample(kind);
+    if (!s.bytes)
+        s.bytes = new TextEncoder().encode(s.str);
+    d = new TextDecoder();
+    for(j = 0; j < n; j++) {
+        global_res = d.decode(s.bytes);
+    }
+    return n * s.len;
+}
+
+function text_decoder_ascii(n) { return text_decoder(n, "ascii"); }
+function text_decoder_latin1(n) { return text_decoder(n, "latin1"); }
+function text_decoder_cjk(n) { return text_decoder(n, "cjk"); }
+
+function text_encoder(n, kind)
+{
+    var s, e, j;
+    s = utf8_sample(kind);
+    e = new TextEncoder();
+    for(j = 0; j < n; j++) {
+        global_res = e.encode(s.str);
+    }
+    return n * s.len;
+}
+
+function text_encoder_ascii(n) { return text_encoder(n, "ascii"); }
+function text_encoder_latin1(n) { return text_encoder(n, "latin1"); }
+function text_encoder_cjk(n) { return text_encoder(n, "cjk"); }
+
 function load_result(filename)
 {
     var has_filename = filename;
@@ -1512,6 +1623,23 @@ function main(argc, argv, g)
         test_list.push(bigint64_arith);
         test_list.push(bigint256_arith);
     }
+    if (typeof std !== "undefined") {
+        /* UTF-8 conversions in the C API */
+        test_list.push(utf8_decode_ascii);
+        test_list.push(utf8_decode_latin1);
+        test_list.push(utf8_decode_cjk);
+        test_list.push(utf8_encode_ascii);
+        test_list.push(utf8_encode_latin1);
+        test_list.push(utf8_encode_cjk);
+    }
+    if (typeof TextEncoder === "function") {
+        test_list.push(text_decoder_ascii);
+        test_list.push(text_decoder_latin1);
+        test_list.push(text_decoder_cjk);
+        test_list.push(text_encoder_ascii);
+        test_list.push(text_encoder_latin1);
+        test_list.push(text_encoder_cjk);
+    }
     test_list.push(sort_bench);
 
     for (i = 1; i < argc;) {
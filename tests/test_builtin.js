@@ -234,7 +234,7 @@ function test_array()
 
 function test_string()
 {
-    var a;
+    var a, b, i;
     a = String("abc");
     assert(a.length, 3, "string");
     assert(a[1], "b", "string");
@@ -245,6 +245,28 @@ function test_string()
     assert(a.charAt(-1), "");
     assert(a.charAt(3), "");
 
+    /* shared one character strings */
+    a = "\u00e9t\u00e9";
+    assert("\u00e9"[0], "\u00e9");
+    assert(String.fromCharCode(0xff), "\u00ff");
+    assert(String.fromCharCode(0xff).charCodeAt(0), 0xff);
+    assert(a.charAt(0), "\u00e9");
+    assert(a.at(-1), "\u00e9");
+    assert(a.slice(1, 2), "t");
+    assert(a.substring(2), "\u00e9");
+    assert(a[0] === a[2], true);
+    b = a[0];
+    for(i = 0; i < 10; i++)
+        b += "x";
+    assert(b, "\u00e9xxxxxxxxxx");
+    assert(a[0], "\u00e9");
+    assert("\u00e9"[0].length, 1);
+    b = "t";
+    b += "\u00e9";
+    assert(b, "t\u00e9");
+    assert(a.charAt(1), "t");
+    assert(a, "\u00e9t\u00e9");
+
     a = "abcd";
     assert(a.substring(1, 3), "bc", "substring");
     a = String.fromCharCode(0x20ac);
@@ -260,6 +282,19 @@ function test_string()
     assert(a.codePointAt(0), 0x10ffff);
     assert(String.fromCodePoint(0x10ffff), a);
 
+    assert("Hello World 123".toLowerCase(), "hello world 123");
+    assert("Hello World 123".toUpperCase(), "HELLO WORLD 123");
+    assert("ÀÉÞ".toLowerCase(), "àéþ");
+    assert("straße".toUpperCase(), "STRASSE");
+    assert("\u00b5\u00ff".toUpperCase(), "\u039c\u0178");
+    assert("abc".normalize("NFD"), "abc");
+    assert("\u00e9".normalize("NFD"), "e\u0301");
+    assert("e\u0301".normalize(), "\u00e9");
+    assert("\u00bd".normalize("NFKC"), "1\u20442");
+    assert("a".localeCompare("b"), -1);
+    assert("b".localeCompare("a"), 1);
+    assert("\u00e9".localeCompare("e\u0301"), 0);
+
     assert("a".concat("b", "c"), "abc");
 
     assert("abcabc".indexOf("cab"), 2);
@@ -289,6 +324,14 @@ function test_string()
     assert("aaa".indexOf("", 3), 3);
     assert("aaa".indexOf("", 4), 3);
     assert("aaa".indexOf("", Infinity), 3);
+    assert("\u0100ab\u0100abc".indexOf("abc"), 4);
+    assert("abcab".indexOf("\u0100ab"), -1);
+    assert(("a".repeat(1000) + "b").indexOf("a".repeat(100) + "b"), 900);
+    assert(("ab".repeat(500) + "c").indexOf("ab".repeat(300) + "abc"), 398);
+    assert(("ab".repeat(500) + "c").indexOf("ab".repeat(501)), -1);
+    assert(("a".repeat(1000) + "b" + "a".repeat(60)).indexOf("a".repeat(50) + "b" + "a".repeat(50)), 950);
+    assert("a".repeat(1000).indexOf("a".repeat(50) + "b" + "a".repeat(50)), -1);
+    assert(("\u0100a".repeat(500) + "\u0100b").indexOf("\u0100a".repeat(200) + "\u0100b"), 600);
 
     assert("aaa".lastIndexOf("a"), 2);
     assert("aaa".lastIndexOf("a", NaN), 2);
@@ -385,6 +428,16 @@ function test_number()
     assert((1-2**-53).toString(12), "0.bbbbbbbbbbbbbba");
     assert((1000000000000000128).toString(), "1000000000000000100");
     assert((1000000000000000128).toFixed(0), "1000000000000000128");
+    /* cached conversions */
+    assert(String(1023), "1023");
+    assert(String(1024), "1024");
+    assert(String(-0), "0");
+    assert(String(1023 / 2), "511.5");
+    assert(String(1023 / 2), "511.5");
+    assert((10).toString(), "10");
+    assert((10).toString(2), "1010");
+    assert((0.1).toString(), "0.1");
+    assert((0.5).toString(2), "0.1");
     assert((25).toExponential(0), "3e+1");
     assert((-25).toExponential(0), "-3e+1");
     assert((2.5).toPrecision(1), "3");
@@ -581,6 +634,59 @@ function assert_json_error(str, line_num, col_num)
     }
 }
 
+function test_text_encoding()
+{
+    var te, td, a, r, s, i;
+
+    te = new TextEncoder();
+    assert(te.encoding, "utf-8");
+    a = te.encode("a\u00e9\u20ac\ud83d\ude00\ud800x");
+    assert(a instanceof Uint8Array, true);
+    assert(a.join(","), "97,195,169,226,130,172,240,159,152,128,239,191,189,120");
+    assert(te.encode().length, 0);
+
+    a = new Uint8Array(5);
+    r = te.encodeInto("a\u20acb", a);
+    assert(r.read, 3);
+    assert(r.written, 5);
+    assert(a.join(","), "97,226,130,172,98");
+    r = te.encodeInto("\ud83d\ude00", new Uint8Array(3));
+    assert(r.read, 0);
+    assert(r.written, 0);
+
+    td = new TextDecoder();
+    assert(td.encoding, "utf-8");
+    assert(td.fatal, false);
+    assert(td.ignoreBOM, false);
+    assert(td.decode(new Uint8Array([0xef, 0xbb, 0xbf, 0x61, 0xe2, 0x82, 0xac])), "a\u20ac");
+    assert(td.decode(new Uint8Array([0x61, 0xe9]).buffer), "a\ufffd");
+    assert(td.decode(new DataView(new Uint8Array([0x61, 0x62, 0x63]).buffer, 1)), "bc");
+    /* one replacement character per maximal subpart */
+    assert(td.decode(new Uint8Array([0xf0, 0x9f, 0x41, 0xed, 0xa0, 0x80, 0xc0])),
+           "\ufffdA\ufffd\ufffd\ufffd\ufffd");
+    assert(new TextDecoder("utf-8", { ignoreBOM: true }).decode(new Uint8Array([0xef, 0xbb, 0xbf])), "\ufeff");
+    assert(new TextDecoder(" UTF8 ").encoding, "utf-8");
+    assert_throws(RangeError, () => new TextDecoder("latin1"));
+    assert_throws(TypeError, () => new TextDecoder("utf-8", { fatal: true }).decode(new Uint8Array([0xff])));
+
+    /* streaming: the sequences are split between the chunks */
+    a = te.encode("\ufeffx\u20ac\ud83d\ude00\u00e9");
+    s = "";
+    for(i = 0; i < a.length; i++)
+        s += td.decode(a.subarray(i, i + 1), { stream: true });
+    s += td.decode();
+    assert(s, "x\u20ac\ud83d\ude00\u00e9");
+    assert(td.decode(new Uint8Array([0xe2, 0x82]), { stream: true }), "");
+    assert(td.decode(), "\ufffd");
+    assert(new TextDecoder().decode(), "");
+    assert(td.decode(new Uint8Array([0x61, 0xf0, 0x9f]), { stream: true }), "a");
+    assert(td.decode(undefined, { stream: false }), "\ufffd");
+    assert(td.decode(), "");
+
+    s = "h\u00e9llo \u20ac\ud83d\ude00 ".repeat(1000);
+    assert(td.decode(te.encode(s)), s);
+}
+
 function test_json()
 {
     var a, s;
@@ -856,6 +962,9 @@ function test_map1(key_type, n)
         case "object":
             o = { id: i };
             break;
+        case "string":
+            o = "key" + i;
+            break;
         default:
             assert(false);
         }
@@ -881,7 +990,7 @@ function test_map1(key_type, n)
 
 function test_map()
 {
-    var a, i, n, tab, o, v;
+    var a, i, n, tab, o, v, s;
     n = 1000;
 
     a = new Map();
@@ -897,7 +1006,19 @@ function test_map()
     assert(a.get(1n), 1n);
     assert(a.get(2n**1000n - (2n**1000n - 1n)), 1n);
 
+    /* the hash of a string does not depend on its representation */
+    s = "";
+    for(i = 0; i < 1000; i++)
+        s = s + "ab\u00e9" + i;
+    a.set(s, 2);
+    assert(a.get(s.split("").join("")), 2);
+    a.set("abcdefgh", 3);
+    assert(a.get(["\u4e2d", "abcdefgh"].join("").substring(1)), 3);
+    assert(a.get("abcdefg"), undefined);
+    assert(a.get("abcdefgh\0"), undefined);
+
     test_map1("object", n);
+    test_map1("string", n);
     test_map1("small_bigint", n);
     test_map1("bigint", n);
 }
@@ -998,6 +1119,16 @@ function test_finalization_registry()
             assert(actual, expected);
         }, 0);
     }
+    {
+        let actual;
+        let finrec = new FinalizationRegistry(v => { actual = v });
+        let o = {};
+        finrec.register(o, 3, o); /* the target is also the token */
+        o = null;
+        os.setTimeout(() => {
+            assert(actual, 3);
+        }, 0);
+    }
     std.gc();
 }
 
@@ -1080,10 +1211,92 @@ function rope_concat(n, dir)
     }
 }
 
+function string_append()
+{
+    var s, t, i, o;
+
+    /* the appended string must not be visible through other references */
+    s = "ab";
+    s += "c";
+    t = s;
+    s += "d";
+    assert(t, "abc");
+    assert(s, "abcd");
+
+    /* the right side modifies the variable */
+    s = "x";
+    s += (function() { s = "y"; return "z"; })();
+    assert(s, "xz");
+
+    /* self append and 8 to 16 bit conversion */
+    s = "a";
+    for(i = 0; i < 3; i++)
+        s += s;
+    assert(s, "aaaaaaaa");
+    s += "\u00e9";
+    s += "\u4e2d";
+    s += "b";
+    assert(s, "aaaaaaaa\u00e9\u4e2db");
+
+    o = { x: "12" };
+    s = "";
+    for(i = 0; i < 1000; i++) {
+        s += o.x + i;
+        if (i == 500)
+            t = s;
+    }
+    assert(s.length, 2 * 1000 + 10 + 90 * 2 + 900 * 3);
+    assert(t.length, 2 * 501 + 10 + 90 * 2 + 401 * 3);
+    assert(s.startsWith(t), true);
+    assert(s.substring(s.length - 5), "12999");
+}
+
+/* string functions working directly on ropes */
+function rope_ops()
+{
+    var s, ref, i, c, len;
+
+    s = "";
+    for(i = 0; i < 2000; i++)
+        s = s + "ab\u00e9" + i + "\ud83d\ude00";
+    ref = s.split("").join("");
+    s = "";
+    for(i = 0; i < 2000; i++)
+        s = s + "ab\u00e9" + i + "\ud83d\ude00";
+    len = ref.length;
+    assert(s.length, len);
+    for(i = 0; i < len; i += 7) {
+        if (s.charCodeAt(i) !== ref.charCodeAt(i) ||
+            s[i] !== ref[i] ||
+            s.codePointAt(i) !== ref.codePointAt(i)) {
+            assert(s.charCodeAt(i), ref.charCodeAt(i));
+        }
+    }
+    assert(s.at(-1), ref.at(-1));
+    assert(s.charAt(5), ref.charAt(5));
+    assert(s.slice(1000, 9000), ref.slice(1000, 9000));
+    assert(s.slice(-13), ref.slice(-13));
+    assert(s.substring(7000, 3), ref.substring(3, 7000));
+    assert(s.substr(5000, 11), ref.substr(5000, 11));
+    assert(s.startsWith(ref.substring(4000, 5000), 4000), true);
+    assert(s.startsWith("ab\u00e91999", 4000), false);
+    assert(s.endsWith("1999\ud83d\ude00"), true);
+    assert(s.endsWith(ref.substring(100, 6000), 6000), true);
+    assert(s.endsWith("x", 6000), false);
+    c = [];
+    for(i of s)
+        c.push(i);
+    assert(c.length, len - 2000);
+    assert(c[c.length - 1], "\ud83d\ude00");
+    assert(c.join(""), ref);
+}
+
 function test_rope()
 {
     rope_concat(100000, 1);
     rope_concat(100000, -1);
+    string_append();
+    rope_ops();
 }
 
 function eval_error(eval_str, expected_error, level)
@@ -1179,6 +1392,7 @@ test_math();
 test_number();
 test_eval();
 test_typed_array();
+test_text_encoding();
 test_json();
 test_date();
 test_regexp();
@@ -0,0 +1,76 @@
+/* run with "qjs --cpu-prof file tests/test_cpu_prof.js" then check
+   the profile with "qjs tests/test_cpu_prof.js file" */
+import * as std from "std";
+
+function assert(actual, expected, message) {
+    if (arguments.length == 1)
+        expected = true;
+
+    if (actual === expected)
+        return;
+
+    throw Error("assertion failed: got |" + actual + "|" +
+                ", expected |" + expected + "|" +
+                (message ? " (" + message + ")" : ""));
+}
+
+/* pure JS code without backward branches between native calls */
+function leaf(x)
+{
+    return Math.sqrt(x) + x * x - x / 3 + (x | 0) % 7 + x * 0.5 -
+        (x ^ 5) + ((x * 3) >> 1) - (x & 255) * 2 + (x | 17) % 13;
+}
+
+function driver()
+{
+    var s = 0, i;
+    for(i = 0; i < 100000; i++)
+        s += leaf(i);
+    return s;
+}
+
+/* the comparator is called from a C function */
+function cmp(a, b)
+{
+    var x = a * 3 + b * 5 - (a ^ b) + (a & 7) * (b | 3) - a / 7 +
+        (b % 11) * 2 - (a >> 2) + (b << 1) - (a * b) % 17;
+    return a - b + x * 0;
+}
+
+function run(duration)
+{
+    var t = Date.now(), tab = [], i;
+    for(i = 0; i < 2000; i++)
+        tab.push((i * 7919) % 10007);
+    while (Date.now() - t < duration) {
+        driver();
+        tab.slice().sort(cmp);
+    }
+}
+
+function hit_counts(filename)
+{
+    var prof = JSON.parse(std.loadFile(filename));
+    var counts = {}, n, name;
+    for(n of prof.nodes) {
+        name = n.callFrame.functionName;
+        counts[name] = (counts[name] || 0) + n.hitCount;
+    }
+    return counts;
+}
+
+function check(filename)
+{
+    var c = hit_counts(filename);
+    var get = (name) => c[name] || 0;
+    /* the JS functions dominate the native functions they call */
+    assert(get("leaf") > 2 * get("sqrt"), true,
+           "leaf=" + get("leaf") + " sqrt=" + get("sqrt"));
+    assert(get("cmp") > get("sort"), true,
+           "cmp=" + get("cmp") + " sort=" + get("sort"));
+}
+
+if (scriptArgs.length > 1)
+    check(scriptArgs[1]);
+else
+    run(1000);
@@ -0,0 +1,89 @@
+/* run with a small --gc-step-budget so that the automatic GC does
+   bounded steps */
+
+function assert(actual, expected, message) {
+    if (arguments.length == 1)
+        expected = true;
+
+    if (actual === expected)
+        return;
+
+    if (actual !== null && expected !== null
+    &&  typeof actual == 'object' && typeof expected == 'object'
+    &&  actual.toString() === expected.toString())
+        return;
+
+    throw Error("assertion failed: got |" + actual + "|" +
+                ", expected |" + expected + "|" +
+                (message ? " (" + message + ")" : ""));
+}
+
+/* allocate short lived cycles so that the automatic GC runs */
+function alloc_garbage(n)
+{
+    var i, o;
+    for(i = 0; i < n; i++) {
+        o = {};
+        o.self = o;
+    }
+}
+
+/* the small cycles are freed by the bounded steps */
+function test_small_cycles()
+{
+    var n = 1000, i, a, b, tab = [];
+
+    for(i = 0; i < n; i++) {
+        a = {};
+        b = { a };
+        a.b = b;
+        tab.push(new WeakRef(a));
+    }
+    a = b = null;
+    /* the old cycles are only found when the steps reach them */
+    alloc_garbage(100 * n);
+    for(i = 0; i < n; i++)
+        assert(tab[i].deref(), undefined, "small cycles");
+}
+
+/* the cycles larger than the budget are only freed by the full
+   collections, which are done when the allocated memory has grown
+   enough */
+function test_large_cycle()
+{
+    var n = 100000, i, head, p, w, tab = [];
+
+    head = {};
+    p = head;
+    for(i = 0; i < n; i++) {
+        p.next = {};
+        p = p.next;
+    }
+    p.next = head;
+    w = new WeakRef(head);
+    head = p = null;
+    for(i = 0; i < 4 * n; i++)
+        tab.push({});
+    assert(w.deref(), undefined, "large cycle");
+}
+
+/* the objects referenced from outside the examined subset are kept */
+function test_live_objects()
+{
+    var n = 10000, i, tab = [], o;
+
+    for(i = 0; i < n; i++) {
+        o = { id: i };
+        o.self = o;
+        tab.push(o);
+    }
+    alloc_garbage(10 * n);
+    for(i = 0; i < n; i++) {
+        assert(tab[i].id, i);
+        assert(tab[i].self, tab[i]);
+    }
+}
+
+test_small_cycles();
+test_large_cycle();
+test_live_objects();
@@ -126,6 +126,34 @@ function test_popen()
     os.remove(fname);
 }
 
+/* readAsString() decodes the file by chunks: the result must not
+   depend on the position of the UTF-8 sequences */
+function test_read_utf8()
+{
+    var f, i, j, k, buf, seq, fname = "tmp_file.txt";
+    var seqs = [ [ 0xe2, 0x82, 0xac ], [ 0xf0, 0x9f, 0x98, 0x80 ],
+                 [ 0x80, 0xdf, 0x90, 0xed ], [ 0x80, 0xff ],
+                 [ 0xed, 0xa0, 0x80, 0x41 ], [ 0xc0, 0x80, 0xc3 ],
+                 [ 0xf8, 0x88, 0x80, 0x80, 0x80, 0x41 ],
+                 [ 0xe2, 0x82, 0x41, 0x80, 0x80, 0xc3 ] ];
+    for(i = 0; i < seqs.length; i++) {
+        seq = seqs[i];
+        for(k = 4096 - seq.length; k <= 4096; k++) {
+            buf = new Uint8Array(k + seq.length);
+            buf.fill(0x61);
+            for(j = 0; j < seq.length; j++)
+                buf[k + j] = seq[j];
+            f = std.open(fname, "w");
+            f.write(buf.buffer, 0, buf.length);
+            f.close();
+            f = std.open(fname, "r");
+            assert(f.readAsString(), std.loadFile(fname));
+            f.close();
+        }
+    }
+    os.remove(fname);
+}
+
 function test_ext_json()
 {
     var expected, input, obj;
@@ -327,6 +355,7 @@ test_file1();
 test_file2();
 test_getline();
 test_popen();
+test_read_utf8();
 test_os();
 test_os_exec();
 test_timer();